@@ -5,15 +5,245 @@
 #include <algorithm>
 #include <cctype>
 #include <sstream>
-#include <map>
+#include <unordered_map>
+#include <filesystem>
+#include <functional>
+#include <cstdint>
 
 using namespace std;
 
+// How far into the database file an in-memory structure has read. The user
+// index and the username filter each follow the file with one of these.
+struct DatabasePosition {
+    uintmax_t parsedBytes = 0;
+    filesystem::file_time_type writeTime;
+    string lastLine;                // last parsed line, to tell an append from a rewrite
+    bool endsMidLine = false;       // the file did not end with a newline when last parsed
+};
+
+// Here we check that the bytes parsed last time are still where we left them
+bool isParsedPrefixUnchanged(ifstream& databaseFile, const DatabasePosition& position) {
+    if (position.endsMidLine) return false;
+    string expectedTail = position.lastLine + "\n";
+    string actualTail(expectedTail.size(), '\0');
+    databaseFile.seekg(position.parsedBytes - expectedTail.size());
+    databaseFile.read(&actualTail[0], expectedTail.size());
+    databaseFile.clear();
+    return actualTail == expectedTail;
+}
+
+// Here we bring a reader up to date with the database file, which other
+// programs may have changed. Lines appended since position are passed to onUser
+// on their own. Anything else (a shorter file, a rewrite, an edited line) calls
+// onRestart with the file size and then passes every line again.
+void readDatabaseChanges(const string& databasePath, const string& delimiter, DatabasePosition& position,
+                         const function<void(uintmax_t)>& onRestart,
+                         const function<void(const string&, const string&)>& onUser) {
+    error_code statusError;
+    uintmax_t currentBytes = filesystem::file_size(databasePath, statusError);
+    if (statusError) {
+        // No file means no users
+        if (position.parsedBytes > 0 || position.endsMidLine) onRestart(0);
+        position = DatabasePosition();
+        return;
+    }
+    filesystem::file_time_type currentWriteTime = filesystem::last_write_time(databasePath, statusError);
+    if (currentBytes == position.parsedBytes && currentWriteTime == position.writeTime) {
+        return;
+    }
+    
+    ifstream databaseFile(databasePath, ios::binary);
+    if (!databaseFile.is_open()) {
+        return; // Keep what we have until the file can be read again
+    }
+    
+    bool appendedOnly = position.parsedBytes > 0 && currentBytes > position.parsedBytes &&
+                        isParsedPrefixUnchanged(databaseFile, position);
+    if (!appendedOnly) {
+        position = DatabasePosition();
+        onRestart(currentBytes);
+    }
+    databaseFile.seekg(position.parsedBytes);
+    
+    string currentLine;
+    while (getline(databaseFile, currentLine)) {
+        position.parsedBytes += currentLine.size();
+        position.endsMidLine = databaseFile.eof();
+        if (!position.endsMidLine) position.parsedBytes++;
+        position.lastLine = currentLine;
+        
+        // Lines written on Windows end in "\r\n"
+        if (!currentLine.empty() && currentLine.back() == '\r') currentLine.pop_back();
+        if (currentLine.empty()) continue;
+        
+        size_t delimiterPosition = currentLine.find(delimiter);
+        if (delimiterPosition != string::npos) {
+            onUser(currentLine.substr(0, delimiterPosition), currentLine.substr(delimiterPosition + 1));
+        }
+    }
+    position.writeTime = currentWriteTime;
+}
+
+// Bloom filter over every registered username. A name it has never seen is
+// reported as absent for certain; a name it has seen (or, about 1% of the time,
+// one it has not) has to be confirmed against the user index. It is saved to a
+// file together with the DatabasePosition it covers, so a restart only hashes
+// the users added after that.
+class UsernameBloomFilter {
+private:
+    static const uint32_t HASH_COUNT = 7;
+    static const uint64_t BITS_PER_USER = 10;
+    static const uint64_t MINIMUM_BITS = 1 << 16;
+    static constexpr char FILE_MAGIC[8] = {'U', 'S', 'R', 'B', 'L', 'O', 'O', 'M'};
+    
+    vector<uint64_t> bitWords;
+    uint64_t bitCount = 0;          // a power of two, so a bit is picked with a mask
+    uint64_t userCount = 0;         // names added, duplicates included
+    
+    // FNV-1a, then mixed so both halves are usable; it must not change, since the bits are saved
+    static uint64_t hashUsername(const string& username) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (char character : username) {
+            hash ^= (unsigned char)character;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+    
+    // Here we derive the HASH_COUNT bit positions from one hash (double hashing)
+    template <typename BitVisitor>
+    void forEachBit(const string& username, BitVisitor visitBit) const {
+        uint64_t hash = hashUsername(username);
+        uint64_t step = (hash >> 32) | 1;
+        for (uint32_t i = 0; i < HASH_COUNT; i++) {
+            uint64_t bit = (hash + i * step) & (bitCount - 1);
+            if (!visitBit(bit / 64, (uint64_t)1 << (bit % 64))) return;
+        }
+    }
+    
+public:
+    // Starts empty but usable, so checks work before any database file exists
+    UsernameBloomFilter() {
+        reset(0);
+    }
+    
+    void reset(uint64_t expectedUsers) {
+        bitCount = MINIMUM_BITS;
+        while (bitCount < expectedUsers * BITS_PER_USER) bitCount *= 2;
+        bitWords.assign(bitCount / 64, 0);
+        userCount = 0;
+    }
+    
+    void add(const string& username) {
+        forEachBit(username, [&](uint64_t word, uint64_t mask) { bitWords[word] |= mask; return true; });
+        userCount++;
+    }
+    
+    bool mightContain(const string& username) const {
+        bool allSet = true;
+        forEachBit(username, [&](uint64_t word, uint64_t mask) {
+            allSet = (bitWords[word] & mask) != 0;
+            return allSet;
+        });
+        return allSet;
+    }
+    
+    // More names than it was sized for: false positives climb, so it should be rebuilt bigger
+    bool isOverloaded() const {
+        return userCount * BITS_PER_USER > bitCount;
+    }
+    
+    uint64_t getUserCount() const {
+        return userCount;
+    }
+    
+    // Here we write a new file and rename it over the old one, so a crash never leaves half a filter
+    bool save(const string& filterPath, const DatabasePosition& position) const {
+        string temporaryPath = filterPath + ".tmp";
+        ofstream filterFile(temporaryPath, ios::binary | ios::trunc);
+        if (!filterFile.is_open()) return false;
+        
+        int64_t writeTicks = position.writeTime.time_since_epoch().count();
+        uint64_t parsedBytes = position.parsedBytes;
+        uint32_t lastLineLength = (uint32_t)position.lastLine.size();
+        uint8_t endsMidLine = position.endsMidLine ? 1 : 0;
+        filterFile.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+        filterFile.write(reinterpret_cast<const char*>(&bitCount), sizeof(bitCount));
+        filterFile.write(reinterpret_cast<const char*>(&userCount), sizeof(userCount));
+        filterFile.write(reinterpret_cast<const char*>(&parsedBytes), sizeof(parsedBytes));
+        filterFile.write(reinterpret_cast<const char*>(&writeTicks), sizeof(writeTicks));
+        filterFile.write(reinterpret_cast<const char*>(&endsMidLine), sizeof(endsMidLine));
+        filterFile.write(reinterpret_cast<const char*>(&lastLineLength), sizeof(lastLineLength));
+        filterFile.write(position.lastLine.data(), lastLineLength);
+        filterFile.write(reinterpret_cast<const char*>(bitWords.data()), bitWords.size() * sizeof(uint64_t));
+        filterFile.close();
+        if (!filterFile) return false;
+        
+        error_code renameError;
+        filesystem::rename(temporaryPath, filterPath, renameError);
+        return !renameError;
+    }
+    
+    // Leaves the filter and position untouched unless the whole file reads back cleanly
+    bool load(const string& filterPath, DatabasePosition& position) {
+        ifstream filterFile(filterPath, ios::binary);
+        if (!filterFile.is_open()) return false;
+        
+        char magic[sizeof(FILE_MAGIC)];
+        uint64_t savedBitCount = 0, savedUserCount = 0, parsedBytes = 0;
+        int64_t writeTicks = 0;
+        uint8_t endsMidLine = 0;
+        uint32_t lastLineLength = 0;
+        filterFile.read(magic, sizeof(magic));
+        filterFile.read(reinterpret_cast<char*>(&savedBitCount), sizeof(savedBitCount));
+        filterFile.read(reinterpret_cast<char*>(&savedUserCount), sizeof(savedUserCount));
+        filterFile.read(reinterpret_cast<char*>(&parsedBytes), sizeof(parsedBytes));
+        filterFile.read(reinterpret_cast<char*>(&writeTicks), sizeof(writeTicks));
+        filterFile.read(reinterpret_cast<char*>(&endsMidLine), sizeof(endsMidLine));
+        filterFile.read(reinterpret_cast<char*>(&lastLineLength), sizeof(lastLineLength));
+        if (!filterFile || !equal(magic, magic + sizeof(magic), FILE_MAGIC) || savedBitCount < MINIMUM_BITS ||
+            (savedBitCount & (savedBitCount - 1)) != 0 || savedBitCount > ((uint64_t)1 << 40) ||
+            lastLineLength > parsedBytes || lastLineLength > (1 << 20)) {
+            return false;
+        }
+        
+        string lastLine(lastLineLength, '\0');
+        vector<uint64_t> savedWords(savedBitCount / 64);
+        filterFile.read(&lastLine[0], lastLineLength);
+        filterFile.read(reinterpret_cast<char*>(savedWords.data()), savedWords.size() * sizeof(uint64_t));
+        if (!filterFile) return false;
+        
+        bitWords.swap(savedWords);
+        bitCount = savedBitCount;
+        userCount = savedUserCount;
+        position.parsedBytes = parsedBytes;
+        position.writeTime = filesystem::file_time_type(filesystem::file_time_type::duration(writeTicks));
+        position.lastLine = lastLine;
+        position.endsMidLine = endsMidLine != 0;
+        return true;
+    }
+};
+
 class UserAuthenticationSystem {
 private:
     const string DATABASE_FILE = "users_database.txt";
     const string DELIMITER = "|";
     
+    const string FILTER_FILE = "users_database.bloom";
+    
+    // Resident copy of the database, keyed by username. It is loaded the first
+    // time it is needed and then kept up to date by parsing only new lines.
+    unordered_map<string, string> usersIndex;
+    DatabasePosition indexPosition;
+    
+    // Every username, for ruling out new names without loading usersIndex
+    UsernameBloomFilter usernameFilter;
+    DatabasePosition filterPosition;
+    bool filterChanged = false;     // not saved to FILTER_FILE yet
+    
     string hashPassword(const string& plainPassword) {
         string hashedPassword = "";
         for (char character : plainPassword) {
@@ -85,53 +315,37 @@ private:
         return true;
     }
     
+    // Here we let the filter answer for names it has never seen; only a hit needs the index
     bool isUsernameExists(const string& username) {
-        ifstream databaseFile(DATABASE_FILE);
-        string currentLine;
-        
-        if (!databaseFile.is_open()) {
-            return false; 
-        }
-        
-        while (getline(databaseFile, currentLine)) {
-            if (currentLine.empty()) continue;
-            
-            size_t delimiterPosition = currentLine.find(DELIMITER);
-            if (delimiterPosition != string::npos) {
-                string existingUsername = currentLine.substr(0, delimiterPosition);
-                if (existingUsername == username) {
-                    databaseFile.close();
-                    return true;
-                }
-            }
+        refreshUsernameFilter();
+        if (!usernameFilter.mightContain(username)) {
+            return false;
         }
-        
-        databaseFile.close();
-        return false;
+        refreshUserIndex();
+        return usersIndex.find(username) != usersIndex.end();
     }
     
-    map<string, string> loadUsersFromDatabase() {
-        map<string, string> usersDatabase;
-        ifstream databaseFile(DATABASE_FILE);
-        string currentLine;
-        
-        if (!databaseFile.is_open()) {
-            return usersDatabase; // Return empty map if file doesn't exist
-        }
-        
-        while (getline(databaseFile, currentLine)) {
-            if (currentLine.empty()) continue;
-            
-            size_t delimiterPosition = currentLine.find(DELIMITER);
-            if (delimiterPosition != string::npos) {
-                string storedUsername = currentLine.substr(0, delimiterPosition);
-                string storedHashedPassword = currentLine.substr(delimiterPosition + 1);
-                usersDatabase[storedUsername] = storedHashedPassword;
-            }
+    void refreshUserIndex() {
+        readDatabaseChanges(DATABASE_FILE, DELIMITER, indexPosition,
+            [&](uintmax_t) { usersIndex.clear(); },
+            [&](const string& username, const string& hashedPassword) { usersIndex[username] = hashedPassword; });
+    }
+    
+    void refreshUsernameFilter() {
+        if (usernameFilter.isOverloaded()) {
+            filterPosition = DatabasePosition(); // Rebuilt bigger from the whole file below
         }
-        
-        databaseFile.close();
-        return usersDatabase;
+        uint64_t previousUsers = usernameFilter.getUserCount();
+        readDatabaseChanges(DATABASE_FILE, DELIMITER, filterPosition,
+            [&](uintmax_t fileBytes) {
+                // No line is shorter than about 24 bytes, so this never undersizes the filter
+                usernameFilter.reset(max<uint64_t>(fileBytes / 24, previousUsers * 2));
+                filterChanged = true;
+            },
+            [&](const string& username, const string&) {
+                usernameFilter.add(username);
+                filterChanged = true;
+            });
     }
     
     bool saveUserToDatabase(const string& username, const string& hashedPassword) {
@@ -142,12 +356,28 @@ private:
             return false;
         }
         
+        // Here we finish a last line someone left without a newline, so ours stays separate
+        if (filterPosition.endsMidLine) databaseFile << "\n";
         databaseFile << username << DELIMITER << hashedPassword << "\n";
         databaseFile.close();
+        
+        refreshUsernameFilter(); // Hashes just the line we wrote; the index catches up when next used
         return true;
     }
     
 public:
+    
+    UserAuthenticationSystem() {
+        // A saved filter only needs the users added since it was written; without one it is built from the file
+        usernameFilter.load(FILTER_FILE, filterPosition);
+        refreshUsernameFilter();
+    }
+    
+    ~UserAuthenticationSystem() {
+        if (filterChanged) {
+            usernameFilter.save(FILTER_FILE, filterPosition);
+        }
+    }
    
     bool registerUser() {
         string inputUsername, inputPassword, confirmPassword;
@@ -228,21 +458,22 @@ public:
             return false;
         }
         
-        map<string, string> usersDatabase = loadUsersFromDatabase();
+        refreshUserIndex();
         
-        if (usersDatabase.empty()) {
+        if (usersIndex.empty()) {
             cout << "Error: No users found. Please register first.\n";
             return false;
         }
         
-        if (usersDatabase.find(inputUsername) == usersDatabase.end()) {
+        auto storedUser = usersIndex.find(inputUsername);
+        if (storedUser == usersIndex.end()) {
             cout << "Error: Username '" << inputUsername << "' not found.\n";
             return false;
         }
         
         // Here we verify password
         string hashedInputPassword = hashPassword(inputPassword);
-        string storedHashedPassword = usersDatabase[inputUsername];
+        const string& storedHashedPassword = storedUser->second;
         
         if (hashedInputPassword == storedHashedPassword) {
             cout << "\nSuccess: Login successful! Welcome, " << inputUsername << "!\n";
@@ -256,19 +487,27 @@ public:
     
     // Here we display all registered users for admin purposes
     void displayAllUsers() {
-        map<string, string> usersDatabase = loadUsersFromDatabase();
+        refreshUserIndex();
         
         cout << "\n" << string(40, '=') << "\n";
         cout << "           REGISTERED USERS\n";
         cout << string(40, '=') << "\n";
         
-        if (usersDatabase.empty()) {
+        if (usersIndex.empty()) {
             cout << "No users registered yet.\n";
         } else {
-            cout << "Total users: " << usersDatabase.size() << "\n\n";
+            cout << "Total users: " << usersIndex.size() << "\n\n";
+            // The index has no order, so we sort the names for display
+            vector<const string*> sortedUsernames;
+            sortedUsernames.reserve(usersIndex.size());
+            for (const auto& userPair : usersIndex) {
+                sortedUsernames.push_back(&userPair.first);
+            }
+            sort(sortedUsernames.begin(), sortedUsernames.end(),
+                 [](const string* left, const string* right) { return *left < *right; });
             int userCount = 1;
-            for (const auto& userPair : usersDatabase) {
-                cout << userCount << ". " << userPair.first << "\n";
+            for (const string* username : sortedUsernames) {
+                cout << userCount << ". " << *username << "\n";
                 userCount++;
             }
         }
@@ -276,8 +515,8 @@ public:
     }
     
     int getTotalUsers() {
-        map<string, string> usersDatabase = loadUsersFromDatabase();
-        return usersDatabase.size();
+        refreshUserIndex();
+        return usersIndex.size();
     }
 };
 
@@ -1,189 +1,1506 @@
 #include <iostream>
-#include <vector>
-#include <string>
-#include <ctime>
 #include <iomanip>
-#include <algorithm>
+#include <string>
+#include <vector>
 #include <limits>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+
+#include "bank_core.h"
+#include "bank_service.h"
+#include "bank_router.h"
 
 using namespace std;
 
-class Account;
-class Transaction;
+// The display functions read balances and history through a ReadView, so what
+// they print is one point in time even while other threads are posting
+void displayCustomerInfo(const Bank& bank, const ReadView& view, const Customer& customer) {
+    size_t accountCount = 0;
+    Cents total = 0;
+    for (AccountHandle handle : customer.getAccounts()) {
+        Cents balance;
+        uint64_t transactionCount;
+        if (bank.getAccount(handle)->readAt(view, balance, transactionCount)) {
+            accountCount++;
+            total += balance;
+        }
+    }
+    cout << "\nCustomer Information:\n";
+    cout << "ID: " << customer.getCustomerId() << "\n";
+    cout << "Name: " << customer.getName() << "\n";
+    cout << "Address: " << customer.getAddress() << "\n";
+    cout << "Phone: " << customer.getPhoneNumber() << "\n";
+    cout << "Number of Accounts: " << accountCount << "\n";
+    cout << "Total Balance: $" << formatCents(total) << "\n";
+}
+
+void displayAccountInfo(const Bank& bank, const ReadView& view, const Account& account) {
+    Cents balance = 0;
+    uint64_t transactionCount = 0;
+    account.readAt(view, balance, transactionCount);
+    cout << "\nAccount Information:\n";
+    cout << "Account Number: " << account.getAccountNumber() << "\n";
+    cout << "Type: " << account.getAccountType() << "\n";
+    cout << "Balance: $" << formatCents(balance) << "\n";
+    cout << "Owner: " << bank.getCustomer(account.getOwner())->getName() << "\n";
+}
+
+void writeTransactionLine(ostream& out, const Transaction& transaction) {
+    out << left << setw(20) << transaction.getTimestamp() 
+        << setw(15) << transaction.getTransactionId()
+        << setw(25) << transaction.getDescription()
+        << setw(10) << transaction.getType()
+        << "$" << formatCents(transaction.getAmount()) << "\n";
+}
+
+void displayTransactionInfo(const Transaction& transaction) {
+    writeTransactionLine(cout, transaction);
+}
 
-class Customer {
+void displayTransactionHistory(const ReadView& view, const Account& account, int limit = 10) {
+    vector<Transaction> history;
+    account.getHistoryAt(view, 0, (size_t)max(0, limit), history);
+    cout << "\nTransaction History (Last " << history.size() << " transactions):\n";
+    cout << left << setw(20) << "Timestamp"
+         << setw(15) << "Transaction ID"
+         << setw(25) << "Description"
+         << setw(10) << "Type"
+         << "Amount\n";
+    
+    for (const Transaction& transaction : history) {
+        displayTransactionInfo(transaction);
+    }
+}
+
+
+// Here we take a snapshot every intervalSeconds on a background thread
+class SnapshotScheduler {
 private:
-    string customerId;
-    string name;
-    string address;
-    string phoneNumber;
-    vector<Account*> accounts;
+    Bank& bank;
+    string path;
+    chrono::seconds interval;
+    mutex stateMutex;
+    condition_variable wakeUp;
+    bool stopping;
+    thread worker;
 
 public:
-    Customer(const string& id, const string& name, 
-             const string& address, const string& phone)
-        : customerId(id), name(name), address(address), phoneNumber(phone) {}
-
-    string getCustomerId() const { return customerId; }
-    string getName() const { return name; }
-    string getAddress() const { return address; }
-    string getPhoneNumber() const { return phoneNumber; }
-    const vector<Account*>& getAccounts() const { return accounts; }
-
-    void addAccount(Account* account);
-    void displayCustomerInfo() const;
+    SnapshotScheduler(Bank& bank, const string& path, long intervalSeconds)
+        : bank(bank), path(path), interval(intervalSeconds), stopping(false) {
+        worker = thread([this]() {
+            unique_lock<mutex> lock(stateMutex);
+            while (!wakeUp.wait_for(lock, interval, [this]() { return stopping; })) {
+                lock.unlock();
+                SnapshotSummary summary;
+                if (!writeSnapshot(this->bank, this->path, summary)) {
+                    cerr << "Warning: Unable to write snapshot '" << this->path << "'.\n";
+                }
+                lock.lock();
+            }
+        });
+    }
+
+    ~SnapshotScheduler() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        worker.join();
+    }
 };
 
-class Account {
+// Set from the SIGUSR1 handler; the scheduler notices it within a poll interval
+volatile sig_atomic_t metricsDumpRequested = 0;
+
+void requestMetricsDump(int) {
+    metricsDumpRequested = 1;
+}
+
+// Dumps metrics every interval (0 for never) and whenever the process gets SIGUSR1
+class MetricsScheduler {
 private:
-    string accountNumber;
-    string accountType;
-    double balance;
-    Customer* owner;
-    vector<Transaction*> transactions;
+    Bank& bank;
+    string path;
+    chrono::seconds interval;
+    mutex stateMutex;
+    condition_variable wakeUp;
+    bool stopping;
+    thread worker;
 
 public:
-    Account(const string& accNum, const string& accType, Customer* cust)
-        : accountNumber(accNum), accountType(accType), balance(0.0), owner(cust) {}
-
-    string getAccountNumber() const { return accountNumber; }
-    string getAccountType() const { return accountType; }
-    double getBalance() const { return balance; }
-    Customer* getOwner() const { return owner; }
-    const vector<Transaction*>& getTransactions() const { return transactions; }
-
-    void deposit(double amount, const string& description = "Deposit");
-    bool withdraw(double amount, const string& description = "Withdrawal");
-    bool transfer(Account& targetAccount, double amount, const string& description = "Transfer");
-    void addTransaction(Transaction* transaction);
-    void displayAccountInfo() const;
-    void displayTransactionHistory(int limit = 10) const;
+    MetricsScheduler(Bank& bank, const string& path, long intervalSeconds)
+        : bank(bank), path(path), interval(intervalSeconds), stopping(false) {
+        signal(SIGUSR1, requestMetricsDump);
+        worker = thread([this]() {
+            const chrono::milliseconds poll(200);
+            auto nextDump = chrono::steady_clock::now() + interval;
+            unique_lock<mutex> lock(stateMutex);
+            while (!wakeUp.wait_for(lock, poll, [this]() { return stopping; })) {
+                bool due = interval.count() > 0 && chrono::steady_clock::now() >= nextDump;
+                if (!due && metricsDumpRequested == 0) continue;
+                metricsDumpRequested = 0;
+                nextDump = chrono::steady_clock::now() + interval;
+                lock.unlock();
+                if (!writeMetricsFile(this->bank, this->path)) {
+                    cerr << "Warning: Unable to write metrics '" << this->path << "'.\n";
+                }
+                lock.lock();
+            }
+        });
+    }
+
+    ~MetricsScheduler() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        worker.join();
+        signal(SIGUSR1, SIG_DFL);
+    }
 };
 
-class Transaction {
+// Frees the account versions that no ReadView can reach any more. A sweep
+// walks every account, so it only runs when a view has been opened since the
+// last one; writers never free anything themselves.
+class VersionReclaimer {
 private:
-    string transactionId;
-    string timestamp;
-    string description;
-    double amount;
-    string type;
-    Account* account;
+    Bank& bank;
+    mutex stateMutex;
+    condition_variable wakeUp;
+    bool stopping;
+    thread worker;
 
 public:
-    Transaction(const string& transId, const string& desc, 
-                double amt, const string& type, Account* acc)
-        : transactionId(transId), description(desc), 
-          amount(amt), type(type), account(acc) {
-        
-        time_t now = time(0);
-        timestamp = ctime(&now);
-        timestamp = timestamp.substr(0, timestamp.length()-1); // Remove newline
+    explicit VersionReclaimer(Bank& bank) : bank(bank), stopping(false) {
+        worker = thread([this]() {
+            const chrono::milliseconds interval(100);
+            uint64_t sweptEpoch = readEpochs.getCurrent();
+            unique_lock<mutex> lock(stateMutex);
+            while (!wakeUp.wait_for(lock, interval, [this]() { return stopping; })) {
+                uint64_t epoch = readEpochs.getCurrent();
+                if (epoch == sweptEpoch) continue;
+                lock.unlock();
+                this->bank.reclaimVersions();
+                sweptEpoch = epoch;
+                lock.lock();
+            }
+        });
+    }
+
+    ~VersionReclaimer() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        worker.join();
+    }
+};
+
+// Here we replay a file of operations without the menu. The CSV format holds one
+// operation per line:
+//   C,<name>,<address>,<phone>        create customer
+//   A,<customer id>,<account type>    open account
+//   D,<account number>,<amount>       deposit
+//   W,<account number>,<amount>       withdraw
+//   T,<source>,<target>,<amount>      transfer
+// The binary variant starts with BATCH_MAGIC followed by fixed 24-byte BatchRecords.
+const char BATCH_MAGIC[8] = {'B', 'K', 'B', 'A', 'T', 'C', 'H', '1'};
+
+struct BatchRecord {
+    char op;                // 'C', 'A', 'D', 'W' or 'T'
+    char accountKind;       // 'S' (Savings) or 'C' (Checking) for 'A' records
+    uint16_t reserved;
+    uint32_t primary;       // account number, or customer number for 'A'
+    uint32_t secondary;     // target account number for 'T'
+    uint32_t textIndex;     // first entry in BatchFile::texts for CSV 'C'/'A' records
+    int64_t amountCents;
+};
+
+struct BatchFile {
+    vector<BatchRecord> records;
+    vector<string> texts;
+    size_t malformedLines = 0;
+};
+
+struct BatchSummary {
+    size_t applied = 0;
+    size_t rejected = 0;
+    size_t malformed = 0;
+    size_t nettedBatches = 0;       // --clearing only
+    size_t failedBatches = 0;
+    double loadSeconds = 0;
+    double applySeconds = 0;
+};
+
+const uint32_t NO_TEXT = 0xFFFFFFFFu;
+
+// Accepts "ACCT100000", "acct100000" or a bare "100000"
+bool parseNumberToken(const char* begin, const char* end, const char* prefix, uint32_t& number) {
+    size_t prefixLength = strlen(prefix);
+    if ((size_t)(end - begin) > prefixLength) {
+        size_t matched = 0;
+        while (matched < prefixLength && toupper((unsigned char)begin[matched]) == prefix[matched]) {
+            matched++;
+        }
+        if (matched == prefixLength) begin += prefixLength;
+    }
+    if (begin == end) return false;
+    uint64_t value = 0;
+    for (const char* cursor = begin; cursor < end; cursor++) {
+        if (!isdigit((unsigned char)*cursor)) return false;
+        value = value * 10 + (*cursor - '0');
+        if (value > 0xFFFFFFFFull) return false;
+    }
+    number = (uint32_t)value;
+    return true;
+}
+
+// Parses "12", "12.5" or "-3.75" into cents without going through a double
+bool parseAmountCents(const char* begin, const char* end, int64_t& cents) {
+    bool negative = false;
+    if (begin < end && (*begin == '-' || *begin == '+')) {
+        negative = (*begin == '-');
+        begin++;
+    }
+    if (begin == end) return false;
+    int64_t whole = 0;
+    int fractionDigits = 0;
+    int64_t fraction = 0;
+    bool seenPoint = false;
+    for (const char* cursor = begin; cursor < end; cursor++) {
+        if (*cursor == '.' && !seenPoint) {
+            seenPoint = true;
+        } else if (!isdigit((unsigned char)*cursor)) {
+            return false;
+        } else if (!seenPoint) {
+            whole = whole * 10 + (*cursor - '0');
+            if (whole > 90000000000000000LL) return false;
+        } else if (fractionDigits < 2) {
+            fraction = fraction * 10 + (*cursor - '0');
+            fractionDigits++;
+        }
+    }
+    if (fractionDigits == 1) fraction *= 10;
+    cents = whole * 100 + fraction;
+    if (negative) cents = -cents;
+    return true;
+}
+
+bool parseCsvLine(const char* begin, const char* end, BatchFile& batch) {
+    const char* fields[5];
+    const char* fieldEnds[5];
+    int fieldCount = 0;
+    const char* fieldStart = begin;
+    for (const char* cursor = begin; ; cursor++) {
+        if (cursor == end || *cursor == ',') {
+            if (fieldCount == 5) return false;
+            fields[fieldCount] = fieldStart;
+            fieldEnds[fieldCount] = cursor;
+            fieldCount++;
+            if (cursor == end) break;
+            fieldStart = cursor + 1;
+        }
+    }
+    if (fieldEnds[0] - fields[0] != 1) return false;
+
+    BatchRecord record = {};
+    record.op = (char)toupper((unsigned char)fields[0][0]);
+    record.textIndex = NO_TEXT;
+    switch (record.op) {
+        case 'C':
+            if (fieldCount != 4) return false;
+            record.textIndex = (uint32_t)batch.texts.size();
+            for (int i = 1; i < 4; i++) {
+                batch.texts.emplace_back(fields[i], fieldEnds[i]);
+            }
+            break;
+        case 'A':
+            if (fieldCount != 3 || fields[2] == fieldEnds[2]) return false;
+            if (!parseNumberToken(fields[1], fieldEnds[1], "CUST", record.primary)) return false;
+            record.accountKind = (char)toupper((unsigned char)fields[2][0]);
+            record.textIndex = (uint32_t)batch.texts.size();
+            batch.texts.emplace_back(fields[2], fieldEnds[2]);
+            break;
+        case 'D':
+        case 'W':
+            if (fieldCount != 3) return false;
+            if (!parseNumberToken(fields[1], fieldEnds[1], "ACCT", record.primary)) return false;
+            if (!parseAmountCents(fields[2], fieldEnds[2], record.amountCents)) return false;
+            break;
+        case 'T':
+            if (fieldCount != 4) return false;
+            if (!parseNumberToken(fields[1], fieldEnds[1], "ACCT", record.primary)) return false;
+            if (!parseNumberToken(fields[2], fieldEnds[2], "ACCT", record.secondary)) return false;
+            if (!parseAmountCents(fields[3], fieldEnds[3], record.amountCents)) return false;
+            break;
+        default:
+            return false;
+    }
+    batch.records.push_back(record);
+    return true;
+}
+
+bool loadBatchFile(const string& path, BatchFile& batch) {
+    string contents;
+    if (!readWholeFile(path, contents)) {
+        return false;
+    }
+
+    if (contents.size() >= sizeof(BATCH_MAGIC) && memcmp(contents.data(), BATCH_MAGIC, sizeof(BATCH_MAGIC)) == 0) {
+        size_t count = (contents.size() - sizeof(BATCH_MAGIC)) / sizeof(BatchRecord);
+        batch.records.resize(count);
+        memcpy(batch.records.data(), contents.data() + sizeof(BATCH_MAGIC), count * sizeof(BatchRecord));
+        batch.malformedLines = (contents.size() - sizeof(BATCH_MAGIC)) % sizeof(BatchRecord) != 0 ? 1 : 0;
+        return true;
+    }
+
+    batch.records.reserve(contents.size() / 24);
+    const char* cursor = contents.data();
+    const char* end = cursor + contents.size();
+    while (cursor < end) {
+        const char* lineEnd = (const char*)memchr(cursor, '\n', end - cursor);
+        if (lineEnd == nullptr) lineEnd = end;
+        const char* trimmedEnd = lineEnd;
+        while (trimmedEnd > cursor && (trimmedEnd[-1] == '\r' || trimmedEnd[-1] == ' ')) trimmedEnd--;
+        if (trimmedEnd > cursor && *cursor != '#') {
+            if (!parseCsvLine(cursor, trimmedEnd, batch)) {
+                batch.malformedLines++;
+            }
+        }
+        cursor = lineEnd + 1;
+    }
+    return true;
+}
+
+bool writeBinaryBatchFile(const string& path, const BatchFile& batch) {
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file.is_open()) return false;
+    file.write(BATCH_MAGIC, sizeof(BATCH_MAGIC));
+    for (BatchRecord record : batch.records) {
+        record.textIndex = NO_TEXT; // binary files carry no strings
+        file.write((const char*)&record, sizeof(record));
+    }
+    return (bool)file;
+}
+
+bool applyBatchRecord(Bank& bank, const BatchFile& batch, const BatchRecord& record) {
+    switch (record.op) {
+        case 'C': {
+            if (record.textIndex == NO_TEXT) {
+                bank.createCustomer("Batch Customer", "", "");
+            } else {
+                bank.createCustomer(batch.texts[record.textIndex], batch.texts[record.textIndex + 1],
+                                    batch.texts[record.textIndex + 2]);
+            }
+            return true;
+        }
+        case 'A': {
+            Customer* owner = bank.findCustomerByNumber(record.primary);
+            if (owner == nullptr) return false;
+            if (record.textIndex != NO_TEXT) {
+                bank.openAccount(owner, batch.texts[record.textIndex]);
+            } else {
+                bank.openAccount(owner, record.accountKind == 'C' ? "Checking" : "Savings");
+            }
+            return true;
+        }
+        case 'D': {
+            Account* account = bank.findAccountByNumber(record.primary);
+            return account != nullptr && account->deposit(record.amountCents).ok();
+        }
+        case 'W': {
+            Account* account = bank.findAccountByNumber(record.primary);
+            return account != nullptr && account->withdraw(record.amountCents).ok();
+        }
+        case 'T': {
+            Account* source = bank.findAccountByNumber(record.primary);
+            Account* target = bank.findAccountByNumber(record.secondary);
+            return source != nullptr && target != nullptr && source->transfer(*target, record.amountCents).ok();
+        }
+        default:
+            return false;
+    }
+}
+
+// Applies a run of transfer records as one netted batch; a batch that fails
+// (one leg names an unknown account, or some account would be overdrawn once
+// everything is netted) rejects every leg in it
+void applyClearingBatch(Bank& bank, const vector<TransferLeg>& legs, BatchSummary& summary) {
+    if (legs.empty()) return;
+    summary.nettedBatches++;
+    TransferBatchResult result = bank.applyTransferBatch(legs.data(), legs.size());
+    if (!result.unknownAccount && result.status == OperationStatus::Ok) {
+        summary.applied += legs.size();
+    } else {
+        summary.failedBatches++;
+        summary.rejected += legs.size();
+    }
+}
+
+// clearingLegs > 0 groups consecutive transfers into netted batches of up to
+// that many legs; every other record is applied on its own, in file order
+BatchSummary runBatch(Bank& bank, const string& path, size_t clearingLegs = 0) {
+    BatchSummary summary;
+    BatchFile batch;
+
+    auto loadStart = chrono::steady_clock::now();
+    if (!loadBatchFile(path, batch)) {
+        cout << "Error: Unable to open batch file '" << path << "'.\n";
+        summary.malformed = 1;
+        return summary;
+    }
+    auto applyStart = chrono::steady_clock::now();
+
+    vector<TransferLeg> legs;
+    legs.reserve(clearingLegs);
+    for (const BatchRecord& record : batch.records) {
+        if (clearingLegs > 0 && record.op == 'T') {
+            legs.push_back({record.primary, record.secondary, record.amountCents});
+            if (legs.size() == clearingLegs) {
+                applyClearingBatch(bank, legs, summary);
+                legs.clear();
+            }
+            continue;
+        }
+        applyClearingBatch(bank, legs, summary);
+        legs.clear();
+        if (applyBatchRecord(bank, batch, record)) {
+            summary.applied++;
+        } else {
+            summary.rejected++;
+        }
+    }
+    applyClearingBatch(bank, legs, summary);
+    if (!bank.commitLedger()) {
+        cout << "Error: Ledger log write failed; the batch is not durable.\n";
+    }
+
+    auto applyEnd = chrono::steady_clock::now();
+    summary.malformed = batch.malformedLines;
+    summary.loadSeconds = chrono::duration<double>(applyStart - loadStart).count();
+    summary.applySeconds = chrono::duration<double>(applyEnd - applyStart).count();
+    return summary;
+}
+
+void displayTransactionArenaStats(const Bank& bank) {
+    size_t recordsStored = 0;
+    for (const Account* account : bank.getAccounts()) {
+        recordsStored += account->getStoredTransactionCount();
     }
+    cout << "Transaction storage:\n";
+    cout << "  Records stored:      " << recordsStored << "\n";
+    cout << "  Chunk allocations:   " << transactionArenaStats.chunkAllocations
+         << " (" << TransactionLog::CHUNK_RECORDS << " records each)\n";
+    cout << "  Bytes reserved:      " << transactionArenaStats.bytesReserved.load()
+         << " (peak " << transactionArenaStats.peakBytesReserved.load() << ")\n";
 
-    string getTransactionId() const { return transactionId; }
-    string getTimestamp() const { return timestamp; }
-    string getDescription() const { return description; }
-    double getAmount() const { return amount; }
-    string getType() const { return type; }
-    Account* getAccount() const { return account; }
+    const ColdHistoryStore* coldStore = TransactionLog::getColdStore();
+    if (coldStore == nullptr) return;
+    const ColdHistoryStats& cold = coldStore->getStats();
+    cout << "Cold history:\n";
+    cout << "  Records spilled:     " << cold.recordsSpilled.load() << "\n";
+    cout << "  Segments written:    " << cold.segmentsWritten.load() << "\n";
+    cout << "  Bytes written:       " << cold.bytesWritten.load() << "\n";
+}
+
+void displayLedgerLogStats(const Bank& bank) {
+    const WriteAheadLog* log = bank.getLedgerLog();
+    if (log == nullptr) return;
+    uint64_t commits = log->getGroupCommits();
+    cout << "Ledger log:\n";
+    cout << "  Records logged:      " << log->getRecordsLogged() << "\n";
+    cout << "  Group commits:       " << commits << "\n";
+}
+
+// Hits per active velocity rule, and the latest few alerts
+void displayVelocityRuleStats() {
+    if (!velocityRules.isEnabled()) return;
+    MetricsTotals totals;
+    bankMetrics.collect(totals);
+    cout << "Velocity rules:\n";
+    for (int rule = 0; rule < RULE_COUNT; rule++) {
+        if (!velocityRules.isActive((VelocityRule)rule)) continue;
+        bool blocking = velocityRules.getSettings((VelocityRule)rule).action == RuleAction::Block;
+        cout << "  " << left << setw(21) << (string(VELOCITY_RULE_NAMES[rule]) + ":") << right
+             << totals.ruleHits[rule] << (blocking ? " blocked" : " flagged") << "\n";
+    }
+    vector<VelocityAlert> alerts = velocityRules.getRecentAlerts();
+    for (size_t i = 0; i < alerts.size() && i < 3; i++) {
+        cout << "  Latest alert:        ACCT" << alerts[i].accountNumber
+             << " " << VELOCITY_RULE_NAMES[alerts[i].rule] << " $" << formatCents(alerts[i].amount) << "\n";
+    }
+}
 
-    void displayTransactionInfo() const {
-        cout << left << setw(20) << timestamp 
-             << setw(15) << transactionId
-             << setw(25) << description
-             << setw(10) << type
-             << fixed << setprecision(2) << "$" << amount << "\n";
+Cents totalBalance(const Bank& bank) {
+    Cents total = 0;
+    for (const Account* account : bank.getAccounts()) {
+        total += account->getBalance();
     }
+    return total;
+}
+
+// Digest of every account's number, balance and transaction count, in
+// creation order: two replays of one batch agree exactly when these match
+Sha256Digest balancesDigest(const Bank& bank) {
+    string state;
+    state.reserve(bank.getAccounts().size() * 20);
+    for (const Account* account : bank.getAccounts()) {
+        uint32_t number = account->getAccountNumberValue();
+        Cents balance;
+        uint64_t transactionCount;
+        account->readState(balance, transactionCount);
+        state.append(reinterpret_cast<const char*>(&number), sizeof(number));
+        state.append(reinterpret_cast<const char*>(&balance), sizeof(balance));
+        state.append(reinterpret_cast<const char*>(&transactionCount), sizeof(transactionCount));
+    }
+    return sha256(state.data(), state.size());
+}
+
+void displayBatchSummary(const Bank& bank, const BatchSummary& summary) {
+    size_t total = summary.applied + summary.rejected;
+    cout << "Batch summary:\n";
+    cout << "  Operations applied:  " << summary.applied << "\n";
+    cout << "  Operations rejected: " << summary.rejected << "\n";
+    cout << "  Malformed lines:     " << summary.malformed << "\n";
+    if (summary.nettedBatches > 0) {
+        cout << "  Netted batches:      " << summary.nettedBatches << " (" << summary.failedBatches << " failed)\n";
+    }
+    cout << fixed << setprecision(3);
+    cout << "  Load time:           " << summary.loadSeconds << " s\n";
+    cout << "  Apply time:          " << summary.applySeconds << " s\n";
+    if (summary.applySeconds > 0) {
+        cout << setprecision(0);
+        cout << "  Throughput:          " << total / summary.applySeconds << " ops/s\n";
+    }
+    cout << "  Total balance:       $" << formatCents(totalBalance(bank)) << "\n";
+    cout << "  Balances digest:     " << formatDigest(balancesDigest(bank)) << "\n";
+    displayTransactionArenaStats(bank);
+    displayLedgerLogStats(bank);
+    displayVelocityRuleStats();
+}
+
+// Here we drive transfers from several worker threads at once to see how the
+// per-account locking scales. Accounts are picked uniformly, so most transfers
+// touch different accounts and only occasionally contend for the same lock.
+struct ConcurrentRunResult {
+    unsigned threads = 0;
+    size_t applied = 0;
+    size_t rejected = 0;
+    uint64_t conflicts = 0;
+    double seconds = 0;
+    size_t reports = 0;         // point-in-time totals taken while the transfers ran
+    size_t tornReports = 0;     // ones that did not add up to the expected total
 };
 
-void Customer::addAccount(Account* account) {
-    accounts.push_back(account);
+uint64_t nextRandom(uint64_t& state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
 }
 
-void Customer::displayCustomerInfo() const {
-    cout << "\nCustomer Information:\n";
-    cout << "ID: " << customerId << "\n";
-    cout << "Name: " << name << "\n";
-    cout << "Address: " << address << "\n";
-    cout << "Phone: " << phoneNumber << "\n";
-    cout << "Number of Accounts: " << accounts.size() << "\n";
+// Alongside the workers, a reporting thread keeps adding up every balance
+// through a ReadView: transfers move money but never create it, so each
+// report must come to expectedTotal
+ConcurrentRunResult runConcurrentTransfers(const Bank& bank, unsigned threadCount, size_t transfersPerThread,
+                                           Cents expectedTotal) {
+    ConcurrentRunResult result;
+    result.threads = threadCount;
+    const vector<Account*>& accounts = bank.getAccounts();
+
+    vector<ConcurrentRunResult> perThread(threadCount);
+    atomic<bool> startSignal(false);
+    vector<thread> workers;
+    for (unsigned t = 0; t < threadCount; t++) {
+        workers.emplace_back([&, t]() {
+            uint64_t rng = 0x9E3779B97F4A7C15ULL * (t + 1);
+            ConcurrentRunResult& local = perThread[t];
+            uint64_t conflictsBefore = transferLockConflicts;
+            while (!startSignal.load(memory_order_acquire)) {
+                this_thread::yield();
+            }
+            for (size_t i = 0; i < transfersPerThread; i++) {
+                Account* source = accounts[nextRandom(rng) % accounts.size()];
+                Account* target = accounts[nextRandom(rng) % accounts.size()];
+                Cents amount = 1 + (Cents)(nextRandom(rng) % 10000);
+                if (source != target && source->transfer(*target, amount).ok()) {
+                    local.applied++;
+                } else {
+                    local.rejected++;
+                }
+            }
+            local.conflicts = transferLockConflicts - conflictsBefore;
+        });
+    }
+
+    atomic<bool> workersDone(false);
+    thread reporter([&]() {
+        while (!startSignal.load(memory_order_acquire)) {
+            this_thread::yield();
+        }
+        while (!workersDone.load(memory_order_acquire)) {
+            ReadView view = bank.openReadView();
+            Cents total = 0;
+            for (const Account* account : view.getAccounts()) {
+                Cents balance;
+                uint64_t transactionCount;
+                if (account->readAt(view, balance, transactionCount)) total += balance;
+            }
+            result.reports++;
+            result.tornReports += total != expectedTotal ? 1 : 0;
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    });
+
+    auto start = chrono::steady_clock::now();
+    startSignal.store(true, memory_order_release);
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    workersDone.store(true, memory_order_release);
+    reporter.join();
+
+    for (const ConcurrentRunResult& local : perThread) {
+        result.applied += local.applied;
+        result.rejected += local.rejected;
+        result.conflicts += local.conflicts;
+    }
+    return result;
+}
+
+int runConcurrentBenchmark(Bank& bank, size_t accountCount, size_t transfersPerThread, unsigned maxThreads) {
+    if (accountCount < 2 || transfersPerThread == 0 || maxThreads == 0) {
+        cout << "Error: Need at least 2 accounts, 1 transfer and 1 thread.\n";
+        return 1;
+    }
+
+    for (size_t i = 0; i < accountCount; i++) {
+        Customer* customer = bank.createCustomer("Load Customer", "", "");
+        bank.openAccount(customer, i % 2 == 0 ? "Savings" : "Checking")->deposit(100000000);
+    }
+    Cents expectedTotal = totalBalance(bank);
+
+    vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    cout << "Concurrent transfers: " << accountCount << " accounts, "
+         << transfersPerThread << " transfers per thread\n";
+    cout << left << setw(10) << "Threads" << setw(14) << "Applied" << setw(12) << "Rejected"
+         << setw(12) << "Conflicts" << setw(12) << "Seconds" << "Transfers/s\n";
+
+    bool conserved = true;
+    size_t reports = 0;
+    size_t tornReports = 0;
+    for (unsigned threads : threadCounts) {
+        ConcurrentRunResult result = runConcurrentTransfers(bank, threads, transfersPerThread, expectedTotal);
+        reports += result.reports;
+        tornReports += result.tornReports;
+        double perSecond = (result.applied + result.rejected) / result.seconds;
+        cout << left << setw(10) << result.threads << setw(14) << result.applied << setw(12) << result.rejected
+             << setw(12) << result.conflicts << setw(12) << fixed << setprecision(3) << result.seconds
+             << setprecision(0) << perSecond << "\n";
+        conserved = conserved && totalBalance(bank) == expectedTotal;
+    }
+    bank.commitLedger();
+    displayLedgerLogStats(bank);
+    displayVelocityRuleStats();
+
+    cout << "Concurrent reports:  " << reports << " (" << tornReports << " did not add up)\n";
+    cout << "Total balance " << (conserved ? "conserved" : "NOT conserved")
+         << ": $" << formatCents(totalBalance(bank)) << "\n";
+    return conserved && tornReports == 0 ? 0 : 1;
+}
+
+// Here we load the scheduler with standing orders (monthly rent, fortnightly
+// payroll and daily savings sweeps, one in ten then cancelled) and run a
+// simulated clock forward a day at a time, releasing what falls due in
+// batches. The transfers themselves are real and go through the ledger.
+int runStandingOrders(Bank& bank, size_t accountCount, size_t orderCount, unsigned days) {
+    if (accountCount < 2 || orderCount == 0) {
+        cout << "Error: Need at least 2 accounts and 1 order.\n";
+        return 1;
+    }
+    for (size_t i = 0; i < accountCount; i++) {
+        Customer* customer = bank.createCustomer("Standing Order Customer", "", "");
+        bank.openAccount(customer, i % 2 == 0 ? "Savings" : "Checking")->deposit(100000000);
+    }
+    bank.commitLedger();
+    Cents expectedTotal = totalBalance(bank);
+
+    const int64_t day = 86400LL * 1000000000LL;
+    const int64_t intervals[3] = {30 * day, 14 * day, day};
+    const Cents amounts[3] = {150000, 250000, 5000};
+    int64_t startNs = currentEpochNanoseconds();
+    TransferScheduler scheduler(1000000000LL, startNs);
+    vector<uint64_t> orderIds;
+    orderIds.reserve(orderCount);
+    uint64_t state = 0x5eed0021;
+
+    auto scheduleStart = chrono::steady_clock::now();
+    for (size_t i = 0; i < orderCount; i++) {
+        int kind = (int)(i % 3);
+        uint32_t source = (uint32_t)(FIRST_ACCOUNT_NUMBER + nextRandom(state) % accountCount);
+        uint32_t target = (uint32_t)(FIRST_ACCOUNT_NUMBER + nextRandom(state) % accountCount);
+        int64_t firstDue = startNs + (int64_t)(nextRandom(state) % (uint64_t)intervals[kind]);
+        orderIds.push_back(scheduler.schedule(source, target, amounts[kind], firstDue, intervals[kind]));
+    }
+    auto cancelStart = chrono::steady_clock::now();
+    size_t cancelled = 0;
+    for (size_t i = 0; i < orderIds.size(); i += 10) {
+        cancelled += scheduler.cancel(orderIds[i]) ? 1 : 0;
+    }
+    auto runStart = chrono::steady_clock::now();
+    StandingOrderRun total;
+    for (unsigned d = 1; d <= days; d++) {
+        StandingOrderRun run = runDueTransfers(bank, scheduler, startNs + d * day, 4096);
+        total.due += run.due;
+        total.applied += run.applied;
+        total.rejected += run.rejected;
+        total.batches += run.batches;
+        total.durable = total.durable && run.durable;
+    }
+    auto runEnd = chrono::steady_clock::now();
+
+    double scheduleSeconds = chrono::duration<double>(cancelStart - scheduleStart).count();
+    double cancelSeconds = chrono::duration<double>(runStart - cancelStart).count();
+    double runSeconds = chrono::duration<double>(runEnd - runStart).count();
+    cout << "Standing orders: " << accountCount << " accounts, " << orderCount << " orders, " << days
+         << " simulated days\n";
+    cout << fixed << setprecision(0);
+    cout << "  Scheduled:           " << orderCount << " (" << orderCount / max(scheduleSeconds, 1e-9) << " /s)\n";
+    cout << "  Cancelled:           " << cancelled << " (" << cancelled / max(cancelSeconds, 1e-9) << " /s)\n";
+    cout << "  Fired:               " << total.due << " in " << total.batches << " batches ("
+         << total.due / max(runSeconds, 1e-9) << " /s including the transfers)\n";
+    cout << "  Transfers applied:   " << total.applied << "\n";
+    cout << "  Transfers rejected:  " << total.rejected << "\n";
+    cout << "  Orders cascaded:     " << scheduler.getCascadedOrders() << "\n";
+    cout << "  Still scheduled:     " << scheduler.size() << " (" << sizeof(ScheduledTransfer) + sizeof(uint32_t)
+         << " bytes each)\n";
+    displayLedgerLogStats(bank);
+    displayVelocityRuleStats();
+
+    bool conserved = totalBalance(bank) == expectedTotal;
+    cout << "Total balance " << (conserved ? "conserved" : "NOT conserved")
+         << ": $" << formatCents(totalBalance(bank)) << "\n";
+    if (!total.durable) {
+        cout << "Error: Ledger log write failed; standing order transfers are not durable.\n";
+    }
+    return conserved && total.durable ? 0 : 1;
+}
+
+// End-of-day rates. Interest accrues daily on positive Savings balances; a Checking
+// account below the minimum balance pays a flat daily fee, never more than it holds.
+struct EndOfDayPolicy {
+    long savingsRateBasisPoints = 250;      // per year
+    Cents checkingFee = 25;
+    Cents checkingMinimumBalance = 100000;
+};
+
+struct EndOfDayThreadResult {
+    size_t accounts = 0;
+    size_t credited = 0;
+    size_t charged = 0;
+    size_t skipped = 0;                     // fee no longer covered when it was applied
+    Cents interestPaid = 0;
+    Cents feesCollected = 0;
+    double seconds = 0;
+};
+
+enum EndOfDayKind : uint8_t {
+    END_OF_DAY_NONE = 0,
+    END_OF_DAY_SAVINGS = 1,
+    END_OF_DAY_CHECKING = 2
+};
+
+// Account types are free text typed at the menu, so only the first letter is checked
+EndOfDayKind classifyForEndOfDay(const string& accountType) {
+    char first = accountType.empty() ? ' ' : (char)toupper((unsigned char)accountType[0]);
+    return first == 'S' ? END_OF_DAY_SAVINGS : first == 'C' ? END_OF_DAY_CHECKING : END_OF_DAY_NONE;
+}
+
+// Straight-line loop over contiguous arrays so the compiler can vectorize it.
+// Positive adjustments are interest, negative ones are fees. The daily rate is
+// fixed point (units of 2^-32); splitting the balance into high and low halves
+// keeps the products inside 64 bits for any balance.
+void computeEndOfDayAdjustments(const Cents* balances, const uint8_t* kinds, Cents* adjustments,
+                                size_t count, const EndOfDayPolicy& policy) {
+    const int64_t dailyRate = llround(policy.savingsRateBasisPoints * 4294967296.0 / (10000.0 * 365.0));
+    const Cents fee = policy.checkingFee;
+    const Cents minimum = policy.checkingMinimumBalance;
+    for (size_t i = 0; i < count; i++) {
+        Cents positive = balances[i] > 0 ? balances[i] : 0;
+        Cents interest = (positive >> 32) * dailyRate + (((positive & 0xFFFFFFFF) * dailyRate) >> 32);
+        Cents charge = balances[i] < minimum ? min(fee, positive) : 0;
+        adjustments[i] = kinds[i] == END_OF_DAY_SAVINGS ? interest : kinds[i] == END_OF_DAY_CHECKING ? -charge : 0;
+    }
 }
 
-void Account::deposit(double amount, const string& description) {
-    if (amount <= 0) {
-        cout << "Invalid deposit amount.\n";
-        return;
+// Captures one thread's slice of balances into local arrays, computes the
+// adjustments in one pass, then posts them. Each posting is an ordinary
+// deposit or withdrawal, so it is locked and written to the ledger log.
+void runEndOfDaySlice(Account* const* accounts, size_t count, const EndOfDayPolicy& policy,
+                      EndOfDayThreadResult& result) {
+    auto start = chrono::steady_clock::now();
+    vector<Cents> balances(count);
+    vector<uint8_t> kinds(count);
+    vector<Cents> adjustments(count);
+    for (size_t i = 0; i < count; i++) {
+        balances[i] = accounts[i]->getBalance();
+        kinds[i] = classifyForEndOfDay(accounts[i]->getAccountType());
+    }
+
+    computeEndOfDayAdjustments(balances.data(), kinds.data(), adjustments.data(), count, policy);
+
+    for (size_t i = 0; i < count; i++) {
+        Cents adjustment = adjustments[i];
+        if (adjustment > 0) {
+            accounts[i]->deposit(adjustment, DESCRIPTION_INTEREST);
+            result.credited++;
+            result.interestPaid += adjustment;
+        } else if (adjustment < 0) {
+            if (accounts[i]->withdraw(-adjustment, DESCRIPTION_FEE).ok()) {
+                result.charged++;
+                result.feesCollected -= adjustment;
+            } else {
+                result.skipped++;
+            }
+        }
+    }
+    result.accounts = count;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Splits the accounts into one contiguous range per thread. Meant to run while
+// the bank is otherwise quiet: balances are captured before postings are made,
+// so a transfer landing in between is not reflected in that day's interest.
+int runEndOfDay(Bank& bank, unsigned threadCount, const EndOfDayPolicy& policy = EndOfDayPolicy()) {
+    if (threadCount == 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+    const vector<Account*>& accounts = bank.getAccounts();
+    size_t sliceSize = (accounts.size() + threadCount - 1) / threadCount;
+
+    vector<EndOfDayThreadResult> results(threadCount);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (unsigned t = 0; t < threadCount; t++) {
+        size_t first = min(accounts.size(), t * sliceSize);
+        size_t last = min(accounts.size(), first + sliceSize);
+        workers.emplace_back(runEndOfDaySlice, accounts.data() + first, last - first,
+                             cref(policy), ref(results[t]));
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    bool durable = bank.commitLedger();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    EndOfDayThreadResult total;
+    cout << "End of day: " << accounts.size() << " accounts, " << threadCount << " threads\n";
+    cout << left << setw(10) << "Thread" << setw(14) << "Accounts" << setw(12) << "Seconds" << "Accounts/s\n";
+    for (unsigned t = 0; t < threadCount; t++) {
+        const EndOfDayThreadResult& result = results[t];
+        double perSecond = result.seconds > 0 ? result.accounts / result.seconds : 0;
+        cout << left << setw(10) << t << setw(14) << result.accounts << setw(12) << fixed << setprecision(3)
+             << result.seconds << setprecision(0) << perSecond << "\n";
+        total.credited += result.credited;
+        total.charged += result.charged;
+        total.skipped += result.skipped;
+        total.interestPaid += result.interestPaid;
+        total.feesCollected += result.feesCollected;
     }
-    balance += amount;
-    string transId = "T" + to_string(transactions.size() + 1);
-    Transaction* transaction = new Transaction(transId, description, amount, "Credit", this);
-    transactions.push_back(transaction);
-    cout << "Deposit successful. New balance: $" << balance << "\n";
+    cout << "  Interest credited:   " << total.credited << " accounts, $" << formatCents(total.interestPaid) << "\n";
+    cout << "  Fees charged:        " << total.charged << " accounts, $" << formatCents(total.feesCollected) << "\n";
+    cout << "  Fees skipped:        " << total.skipped << "\n";
+    cout << "  Wall time:           " << fixed << setprecision(3) << seconds << " s\n";
+    if (!durable) {
+        cout << "Error: Ledger log write failed; end-of-day postings are not durable.\n";
+        return 1;
+    }
+    return 0;
 }
 
-bool Account::withdraw(double amount, const string& description) {
-    if (amount <= 0) {
-        cout << "Invalid withdrawal amount.\n";
+// Parses "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM:SS" as UTC into epoch nanoseconds
+bool parseUtcTime(const string& text, int64_t& timestampNs) {
+    struct tm fields = {};
+    int consumed = 0;
+    if (sscanf(text.c_str(), "%4d-%2d-%2d%n", &fields.tm_year, &fields.tm_mon, &fields.tm_mday, &consumed) != 3) {
         return false;
     }
-    if (balance < amount) {
-        cout << "Insufficient funds.\n";
+    if ((size_t)consumed != text.size() &&
+        sscanf(text.c_str() + consumed, "T%2d:%2d:%2d", &fields.tm_hour, &fields.tm_min, &fields.tm_sec) != 3) {
         return false;
     }
-    balance -= amount;
-    string transId = "T" + to_string(transactions.size() + 1);
-    Transaction* transaction = new Transaction(transId, description, amount, "Debit", this);
-    transactions.push_back(transaction);
-    cout << "Withdrawal successful. New balance: $" << balance << "\n";
+    fields.tm_year -= 1900;
+    fields.tm_mon -= 1;
+    time_t seconds = timegm(&fields);
+    if (seconds == (time_t)-1) return false;
+    timestampNs = (int64_t)seconds * 1000000000LL;
     return true;
 }
 
-bool Account::transfer(Account& targetAccount, double amount, const string& description) {
-    if (this == &targetAccount) {
-        cout << "Cannot transfer to the same account.\n";
-        return false;
+string formatUtcDate(int64_t timestampNs) {
+    time_t seconds = (time_t)(timestampNs / 1000000000LL);
+    struct tm fields;
+    gmtime_r(&seconds, &fields);
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &fields);
+    return text;
+}
+
+void writeStatement(ostream& out, const Account& account, const AccountStatement& statement) {
+    out << "Statement for " << account.getAccountNumber() << " (" << account.getAccountType() << "), "
+        << formatUtcDate(statement.fromNs) << " to " << formatUtcDate(statement.toNs) << " UTC\n";
+    out << "Opening balance: $" << formatCents(statement.openingBalance) << "\n";
+    for (const Transaction& entry : statement.entries) {
+        writeTransactionLine(out, entry);
+    }
+    out << "Closing balance: $" << formatCents(statement.closingBalance) << "\n\n";
+}
+
+int runStatementQuery(const Bank& bank, const string& accountNumber, const string& from, const string& to) {
+    Account* account = bank.findAccount(accountNumber);
+    int64_t fromNs, toNs;
+    if (account == nullptr || !parseUtcTime(from, fromNs) || !parseUtcTime(to, toNs)) {
+        cout << "Error: Need an existing account and two times as YYYY-MM-DD[THH:MM:SS].\n";
+        return 1;
+    }
+    writeStatement(cout, *account, account->getStatementAt(ReadView(), fromNs, toNs));
+    return 0;
+}
+
+int runBalanceQuery(const Bank& bank, const string& accountNumber, const string& when) {
+    Account* account = bank.findAccount(accountNumber);
+    int64_t timestampNs;
+    if (account == nullptr || !parseUtcTime(when, timestampNs)) {
+        cout << "Error: Need an existing account and a time as YYYY-MM-DD[THH:MM:SS].\n";
+        return 1;
+    }
+    cout << "Balance of " << account->getAccountNumber() << " at " << formatUtcDate(timestampNs) << " UTC: $"
+         << formatCents(account->getBalanceAt(timestampNs)) << "\n";
+    return 0;
+}
+
+// Writes one month's statement for every account. Each thread takes a
+// contiguous range of accounts and writes its own part file,
+// <prefix>-<thread>.txt, so no output is shared between threads.
+int runMonthlyStatements(const Bank& bank, const string& month, const string& prefix, unsigned threadCount) {
+    int year, monthNumber;
+    int64_t fromNs, toNs;
+    if (sscanf(month.c_str(), "%4d-%2d", &year, &monthNumber) != 2 || monthNumber < 1 || monthNumber > 12 ||
+        !parseUtcTime(month + "-01", fromNs)) {
+        cout << "Error: Month must be YYYY-MM.\n";
+        return 1;
     }
-    if (withdraw(amount, "Transfer to " + targetAccount.getAccountNumber())) {
-        targetAccount.deposit(amount, "Transfer from " + accountNumber);
+    char nextMonth[32];
+    snprintf(nextMonth, sizeof(nextMonth), "%04d-%02d-01", monthNumber == 12 ? year + 1 : year,
+             monthNumber == 12 ? 1 : monthNumber + 1);
+    parseUtcTime(nextMonth, toNs);
+    if (threadCount == 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+
+    // Every statement is cut at the same point in time, whatever is posted while they are written
+    ReadView view = bank.openReadView();
+    const vector<Account*>& accounts = view.getAccounts();
+    size_t sliceSize = (accounts.size() + threadCount - 1) / threadCount;
+    vector<size_t> entriesWritten(threadCount, 0);
+    vector<char> failed(threadCount, 0);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (unsigned t = 0; t < threadCount; t++) {
+        workers.emplace_back([&, t]() {
+            ofstream out(prefix + "-" + to_string(t) + ".txt");
+            size_t first = min(accounts.size(), t * sliceSize);
+            size_t last = min(accounts.size(), first + sliceSize);
+            for (size_t i = first; i < last && out; i++) {
+                AccountStatement statement = accounts[i]->getStatementAt(view, fromNs, toNs);
+                writeStatement(out, *accounts[i], statement);
+                entriesWritten[t] += statement.entries.size();
+            }
+            failed[t] = !out.flush();
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t entries = 0;
+    for (size_t count : entriesWritten) entries += count;
+    if (find(failed.begin(), failed.end(), 1) != failed.end()) {
+        cout << "Error: Unable to write statements to '" << prefix << "-*.txt'.\n";
+        return 1;
+    }
+    cout << "Statements for " << month << ": " << accounts.size() << " accounts, " << entries
+         << " entries in " << threadCount << " files, " << fixed << setprecision(3) << seconds << " s\n";
+    return 0;
+}
+
+void displayAuditFailures(const char* label, const vector<uint32_t>& accountNumbers) {
+    if (accountNumbers.empty()) return;
+    cout << "  " << label << accountNumbers.size() << ":";
+    for (size_t i = 0; i < accountNumbers.size() && i < 20; i++) {
+        cout << " ACCT" << accountNumbers[i];
+    }
+    cout << (accountNumbers.size() > 20 ? " ...\n" : "\n");
+}
+
+// Checks every account's hash chain and balance, re-hashing only what was
+// sealed since the marks in statePath, then saves the advanced marks. An
+// account that fails keeps its old mark and so fails again until looked into.
+int runLedgerAudit(const Bank& bank, const string& statePath, unsigned threadCount) {
+    LedgerAuditState state;
+    if (!state.load(statePath)) {
+        cout << "Error: Audit state '" << statePath << "' is damaged; move it aside to audit from scratch.\n";
+        return 1;
+    }
+    size_t marksBefore = state.size();
+    LedgerAuditSummary summary = auditLedger(bank, state, threadCount);
+
+    cout << "Audit: " << summary.accounts << " accounts, " << summary.threads << " threads, "
+         << marksBefore << " earlier marks\n";
+    cout << "  Chunks verified:     " << summary.chunksVerified << "\n";
+    cout << "  Chunks skipped:      " << summary.chunksSkipped << " (covered by an earlier audit)\n";
+    cout << "  Records checked:     " << summary.recordsVerified << " (re-hashed chunks and unsealed tails)\n";
+    cout << "  Accounts rebased:    " << summary.rebased << " (chain restarted by a snapshot)\n";
+    cout << "  Book root:           " << formatDigest(summary.bookRoot) << "\n";
+    cout << "  Wall time:           " << fixed << setprecision(3) << summary.seconds << " s\n";
+    displayAuditFailures("Broken chains:       ", summary.brokenChains);
+    displayAuditFailures("Balance mismatches:  ", summary.balanceMismatches);
+    displayAuditFailures("Unreadable history:  ", summary.unreadable);
+    if (!state.save(statePath)) {
+        cout << "Error: Unable to write audit state '" << statePath << "'.\n";
+        return 1;
+    }
+    cout << (summary.clean() ? "Ledger is consistent.\n" : "Ledger audit FAILED.\n");
+    return summary.clean() ? 0 : 1;
+}
+
+// Parses count colon-separated weights such as "40:30:30"; at least one must be nonzero
+bool parseMixWeights(const string& text, unsigned* weights, int count) {
+    vector<unsigned> parsed(count);
+    unsigned totalWeight = 0;
+    size_t position = 0;
+    for (int i = 0; i < count; i++) {
+        size_t separator = text.find(':', position);
+        if ((separator == string::npos) != (i == count - 1)) return false;
+        string field = text.substr(position, separator == string::npos ? string::npos : separator - position);
+        if (field.empty() || field.find_first_not_of("0123456789") != string::npos || field.size() > 6) return false;
+        parsed[i] = (unsigned)stoul(field);
+        totalWeight += parsed[i];
+        position = separator + 1;
+    }
+    if (totalWeight == 0) return false;
+    copy(parsed.begin(), parsed.end(), weights);
+    return true;
+}
+
+// Here we write a synthetic batch file: customers, their accounts, an opening
+// deposit into every account and then a stream of deposits, withdrawals and
+// transfers. Which accounts an operation touches follows either a uniform or a
+// Zipf distribution (rank k drawn with weight 1 / k^s), with ranks scattered
+// over the account numbers so the busy accounts are not simply the oldest.
+//
+// Everything comes from one seeded nextRandom stream and the file is the
+// binary batch format, so a seed always yields the same bytes, and replaying
+// the file with --batch into an empty ledger gives the same balances on every
+// build. The batch summary prints a digest of them to compare. Numbers are
+// assigned in creation order, which is why the ledger must start empty.
+enum WorkloadOperation { WORKLOAD_DEPOSIT, WORKLOAD_WITHDRAW, WORKLOAD_TRANSFER, WORKLOAD_OPERATION_COUNT };
+
+struct WorkloadConfig {
+    size_t customers = 0;
+    size_t accounts = 0;
+    size_t operations = 0;
+    unsigned mix[WORKLOAD_OPERATION_COUNT] = {40, 30, 30};
+    double zipfExponent = 0;        // 0 for uniform
+    uint64_t seed = 1;
+};
+
+// "uniform", "zipf" (s = 0.99) or "zipf:<s>"
+bool parseWorkloadSkew(const string& text, double& zipfExponent) {
+    if (text == "uniform") {
+        zipfExponent = 0;
+        return true;
+    }
+    if (text == "zipf") {
+        zipfExponent = 0.99;
         return true;
     }
-    return false;
+    char* end;
+    if (text.compare(0, 5, "zipf:") != 0) return false;
+    zipfExponent = strtod(text.c_str() + 5, &end);
+    return *end == '\0' && end != text.c_str() + 5 && zipfExponent > 0 && zipfExponent <= 5;
+}
+
+// Picks account indexes, [0, count), with the configured skew
+class AccountPicker {
+private:
+    vector<double> cumulative;      // running Zipf weight by rank; empty for uniform
+    vector<uint32_t> rankToIndex;
+    size_t count;
+
+public:
+    AccountPicker(size_t accountCount, double zipfExponent, uint64_t& state) : count(accountCount) {
+        if (zipfExponent <= 0) return;
+        cumulative.resize(count);
+        double total = 0;
+        for (size_t rank = 0; rank < count; rank++) {
+            total += 1.0 / pow((double)(rank + 1), zipfExponent);
+            cumulative[rank] = total;
+        }
+        rankToIndex.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            rankToIndex[i] = (uint32_t)i;
+        }
+        for (size_t i = count - 1; i > 0; i--) {
+            swap(rankToIndex[i], rankToIndex[nextRandom(state) % (i + 1)]);
+        }
+    }
+
+    size_t pick(uint64_t& state) const {
+        if (cumulative.empty()) return (size_t)(nextRandom(state) % count);
+        double point = (double)(nextRandom(state) >> 11) * 0x1.0p-53 * cumulative.back();
+        size_t rank = (size_t)(upper_bound(cumulative.begin(), cumulative.end(), point) - cumulative.begin());
+        return rankToIndex[min(rank, count - 1)];
+    }
+};
+
+void generateWorkload(const WorkloadConfig& config, BatchFile& batch) {
+    uint64_t state = config.seed * 0x9E3779B97F4A7C15ULL + 0x5eed;
+    AccountPicker picker(config.accounts, config.zipfExponent, state);
+    batch.records.clear();
+    batch.records.reserve(config.customers + config.accounts * 2 + config.operations);
+
+    BatchRecord record = {};
+    record.textIndex = NO_TEXT;
+    record.op = 'C';
+    for (size_t i = 0; i < config.customers; i++) {
+        batch.records.push_back(record);
+    }
+    for (size_t i = 0; i < config.accounts; i++) {
+        record.op = 'A';
+        record.primary = (uint32_t)(FIRST_CUSTOMER_NUMBER + i % config.customers);
+        record.accountKind = nextRandom(state) % 2 == 0 ? 'S' : 'C';
+        batch.records.push_back(record);
+    }
+    record.accountKind = 0;
+    for (size_t i = 0; i < config.accounts; i++) {
+        record.op = 'D';
+        record.primary = (uint32_t)(FIRST_ACCOUNT_NUMBER + i);
+        record.amountCents = 100000 + (Cents)(nextRandom(state) % 900000);   // $1,000 to $10,000
+        batch.records.push_back(record);
+    }
+
+    unsigned totalWeight = config.mix[WORKLOAD_DEPOSIT] + config.mix[WORKLOAD_WITHDRAW] + config.mix[WORKLOAD_TRANSFER];
+    for (size_t i = 0; i < config.operations; i++) {
+        unsigned roll = (unsigned)(nextRandom(state) % totalWeight);
+        int operation = 0;
+        while (roll >= config.mix[operation]) {
+            roll -= config.mix[operation];
+            operation++;
+        }
+        record.primary = (uint32_t)(FIRST_ACCOUNT_NUMBER + picker.pick(state));
+        record.secondary = 0;
+        record.amountCents = 100 + (Cents)(nextRandom(state) % 50000);          // $1 to $500
+        if (operation == WORKLOAD_DEPOSIT) {
+            record.op = 'D';
+        } else if (operation == WORKLOAD_WITHDRAW) {
+            record.op = 'W';
+        } else {
+            record.op = 'T';
+            // A few redraws, then settle for a rejected same-account transfer
+            for (int attempt = 0; attempt < 8 && (record.secondary == 0 || record.secondary == record.primary);
+                 attempt++) {
+                record.secondary = (uint32_t)(FIRST_ACCOUNT_NUMBER + picker.pick(state));
+            }
+        }
+        batch.records.push_back(record);
+    }
 }
 
-void Account::addTransaction(Transaction* transaction) {
-    transactions.push_back(transaction);
+int runWorkloadGenerator(const string& path, const WorkloadConfig& config) {
+    if (config.customers == 0 || config.accounts == 0) {
+        cout << "Error: A workload needs at least one customer and one account.\n";
+        return 1;
+    }
+    BatchFile batch;
+    generateWorkload(config, batch);
+    if (!writeBinaryBatchFile(path, batch)) {
+        cout << "Error: Unable to write '" << path << "'.\n";
+        return 1;
+    }
+    cout << "Generated " << batch.records.size() << " operations (" << config.customers << " customers, "
+         << config.accounts << " accounts, " << config.operations << " in the stream, ";
+    if (config.zipfExponent > 0) {
+        cout << "zipf " << config.zipfExponent;
+    } else {
+        cout << "uniform";
+    }
+    cout << ", seed " << config.seed << ")\n";
+    return 0;
 }
 
-void Account::displayAccountInfo() const {
-    cout << "\nAccount Information:\n";
-    cout << "Account Number: " << accountNumber << "\n";
-    cout << "Type: " << accountType << "\n";
-    cout << "Balance: $" << fixed << setprecision(2) << balance << "\n";
-    cout << "Owner: " << owner->getName() << "\n";
+// Swallows everything written to it; lets the history benchmark include the
+// formatting work of displayTransactionHistory without flooding the terminal
+class NullStreamBuffer : public streambuf {
+protected:
+    int overflow(int character) override { return character; }
+    streamsize xsputn(const char*, streamsize count) override { return count; }
+};
+
+enum BenchmarkOperation {
+    BENCH_DEPOSIT,
+    BENCH_WITHDRAW,
+    BENCH_TRANSFER,
+    BENCH_HISTORY,
+    BENCH_OPERATION_COUNT
+};
+
+const char* BENCHMARK_OPERATION_NAMES[BENCH_OPERATION_COUNT] = {"deposit", "withdraw", "transfer", "history"};
+
+struct BenchmarkConfig {
+    size_t accounts = 1000;
+    size_t historyDepth = 100;              // transactions each account starts with
+    size_t operations = 1000000;
+    unsigned mix[BENCH_OPERATION_COUNT] = {40, 30, 25, 5};   // relative weights
+    int historyLimit = 10;
+    string outputPath;                      // JSON results, skipped when empty
+};
+
+// Parses "deposit:withdraw:transfer:history" weights such as "40:30:25:5"
+bool parseBenchmarkMix(const string& text, unsigned mix[BENCH_OPERATION_COUNT]) {
+    return parseMixWeights(text, mix, BENCH_OPERATION_COUNT);
 }
 
-void Account::displayTransactionHistory(int limit) const {
-    cout << "\nTransaction History (Last " << min(limit, (int)transactions.size()) << " transactions):\n";
-    cout << left << setw(20) << "Timestamp"
-         << setw(15) << "Transaction ID"
-         << setw(25) << "Description"
-         << setw(10) << "Type"
-         << "Amount\n";
-    
-    int start = max(0, (int)transactions.size() - limit);
-    for (int i = start; i < transactions.size(); i++) {
-        transactions[i]->displayTransactionInfo();
+bool writeBenchmarkResults(const BenchmarkConfig& config, const LatencyHistogram* histograms,
+                           const double* seconds) {
+    ofstream out(config.outputPath);
+    if (!out) return false;
+    out << "{\n  \"benchmark\": \"account-operations\",\n";
+    out << "  \"accounts\": " << config.accounts << ",\n";
+    out << "  \"history_depth\": " << config.historyDepth << ",\n";
+    out << "  \"operations\": " << config.operations << ",\n";
+    out << "  \"mix\": [" << config.mix[0] << ", " << config.mix[1] << ", " << config.mix[2] << ", "
+        << config.mix[3] << "],\n";
+    out << "  \"results\": [\n";
+    bool first = true;
+    for (int op = 0; op < BENCH_OPERATION_COUNT; op++) {
+        const LatencyHistogram& histogram = histograms[op];
+        if (histogram.getCount() == 0) continue;
+        out << (first ? "" : ",\n") << fixed << setprecision(1);
+        out << "    {\"operation\": \"" << BENCHMARK_OPERATION_NAMES[op] << "\", \"count\": " << histogram.getCount()
+            << ", \"ops_per_second\": " << histogram.getCount() / seconds[op]
+            << ", \"mean_ns\": " << histogram.getMean()
+            << ", \"p50_ns\": " << histogram.percentile(0.50)
+            << ", \"p99_ns\": " << histogram.percentile(0.99)
+            << ", \"p999_ns\": " << histogram.percentile(0.999)
+            << ", \"max_ns\": " << histogram.getMax() << "}";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+    return (bool)out;
+}
+
+// Times every operation on its own and keeps one histogram per operation type.
+// Throughput is operations over the time spent inside that operation, so the
+// random choice of accounts between calls is not charged to any of them.
+int runAccountBenchmark(Bank& bank, const BenchmarkConfig& config) {
+    if (config.accounts < 2 || config.operations == 0) {
+        cout << "Error: Need at least 2 accounts and 1 operation.\n";
+        return 1;
+    }
+
+    vector<Account*> accounts;
+    accounts.reserve(config.accounts);
+    for (size_t i = 0; i < config.accounts; i++) {
+        Customer* customer = bank.createCustomer("Bench Customer", "", "");
+        Account* account = bank.openAccount(customer, i % 2 == 0 ? "Savings" : "Checking");
+        account->deposit(100000000);
+        for (size_t h = 1; h < config.historyDepth; h++) {
+            account->deposit(1);
+        }
+        accounts.push_back(account);
+    }
+
+    unsigned totalWeight = 0;
+    for (unsigned weight : config.mix) totalWeight += weight;
+
+    LatencyHistogram histograms[BENCH_OPERATION_COUNT];
+    double seconds[BENCH_OPERATION_COUNT] = {};
+    NullStreamBuffer discard;
+    streambuf* console = cout.rdbuf(&discard);
+    uint64_t rng = 0x2545F4914F6CDD1DULL;
+    for (size_t i = 0; i < config.operations; i++) {
+        unsigned pick = (unsigned)(nextRandom(rng) % totalWeight);
+        int op = 0;
+        while (pick >= config.mix[op]) {
+            pick -= config.mix[op];
+            op++;
+        }
+        Account* source = accounts[nextRandom(rng) % accounts.size()];
+        Account* target = accounts[nextRandom(rng) % accounts.size()];
+        Cents amount = 1 + (Cents)(nextRandom(rng) % 10000);
+
+        auto start = chrono::steady_clock::now();
+        switch (op) {
+            case BENCH_DEPOSIT: source->deposit(amount); break;
+            case BENCH_WITHDRAW: source->withdraw(amount); break;
+            case BENCH_TRANSFER: if (source != target) source->transfer(*target, amount); break;
+            default: displayTransactionHistory(ReadView(), *source, config.historyLimit); break;
+        }
+        auto elapsed = chrono::steady_clock::now() - start;
+        histograms[op].record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+        seconds[op] += chrono::duration<double>(elapsed).count();
+    }
+    cout.rdbuf(console);
+    bank.commitLedger();
+
+    cout << "Account benchmark: " << config.accounts << " accounts, history depth " << config.historyDepth
+         << ", " << config.operations << " operations\n";
+    cout << left << setw(10) << "Operation" << setw(10) << "Count" << setw(12) << "Ops/s"
+         << setw(10) << "p50 ns" << setw(10) << "p99 ns" << setw(10) << "p999 ns" << "max ns\n";
+    for (int op = 0; op < BENCH_OPERATION_COUNT; op++) {
+        const LatencyHistogram& histogram = histograms[op];
+        if (histogram.getCount() == 0) continue;
+        cout << left << setw(10) << BENCHMARK_OPERATION_NAMES[op] << setw(10) << histogram.getCount()
+             << setw(12) << fixed << setprecision(0) << histogram.getCount() / seconds[op]
+             << setw(10) << histogram.percentile(0.50) << setw(10) << histogram.percentile(0.99)
+             << setw(10) << histogram.percentile(0.999) << histogram.getMax() << "\n";
+    }
+
+    if (!config.outputPath.empty()) {
+        if (!writeBenchmarkResults(config, histograms, seconds)) {
+            cout << "Error: Unable to write benchmark results to '" << config.outputPath << "'.\n";
+            return 1;
+        }
+        cout << "Results written to " << config.outputPath << "\n";
     }
+    return 0;
 }
 
-string generateCustomerId() {
-    static int counter = 1000;
-    return "CUST" + to_string(counter++);
+volatile sig_atomic_t serviceStopSignal = 0;
+
+void requestServiceStop(int) {
+    serviceStopSignal = 1;
+}
+
+// Serves the socket protocol in bank_service.h until SIGINT or SIGTERM. Accounts
+// are opened (with $1,000,000 each) until the bank holds at least accountCount,
+// so a load generator has something to drive against a fresh ledger. As shard
+// index of shardCount, only the numbers below FIRST_ACCOUNT_NUMBER + accountCount
+// that belong to this shard are opened, so every shard of a set started with
+// the same count agrees on who holds what.
+int runService(Bank& bank, const string& socketPath, size_t accountCount, uint32_t shardIndex, uint32_t shardCount) {
+    if (shardCount <= 1) {
+        while (bank.getAccountCount() < accountCount) {
+            Customer* customer = bank.createCustomer("Service Customer", "", "");
+            bank.openAccount(customer, bank.getAccountCount() % 2 == 0 ? "Savings" : "Checking")->deposit(100000000);
+        }
+    } else {
+        for (uint32_t number = FIRST_ACCOUNT_NUMBER; number < FIRST_ACCOUNT_NUMBER + accountCount; number++) {
+            if (shardForAccount(number, shardCount) != shardIndex || bank.findAccountByNumber(number) != nullptr) {
+                continue;
+            }
+            Customer* customer = bank.createCustomer("Service Customer", "", "");
+            Account* account = bank.openAccount(customer, number % 2 == 0 ? "Savings" : "Checking", number);
+            if (account == nullptr) {
+                cout << "Error: Account number " << number << " is already taken.\n";
+                return 1;
+            }
+            account->deposit(100000000);
+        }
+    }
+    if (!bank.commitLedger()) {
+        cout << "Error: Ledger log write failed.\n";
+        return 1;
+    }
+
+    BankService service(bank);
+    if (!service.listen(socketPath)) {
+        cout << "Error: Unable to listen on '" << socketPath << "'.\n";
+        return 1;
+    }
+    cout << "Serving " << bank.getAccountCount() << " accounts on " << socketPath;
+    if (shardCount > 1) {
+        cout << " as shard " << shardIndex << "/" << shardCount << " ("
+             << bank.getPendingTransfers().size() << " prepared transfers pending)";
+    }
+    cout << " (SIGINT or SIGTERM to stop)\n" << flush;
+
+    signal(SIGINT, requestServiceStop);
+    signal(SIGTERM, requestServiceStop);
+    auto started = chrono::steady_clock::now();
+    bool ledgerOk = service.run(serviceStopSignal);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    const ServiceStats& stats = service.getStats();
+    cout << "Service stopped after " << fixed << setprecision(1) << seconds << " s: "
+         << stats.connections << " connections, " << stats.requests << " requests in "
+         << stats.rounds << " passes, " << stats.ledgerCommits << " ledger commits\n";
+    if (stats.rounds > 0) {
+        cout << "Average batch: " << setprecision(1) << (double)stats.requests / stats.rounds
+             << " requests per pass, " << stats.bytesIn << " bytes in, " << stats.bytesOut << " bytes out\n";
+    }
+    if (shardCount > 1) {
+        cout << "Prepared transfers still pending: " << bank.getPendingTransfers().size() << "\n";
+    }
+    displayLedgerLogStats(bank);
+    displayVelocityRuleStats();
+    if (!ledgerOk) {
+        cout << "Error: Ledger log write failed; unacknowledged requests were dropped.\n";
+        return 1;
+    }
+    return 0;
 }
 
-string generateAccountNumber() {
-    static int counter = 100000;
-    return "ACCT" + to_string(counter++);
+// Fronts a set of "--serve --shard" processes until SIGINT or SIGTERM; see
+// bank_router.h. The router keeps no accounts of its own, only the decision log.
+int runRouter(const string& socketPath, const string& decisionLogPath, const vector<string>& shardPaths) {
+    ShardRouter router(shardPaths);
+    if (!router.open(socketPath, decisionLogPath)) {
+        cout << "Error: Unable to open decision log '" << decisionLogPath << "' or listen on '"
+             << socketPath << "'.\n";
+        return 1;
+    }
+    cout << "Routing " << socketPath << " over " << shardPaths.size()
+         << " shards (SIGINT or SIGTERM to stop)\n" << flush;
+
+    signal(SIGINT, requestServiceStop);
+    signal(SIGTERM, requestServiceStop);
+    auto started = chrono::steady_clock::now();
+    bool decisionsOk = router.run(serviceStopSignal);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    const ShardRouterStats& stats = router.getStats();
+    cout << "Router stopped after " << fixed << setprecision(1) << seconds << " s: "
+         << stats.connections << " connections, " << stats.requests << " requests, "
+         << stats.forwarded << " forwarded to one shard\n";
+    cout << "Cross-shard transfers: " << stats.crossShardCommitted << " committed, "
+         << stats.crossShardAborted << " aborted, " << stats.decisionSyncs << " decision log syncs, "
+         << stats.recoveredDecisions << " decisions recovered, " << stats.shardConnects
+         << " shard connections, " << router.getUnconfirmedTransfers() << " still in flight\n";
+    if (!decisionsOk) {
+        cout << "Error: Decision log write failed; unacknowledged transfers were dropped.\n";
+        return 1;
+    }
+    return 0;
 }
 
 void displayMainMenu() {
@@ -215,9 +1532,510 @@ void displayHorizontalLine() {
     cout << "---------------------------------------------\n";
 }
 
-int main() {
-    vector<Customer*> customers;
-    vector<Account*> accounts;
+// Here we look the account up by its number (e.g. ACCT100000) instead of listing every account
+Account* promptForAccount(const Bank& bank, const string& prompt, const string& errorMessage) {
+    string accNum;
+    cout << "| " << prompt << " (e.g. ACCT100000): ";
+    cin >> accNum;
+    
+    Account* account = bank.findAccount(accNum);
+    if (account == nullptr) {
+        displaySectionHeader("ERROR");
+        cout << "| " << left << setw(41) << errorMessage << " |\n";
+        displayHorizontalLine();
+    }
+    return account;
+}
+
+const size_t CUSTOMER_SEARCH_PAGE_SIZE = 10;
+
+// Here we page through the customers whose name (or phone, for all-digit input) starts with the query
+Customer* pickCustomerFromSearch(const Bank& bank, const string& query) {
+    bool digitsOnly = query.find_first_not_of("0123456789+-() ") == string::npos;
+    CustomerSearchField field = digitsOnly ? CustomerSearchField::Phone : CustomerSearchField::Name;
+    CustomerSearchCursor cursor;
+    
+    while (true) {
+        CustomerSearchPage page = bank.searchCustomers(field, query, false, CUSTOMER_SEARCH_PAGE_SIZE, cursor);
+        if (page.customers.empty()) {
+            return nullptr;
+        }
+        
+        displayHorizontalLine();
+        for (size_t i = 0; i < page.customers.size(); i++) {
+            const Customer* match = page.customers[i];
+            cout << "| " << right << setw(2) << (i + 1) << ". " << left << setw(10) << match->getCustomerId()
+                 << setw(16) << match->getName().substr(0, 15) << match->getPhoneNumber() << "\n";
+        }
+        displayHorizontalLine();
+        cout << "| Pick 1-" << page.customers.size() << (page.hasMore ? ", 'n' for more" : "")
+             << ", or Enter to cancel: ";
+        
+        string answer;
+        getline(cin, answer);
+        if (answer.empty()) {
+            return nullptr;
+        }
+        if (page.hasMore && (answer == "n" || answer == "N")) {
+            cursor = page.next;
+            continue;
+        }
+        char* end = nullptr;
+        unsigned long pick = strtoul(answer.c_str(), &end, 10);
+        if (*end == '\0' && pick >= 1 && pick <= page.customers.size()) {
+            return page.customers[pick - 1];
+        }
+        return nullptr;
+    }
+}
+
+Customer* promptForCustomer(const Bank& bank) {
+    string query;
+    cout << "| Enter customer ID, name or phone prefix: ";
+    cin >> ws;
+    getline(cin, query);
+    
+    Customer* customer = bank.findCustomer(query);
+    if (customer == nullptr && !query.empty()) {
+        customer = pickCustomerFromSearch(bank, query);
+    }
+    if (customer == nullptr) {
+        displaySectionHeader("ERROR");
+        cout << "| Invalid customer selection!            |\n";
+        displayHorizontalLine();
+    }
+    return customer;
+}
+
+// Options shared by every mode, pulled out of the argument list before the mode is picked
+struct LedgerOptions {
+    string walPath;
+    bool walPathGiven = false;
+    bool walDisabled = false;
+    size_t commitBatchSize = 1024;
+    long commitLatencyMicros = 2000;
+    string snapshotPath;
+    bool snapshotPathGiven = false;
+    long snapshotIntervalSeconds = 60;
+    string historyStorePath;
+    bool historyStorePathGiven = false;
+    size_t historyResidentRecords = 1024;
+    string metricsPath;
+    long metricsIntervalSeconds = 15;
+    uint32_t shardIndex = 0;
+    uint32_t shardCount = 1;
+    RuleAction rulesAction = RuleAction::Off;
+    VelocityRuleSettings rules[RULE_COUNT] = {};    // the defaults until a --rule changes one
+    bool ruleGiven[RULE_COUNT] = {};
+    bool ruleActionGiven[RULE_COUNT] = {};
+};
+
+const char* DEFAULT_LEDGER_LOG = "bank_ledger.wal";
+const char* DEFAULT_SNAPSHOT = "bank_snapshot.bin";
+const char* DEFAULT_HISTORY_STORE = "bank_history.seg";
+
+bool parseRuleAction(const string& text, RuleAction& action) {
+    if (text == "off") {
+        action = RuleAction::Off;
+    } else if (text == "flag") {
+        action = RuleAction::Flag;
+    } else if (text == "block") {
+        action = RuleAction::Block;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// "<rule>=<limit>/<seconds>[/<action>]"; limits are dollars except for withdrawal_count
+bool parseVelocityRule(const string& text, LedgerOptions& options) {
+    size_t equals = text.find('=');
+    size_t slash = text.find('/', equals);
+    if (equals == string::npos || slash == string::npos) return false;
+    int rule = 0;
+    while (rule < RULE_COUNT && text.compare(0, equals, VELOCITY_RULE_NAMES[rule]) != 0) rule++;
+    if (rule == RULE_COUNT) return false;
+
+    VelocityRuleSettings& settings = options.rules[rule];
+    char* end;
+    double limit = strtod(text.c_str() + equals + 1, &end);
+    if (end != text.c_str() + slash || limit < 0) return false;
+    settings.limit = rule == RULE_WITHDRAWAL_COUNT ? (uint64_t)limit : (uint64_t)dollarsToCents(limit);
+    settings.windowSeconds = strtol(text.c_str() + slash + 1, &end, 10);
+    if (settings.windowSeconds <= 0) return false;
+    if (*end == '/') {
+        if (!parseRuleAction(end + 1, settings.action)) return false;
+        options.ruleActionGiven[rule] = true;
+    } else if (*end != '\0') {
+        return false;
+    }
+    options.ruleGiven[rule] = true;
+    return true;
+}
+
+// Turns the rules on before anything is recovered, so replayed payments refill their windows
+void configureVelocityRules(const LedgerOptions& options) {
+    VelocityRuleSettings rules[RULE_COUNT];
+    for (int rule = 0; rule < RULE_COUNT; rule++) {
+        rules[rule] = options.rules[rule];
+        if (!options.ruleActionGiven[rule]) {
+            rules[rule].action = options.rulesAction != RuleAction::Off ? options.rulesAction
+                               : options.ruleGiven[rule]              ? RuleAction::Flag
+                                                                      : RuleAction::Off;
+        }
+    }
+    velocityRules.configure(rules);
+}
+
+bool parseLedgerOptions(int argc, char* argv[], LedgerOptions& options, vector<string>& arguments) {
+    VelocityRules::defaultSettings(options.rules);
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "--wal" && hasValue) {
+            options.walPath = argv[++i];
+            options.walPathGiven = true;
+        } else if (argument == "--no-wal") {
+            options.walDisabled = true;
+        } else if (argument == "--wal-batch" && hasValue) {
+            options.commitBatchSize = strtoull(argv[++i], nullptr, 10);
+        } else if (argument == "--wal-latency-us" && hasValue) {
+            options.commitLatencyMicros = strtol(argv[++i], nullptr, 10);
+        } else if (argument == "--snapshot" && hasValue) {
+            options.snapshotPath = argv[++i];
+            options.snapshotPathGiven = true;
+        } else if (argument == "--snapshot-interval" && hasValue) {
+            options.snapshotIntervalSeconds = strtol(argv[++i], nullptr, 10);
+        } else if (argument == "--history-store" && hasValue) {
+            options.historyStorePath = argv[++i];
+            options.historyStorePathGiven = true;
+        } else if (argument == "--history-hot" && hasValue) {
+            options.historyResidentRecords = strtoull(argv[++i], nullptr, 10);
+        } else if (argument == "--metrics" && hasValue) {
+            options.metricsPath = argv[++i];
+        } else if (argument == "--metrics-interval" && hasValue) {
+            options.metricsIntervalSeconds = strtol(argv[++i], nullptr, 10);
+        } else if (argument == "--shard" && hasValue) {
+            unsigned index = 0, count = 0;
+            char extra;
+            if (sscanf(argv[++i], "%u/%u%c", &index, &count, &extra) != 2 || count == 0 || index >= count) {
+                return false;
+            }
+            options.shardIndex = index;
+            options.shardCount = count;
+        } else if (argument == "--rules" && hasValue) {
+            if (!parseRuleAction(argv[++i], options.rulesAction)) return false;
+        } else if (argument == "--rule" && hasValue) {
+            if (!parseVelocityRule(argv[++i], options)) return false;
+        } else if (argument == "--wal" || argument == "--wal-batch" || argument == "--wal-latency-us" ||
+                   argument == "--snapshot" || argument == "--snapshot-interval" ||
+                   argument == "--history-store" || argument == "--history-hot" ||
+                   argument == "--metrics" || argument == "--metrics-interval" || argument == "--shard" ||
+                   argument == "--rules" || argument == "--rule") {
+            return false;
+        } else {
+            arguments.push_back(argument);
+        }
+    }
+    return true;
+}
+
+// Older history spills to the store at path once an account has more than
+// residentRecords in memory. Must run before any account is created.
+bool openHistoryStore(ColdHistoryStore& store, const string& path, size_t residentRecords) {
+    if (!store.open(path)) {
+        cout << "Error: Unable to open history store '" << path << "'.\n";
+        return false;
+    }
+    TransactionLog::configureTiering(&store, residentRecords);
+    return true;
+}
+
+// Loads the snapshot (if any), replays the log at path from where the snapshot
+// left off, and keeps appending to it. An empty log path skips the log.
+bool openLedger(Bank& bank, WriteAheadLog& log, const string& path, const string& snapshotPath,
+                const LedgerOptions& options) {
+    uint64_t replayFrom = 0;
+    if (!snapshotPath.empty()) {
+        SnapshotSummary snapshot;
+        bool found = false;
+        if (loadSnapshot(bank, snapshotPath, snapshot, found)) {
+            replayFrom = snapshot.logOffset;
+            cout << "Loaded snapshot " << snapshotPath << ": " << snapshot.customers << " customers, "
+                 << snapshot.accounts << " accounts in " << fixed << setprecision(3) << snapshot.seconds << " s\n";
+        } else if (found) {
+            cout << "Error: Snapshot '" << snapshotPath << "' is damaged; move it aside to recover from the log.\n";
+            return false;
+        }
+    }
+    if (path.empty()) return true;
+
+    LedgerRecoverySummary recovery;
+    if (!replayLedgerLog(bank, path, recovery, replayFrom)) {
+        if (recovery.rejectedRecord) {
+            cout << "Error: Ledger log '" << path << "' has a record (type " << (int)recovery.rejectedRecordType
+                 << ", at byte " << recovery.validBytes << ") that cannot be applied; the log was left as it is.\n";
+        } else {
+            cout << "Error: Unable to recover ledger log '" << path << "'.\n";
+        }
+        return false;
+    }
+    if (recovery.customers + recovery.accounts + recovery.entries > 0) {
+        cout << "Recovered " << recovery.customers << " customers, " << recovery.accounts << " accounts and "
+             << recovery.entries << " ledger entries from " << path << "\n";
+    }
+    if (recovery.truncatedTail) {
+        cout << "Warning: Discarded an incomplete record at the end of " << path << "\n";
+    }
+
+    if (!log.open(path, options.commitBatchSize, chrono::microseconds(max(options.commitLatencyMicros, 0L)))) {
+        cout << "Error: Unable to open ledger log '" << path << "' for writing.\n";
+        return false;
+    }
+    bank.attachLedgerLog(&log);
+    return true;
+}
+
+void writeSnapshotOrWarn(Bank& bank, const string& path) {
+    SnapshotSummary summary;
+    if (writeSnapshot(bank, path, summary)) {
+        cout << "Snapshot " << path << ": " << summary.customers << " customers, " << summary.accounts
+             << " accounts written in " << fixed << setprecision(3) << summary.seconds << " s\n";
+    } else {
+        cout << "Warning: Unable to write snapshot '" << path << "'.\n";
+    }
+}
+
+void displayUsage(const char* program) {
+    cout << "Usage:\n";
+    cout << "  " << program << " [options]                    interactive menu\n";
+    cout << "  " << program << " [options] --batch <file>     apply a CSV or binary batch file\n";
+    cout << "  " << program << " [options] --clearing <file> [legs]\n";
+    cout << "        apply a batch file with its transfers netted in batches of up to that many legs\n";
+    cout << "        (default 10000), each booked all or nothing\n";
+    cout << "  " << program << " --convert <in.csv> <out.bin> convert a CSV batch to the binary format\n";
+    cout << "  " << program << " --generate <out.bin> <customers> <accounts> <operations> [mix] [skew] [seed]\n";
+    cout << "        write a synthetic binary batch; mix is deposit:withdraw:transfer weights (default\n";
+    cout << "        40:30:30), skew is uniform, zipf or zipf:<s>; replay it with --batch into an\n";
+    cout << "        empty ledger and compare the balances digest between builds\n";
+    cout << "  " << program << " [options] --concurrent <accounts> <transfers per thread> <max threads>\n";
+    cout << "        measure multi-threaded transfer throughput and lock conflicts\n";
+    cout << "  " << program << " [options] --standing-orders <accounts> <orders> <days>\n";
+    cout << "        schedule recurring transfers and run a simulated clock forward day by day\n";
+    cout << "  " << program << " [options] --end-of-day <threads>\n";
+    cout << "        post Savings interest and Checking fees to every account (0 threads: one per core)\n";
+    cout << "  " << program << " [options] --balance-at <account> <time>\n";
+    cout << "  " << program << " [options] --statement <account> <from> <to>\n";
+    cout << "        times are UTC, YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS; a statement covers [from, to)\n";
+    cout << "  " << program << " [options] --statements <YYYY-MM> <file prefix> <threads>\n";
+    cout << "        write that month's statement for every account, one file per thread\n";
+    cout << "  " << program << " [options] --audit <state file> [threads]\n";
+    cout << "        verify every account's hash chain and balance, re-hashing only history sealed\n";
+    cout << "        since the marks saved in the state file (0 threads: one per core)\n";
+    cout << "  " << program << " [options] --bench <accounts> <history depth> <operations> [mix] [results.json]\n";
+    cout << "        time deposit/withdraw/transfer/history calls; mix is weights such as 40:30:25:5\n";
+    cout << "  " << program << " [options] --serve <socket> [accounts]\n";
+    cout << "        serve requests on a Unix domain socket, opening accounts until there are that many\n";
+    cout << "  " << program << " --route <socket> <decision log> <shard socket>...\n";
+    cout << "        serve one bank split across \"--serve --shard i/n\" processes, given in shard order\n";
+    cout << "Options:\n";
+    cout << "  --wal <path>            ledger log to recover from and append to\n";
+    cout << "                          (interactive default: " << DEFAULT_LEDGER_LOG << ")\n";
+    cout << "  --no-wal                keep everything in memory only\n";
+    cout << "  --wal-batch <n>         records per group commit (default 1024)\n";
+    cout << "  --wal-latency-us <n>    longest a record waits for its commit (default 2000)\n";
+    cout << "  --snapshot <path>       snapshot to start from and refresh in the background\n";
+    cout << "                          (interactive default: " << DEFAULT_SNAPSHOT << ")\n";
+    cout << "  --snapshot-interval <s> seconds between background snapshots, 0 for none (default 60)\n";
+    cout << "  --history-store <path>  spill older transaction history to this file\n";
+    cout << "                          (interactive default: " << DEFAULT_HISTORY_STORE << ")\n";
+    cout << "  --history-hot <n>       transactions per account kept in memory (default 1024)\n";
+    cout << "  --metrics <path>        dump Prometheus-format metrics here on exit, on SIGUSR1\n";
+    cout << "                          and every --metrics-interval seconds (default 15, 0 for none)\n";
+    cout << "  --shard <i>/<n>         with --serve, hold only shard i of n (counted from 0)\n";
+    cout << "  --rules <flag|block>    run every velocity rule on withdrawals and transfers, flagging\n";
+    cout << "                          or refusing the payments that trip one (default off)\n";
+    cout << "  --rule <rule>=<limit>/<seconds>[/<flag|block|off>]\n";
+    cout << "                          set one rule; limits are dollars except withdrawal_count:\n";
+    cout << "                          withdrawal_count=10/60, account_outflow=10000/3600,\n";
+    cout << "                          customer_outflow=25000/86400, new_account_credit=5000/86400\n";
+}
+
+void writeMetricsOrWarn(const Bank& bank, const string& path) {
+    if (!path.empty() && !writeMetricsFile(bank, path)) {
+        cout << "Warning: Unable to write metrics '" << path << "'.\n";
+    }
+}
+
+int runCommandLine(const char* program, const vector<string>& arguments, const LedgerOptions& options) {
+    const string& mode = arguments[0];
+    if (mode == "--convert" && arguments.size() == 3) {
+        BatchFile batch;
+        if (!loadBatchFile(arguments[1], batch)) {
+            cout << "Error: Unable to open batch file '" << arguments[1] << "'.\n";
+            return 1;
+        }
+        if (!writeBinaryBatchFile(arguments[2], batch)) {
+            cout << "Error: Unable to write '" << arguments[2] << "'.\n";
+            return 1;
+        }
+        cout << "Converted " << batch.records.size() << " operations ("
+             << batch.malformedLines << " malformed lines skipped).\n";
+        return 0;
+    }
+    if (mode == "--generate" && arguments.size() >= 5 && arguments.size() <= 8) {
+        WorkloadConfig workload;
+        workload.customers = strtoull(arguments[2].c_str(), nullptr, 10);
+        workload.accounts = strtoull(arguments[3].c_str(), nullptr, 10);
+        workload.operations = strtoull(arguments[4].c_str(), nullptr, 10);
+        if ((arguments.size() >= 6 && !parseMixWeights(arguments[5], workload.mix, WORKLOAD_OPERATION_COUNT)) ||
+            (arguments.size() >= 7 && !parseWorkloadSkew(arguments[6], workload.zipfExponent))) {
+            displayUsage(program);
+            return 1;
+        }
+        if (arguments.size() == 8) {
+            workload.seed = strtoull(arguments[7].c_str(), nullptr, 10);
+        }
+        return runWorkloadGenerator(arguments[1], workload);
+    }
+    if (mode == "--route" && arguments.size() >= 4) {
+        return runRouter(arguments[1], arguments[2], vector<string>(arguments.begin() + 3, arguments.end()));
+    }
+
+    bool batchMode = mode == "--batch" && arguments.size() == 2;
+    bool clearingMode = mode == "--clearing" && (arguments.size() == 2 || arguments.size() == 3);
+    size_t clearingLegs = arguments.size() == 3 ? strtoull(arguments[2].c_str(), nullptr, 10) : 10000;
+    if (clearingMode && clearingLegs == 0) {
+        clearingMode = false;
+    }
+    bool concurrentMode = mode == "--concurrent" && arguments.size() == 4;
+    bool endOfDayMode = mode == "--end-of-day" && arguments.size() == 2;
+    bool benchmarkMode = mode == "--bench" && arguments.size() >= 4 && arguments.size() <= 6;
+    BenchmarkConfig benchmark;
+    if (benchmarkMode) {
+        benchmark.accounts = strtoull(arguments[1].c_str(), nullptr, 10);
+        benchmark.historyDepth = strtoull(arguments[2].c_str(), nullptr, 10);
+        benchmark.operations = strtoull(arguments[3].c_str(), nullptr, 10);
+        if (arguments.size() >= 5) {
+            benchmarkMode = parseBenchmarkMix(arguments[4], benchmark.mix);
+        }
+        if (arguments.size() == 6) {
+            benchmark.outputPath = arguments[5];
+        }
+    }
+    bool balanceMode = mode == "--balance-at" && arguments.size() == 3;
+    bool statementMode = mode == "--statement" && arguments.size() == 4;
+    bool monthlyMode = mode == "--statements" && arguments.size() == 4;
+    bool serviceMode = mode == "--serve" && (arguments.size() == 2 || arguments.size() == 3);
+    bool standingOrdersMode = mode == "--standing-orders" && arguments.size() == 4;
+    bool auditMode = mode == "--audit" && (arguments.size() == 2 || arguments.size() == 3);
+    if (!batchMode && !clearingMode && !concurrentMode && !endOfDayMode && !benchmarkMode &&
+        !balanceMode && !statementMode && !monthlyMode && !serviceMode && !auditMode && !standingOrdersMode) {
+        displayUsage(program);
+        return 1;
+    }
+
+    configureVelocityRules(options);
+    ColdHistoryStore historyStore;
+    if (options.historyStorePathGiven &&
+        !openHistoryStore(historyStore, options.historyStorePath, options.historyResidentRecords)) {
+        return 1;
+    }
+    WriteAheadLog ledgerLog;
+    Bank bank;
+    if (!openLedger(bank, ledgerLog, options.walDisabled ? "" : options.walPath, options.snapshotPath, options)) {
+        return 1;
+    }
+
+    int status;
+    {
+        VersionReclaimer versionReclaimer(bank);
+        unique_ptr<SnapshotScheduler> snapshots;
+        unique_ptr<MetricsScheduler> metrics;
+        if (!options.metricsPath.empty()) {
+            metrics.reset(new MetricsScheduler(bank, options.metricsPath, options.metricsIntervalSeconds));
+        }
+        if (!options.snapshotPath.empty() && options.snapshotIntervalSeconds > 0) {
+            snapshots.reset(new SnapshotScheduler(bank, options.snapshotPath, options.snapshotIntervalSeconds));
+        }
+        if (batchMode || clearingMode) {
+            BatchSummary summary = runBatch(bank, arguments[1], clearingMode ? clearingLegs : 0);
+            displayBatchSummary(bank, summary);
+            status = summary.applied + summary.rejected == 0 && summary.malformed > 0 ? 1 : 0;
+        } else if (endOfDayMode) {
+            status = runEndOfDay(bank, (unsigned)strtoul(arguments[1].c_str(), nullptr, 10));
+        } else if (benchmarkMode) {
+            status = runAccountBenchmark(bank, benchmark);
+        } else if (balanceMode) {
+            status = runBalanceQuery(bank, arguments[1], arguments[2]);
+        } else if (statementMode) {
+            status = runStatementQuery(bank, arguments[1], arguments[2], arguments[3]);
+        } else if (serviceMode) {
+            status = runService(bank, arguments[1],
+                                arguments.size() == 3 ? strtoull(arguments[2].c_str(), nullptr, 10) : 0,
+                                options.shardIndex, options.shardCount);
+        } else if (standingOrdersMode) {
+            status = runStandingOrders(bank, strtoull(arguments[1].c_str(), nullptr, 10),
+                                       strtoull(arguments[2].c_str(), nullptr, 10),
+                                       (unsigned)strtoul(arguments[3].c_str(), nullptr, 10));
+        } else if (auditMode) {
+            status = runLedgerAudit(bank, arguments[1],
+                                    arguments.size() == 3 ? (unsigned)strtoul(arguments[2].c_str(), nullptr, 10) : 0);
+        } else if (monthlyMode) {
+            status = runMonthlyStatements(bank, arguments[1], arguments[2],
+                                          (unsigned)strtoul(arguments[3].c_str(), nullptr, 10));
+        } else {
+            status = runConcurrentBenchmark(bank, strtoull(arguments[1].c_str(), nullptr, 10),
+                                            strtoull(arguments[2].c_str(), nullptr, 10),
+                                            (unsigned)strtoul(arguments[3].c_str(), nullptr, 10));
+        }
+    }
+    if (!options.snapshotPath.empty()) {
+        writeSnapshotOrWarn(bank, options.snapshotPath);
+    }
+    writeMetricsOrWarn(bank, options.metricsPath);
+    return status;
+}
+
+void commitOrWarn(Bank& bank) {
+    if (!bank.commitLedger()) {
+        cout << "| Warning: ledger log write failed!       |\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    LedgerOptions options;
+    vector<string> arguments;
+    if (!parseLedgerOptions(argc, argv, options, arguments)) {
+        displayUsage(argv[0]);
+        return 1;
+    }
+    if (!arguments.empty()) {
+        return runCommandLine(argv[0], arguments, options);
+    }
+    
+    configureVelocityRules(options);
+    ColdHistoryStore historyStore;
+    string historyPath = options.historyStorePathGiven ? options.historyStorePath : DEFAULT_HISTORY_STORE;
+    if (!openHistoryStore(historyStore, historyPath, options.historyResidentRecords)) {
+        return 1;
+    }
+    WriteAheadLog ledgerLog;
+    Bank bank;
+    string ledgerPath = options.walDisabled ? "" : options.walPathGiven ? options.walPath : DEFAULT_LEDGER_LOG;
+    string snapshotPath = options.snapshotPathGiven ? options.snapshotPath : options.walDisabled ? "" : DEFAULT_SNAPSHOT;
+    if (!openLedger(bank, ledgerLog, ledgerPath, snapshotPath, options)) {
+        return 1;
+    }
+    VersionReclaimer versionReclaimer(bank);
+    unique_ptr<SnapshotScheduler> snapshots;
+    unique_ptr<MetricsScheduler> metrics;
+    if (!options.metricsPath.empty()) {
+        metrics.reset(new MetricsScheduler(bank, options.metricsPath, options.metricsIntervalSeconds));
+    }
+    if (!snapshotPath.empty() && options.snapshotIntervalSeconds > 0) {
+        snapshots.reset(new SnapshotScheduler(bank, snapshotPath, options.snapshotIntervalSeconds));
+    }
     
     while (true) {
         displayMainMenu();
@@ -246,13 +2064,12 @@ int main() {
                 cout << "| Enter phone number: ";
                 getline(cin, phone);
                 
-                string custId = generateCustomerId();
-                Customer* newCustomer = new Customer(custId, name, address, phone);
-                customers.push_back(newCustomer);
+                Customer* newCustomer = bank.createCustomer(name, address, phone);
+                commitOrWarn(bank);
                 
                 displayHorizontalLine();
                 cout << "| Customer created successfully!          |\n";
-                cout << "| Customer ID: " << left << setw(30) << custId << " |\n";
+                cout << "| Customer ID: " << left << setw(30) << newCustomer->getCustomerId() << " |\n";
                 displayHorizontalLine();
                 break;
             }
@@ -260,31 +2077,15 @@ int main() {
             case 2: {
                 displaySectionHeader("CREATE NEW ACCOUNT");
                 
-                if (customers.empty()) {
+                if (bank.getCustomerCount() == 0) {
                     cout << "| No customers available.                |\n";
                     cout << "| Please create a customer first.        |\n";
                     displayHorizontalLine();
                     break;
                 }
                 
-                cout << "| Select customer:                       |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < customers.size(); i++) {
-                    cout << "| " << i+1 << ". " << left << setw(38) 
-                         << (customers[i]->getName() + " (" + customers[i]->getCustomerId() + ")") 
-                         << " |\n";
-                }
-                displayHorizontalLine();
-                
-                int custIndex;
-                cout << "| Enter customer number: ";
-                cin >> custIndex;
-                custIndex--;
-                
-                if (custIndex < 0 || custIndex >= customers.size()) {
-                    displaySectionHeader("ERROR");
-                    cout << "| Invalid customer selection!            |\n";
-                    displayHorizontalLine();
+                Customer* customer = promptForCustomer(bank);
+                if (customer == nullptr) {
                     break;
                 }
                 
@@ -292,14 +2093,12 @@ int main() {
                 cout << "| Enter account type (Savings/Checking): ";
                 cin >> accountType;
                 
-                string accNum = generateAccountNumber();
-                Account* newAccount = new Account(accNum, accountType, customers[custIndex]);
-                customers[custIndex]->addAccount(newAccount);
-                accounts.push_back(newAccount);
+                Account* newAccount = bank.openAccount(customer, accountType);
+                commitOrWarn(bank);
                 
                 displayHorizontalLine();
                 cout << "| Account created successfully!          |\n";
-                cout << "| Account Number: " << left << setw(27) << accNum << " |\n";
+                cout << "| Account Number: " << left << setw(27) << newAccount->getAccountNumber() << " |\n";
                 displayHorizontalLine();
                 break;
             }
@@ -307,30 +2106,14 @@ int main() {
             case 3: { 
                 displaySectionHeader("DEPOSIT MONEY");
                 
-                if (accounts.empty()) {
+                if (bank.getAccountCount() == 0) {
                     cout << "| No accounts available!                 |\n";
                     displayHorizontalLine();
                     break;
                 }
                 
-                cout << "| Select account:                        |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < accounts.size(); i++) {
-                    cout << "| " << i+1 << ". " << left << setw(38) 
-                         << (accounts[i]->getAccountNumber() + " (" + accounts[i]->getOwner()->getName() + ")") 
-                         << " |\n";
-                }
-                displayHorizontalLine();
-                
-                int accIndex;
-                cout << "| Enter account number: ";
-                cin >> accIndex;
-                accIndex--;
-                
-                if (accIndex < 0 || accIndex >= accounts.size()) {
-                    displaySectionHeader("ERROR");
-                    cout << "| Invalid account selection!             |\n";
-                    displayHorizontalLine();
+                Account* account = promptForAccount(bank, "Enter account number", "Invalid account selection!");
+                if (account == nullptr) {
                     break;
                 }
                 
@@ -338,7 +2121,13 @@ int main() {
                 cout << "| Enter amount to deposit: $";
                 cin >> amount;
                 
-                accounts[accIndex]->deposit(amount);
+                OperationResult result = account->deposit(dollarsToCents(amount));
+                if (result.ok()) {
+                    commitOrWarn(bank);
+                    cout << "Deposit successful. New balance: $" << formatCents(result.balance) << "\n";
+                } else {
+                    cout << describeStatus(result.status) << ".\n";
+                }
                 displayHorizontalLine();
                 break;
             }
@@ -346,30 +2135,14 @@ int main() {
             case 4: { 
                 displaySectionHeader("WITHDRAW MONEY");
                 
-                if (accounts.empty()) {
+                if (bank.getAccountCount() == 0) {
                     cout << "| No accounts available!                 |\n";
                     displayHorizontalLine();
                     break;
                 }
                 
-                cout << "| Select account:                        |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < accounts.size(); i++) {
-                    cout << "| " << i+1 << ". " << left << setw(38) 
-                         << (accounts[i]->getAccountNumber() + " (" + accounts[i]->getOwner()->getName() + ")") 
-                         << " |\n";
-                }
-                displayHorizontalLine();
-                
-                int accIndex;
-                cout << "| Enter account number: ";
-                cin >> accIndex;
-                accIndex--;
-                
-                if (accIndex < 0 || accIndex >= accounts.size()) {
-                    displaySectionHeader("ERROR");
-                    cout << "| Invalid account selection!             |\n";
-                    displayHorizontalLine();
+                Account* account = promptForAccount(bank, "Enter account number", "Invalid account selection!");
+                if (account == nullptr) {
                     break;
                 }
                 
@@ -377,9 +2150,14 @@ int main() {
                 cout << "| Enter amount to withdraw: $";
                 cin >> amount;
                 
-                if (accounts[accIndex]->withdraw(amount)) {
+                OperationResult result = account->withdraw(dollarsToCents(amount));
+                if (result.ok()) {
+                    commitOrWarn(bank);
+                    cout << "Withdrawal successful. New balance: $" << formatCents(result.balance) << "\n";
                     displayHorizontalLine();
                     cout << "| Withdrawal successful!                 |\n";
+                } else {
+                    cout << describeStatus(result.status) << ".\n";
                 }
                 displayHorizontalLine();
                 break;
@@ -388,50 +2166,23 @@ int main() {
             case 5: { 
                 displaySectionHeader("TRANSFER FUNDS");
                 
-                if (accounts.size() < 2) {
+                if (bank.getAccountCount() < 2) {
                     cout << "| Need at least 2 accounts to transfer!  |\n";
                     displayHorizontalLine();
                     break;
                 }
                 
-                cout << "| Select SOURCE account:                 |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < accounts.size(); i++) {
-                    cout << "| " << i+1 << ". " << left << setw(38) 
-                         << (accounts[i]->getAccountNumber() + " (" + accounts[i]->getOwner()->getName() + ")") 
-                         << " |\n";
-                }
-                displayHorizontalLine();
-                
-                int srcIndex;
-                cout << "| Enter source account number: ";
-                cin >> srcIndex;
-                srcIndex--;
-                
-                if (srcIndex < 0 || srcIndex >= accounts.size()) {
-                    displaySectionHeader("ERROR");
-                    cout << "| Invalid source account!                |\n";
-                    displayHorizontalLine();
+                Account* source = promptForAccount(bank, "Enter source account number", "Invalid source account!");
+                if (source == nullptr) {
                     break;
                 }
                 
-                cout << "| Select TARGET account:                 |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < accounts.size(); i++) {
-                    if (i != srcIndex) {
-                        cout << "| " << i+1 << ". " << left << setw(38) 
-                             << (accounts[i]->getAccountNumber() + " (" + accounts[i]->getOwner()->getName() + ")") 
-                             << " |\n";
-                    }
+                Account* target = promptForAccount(bank, "Enter target account number", "Invalid target account!");
+                if (target == nullptr) {
+                    break;
                 }
-                displayHorizontalLine();
-                
-                int targetIndex;
-                cout << "| Enter target account number: ";
-                cin >> targetIndex;
-                targetIndex--;
                 
-                if (targetIndex < 0 || targetIndex >= accounts.size() || targetIndex == srcIndex) {
+                if (target == source) {
                     displaySectionHeader("ERROR");
                     cout << "| Invalid target account!                |\n";
                     displayHorizontalLine();
@@ -442,9 +2193,15 @@ int main() {
                 cout << "| Enter amount to transfer: $";
                 cin >> amount;
                 
-                if (accounts[srcIndex]->transfer(*accounts[targetIndex], amount)) {
+                OperationResult result = source->transfer(*target, dollarsToCents(amount));
+                if (result.ok()) {
+                    commitOrWarn(bank);
+                    cout << "Withdrawal successful. New balance: $" << formatCents(result.balance) << "\n";
+                    cout << "Deposit successful. New balance: $" << formatCents(target->getBalance()) << "\n";
                     displayHorizontalLine();
                     cout << "| Transfer successful!                   |\n";
+                } else {
+                    cout << describeStatus(result.status) << ".\n";
                 }
                 displayHorizontalLine();
                 break;
@@ -453,35 +2210,19 @@ int main() {
             case 6: { 
                 displaySectionHeader("CUSTOMER DETAILS");
                 
-                if (customers.empty()) {
+                if (bank.getCustomerCount() == 0) {
                     cout << "| No customers available!                |\n";
                     displayHorizontalLine();
                     break;
                 }
                 
-                cout << "| Select customer:                       |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < customers.size(); i++) {
-                    cout << "| " << i+1 << ". " << left << setw(38) 
-                         << (customers[i]->getName() + " (" + customers[i]->getCustomerId() + ")") 
-                         << " |\n";
-                }
-                displayHorizontalLine();
-                
-                int custIndex;
-                cout << "| Enter customer number: ";
-                cin >> custIndex;
-                custIndex--;
-                
-                if (custIndex < 0 || custIndex >= customers.size()) {
-                    displaySectionHeader("ERROR");
-                    cout << "| Invalid customer selection!            |\n";
-                    displayHorizontalLine();
+                Customer* customer = promptForCustomer(bank);
+                if (customer == nullptr) {
                     break;
                 }
                 
                 displayHorizontalLine();
-                customers[custIndex]->displayCustomerInfo();
+                displayCustomerInfo(bank, ReadView(), *customer);
                 displayHorizontalLine();
                 break;
             }
@@ -489,35 +2230,19 @@ int main() {
             case 7: { 
                 displaySectionHeader("ACCOUNT DETAILS");
                 
-                if (accounts.empty()) {
+                if (bank.getAccountCount() == 0) {
                     cout << "| No accounts available!                 |\n";
                     displayHorizontalLine();
                     break;
                 }
                 
-                cout << "| Select account:                        |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < accounts.size(); i++) {
-                    cout << "| " << i+1 << ". " << left << setw(38) 
-                         << (accounts[i]->getAccountNumber() + " (" + accounts[i]->getOwner()->getName() + ")") 
-                         << " |\n";
-                }
-                displayHorizontalLine();
-                
-                int accIndex;
-                cout << "| Enter account number: ";
-                cin >> accIndex;
-                accIndex--;
-                
-                if (accIndex < 0 || accIndex >= accounts.size()) {
-                    displaySectionHeader("ERROR");
-                    cout << "| Invalid account selection!             |\n";
-                    displayHorizontalLine();
+                Account* account = promptForAccount(bank, "Enter account number", "Invalid account selection!");
+                if (account == nullptr) {
                     break;
                 }
                 
                 displayHorizontalLine();
-                accounts[accIndex]->displayAccountInfo();
+                displayAccountInfo(bank, ReadView(), *account);
                 displayHorizontalLine();
                 break;
             }
@@ -525,30 +2250,14 @@ int main() {
             case 8: {
                 displaySectionHeader("TRANSACTION HISTORY");
                 
-                if (accounts.empty()) {
+                if (bank.getAccountCount() == 0) {
                     cout << "| No accounts available!                 |\n";
                     displayHorizontalLine();
                     break;
                 }
                 
-                cout << "| Select account:                        |\n";
-                displayHorizontalLine();
-                for (int i = 0; i < accounts.size(); i++) {
-                    cout << "| " << i+1 << ". " << left << setw(38) 
-                         << (accounts[i]->getAccountNumber() + " (" + accounts[i]->getOwner()->getName() + ")") 
-                         << " |\n";
-                }
-                displayHorizontalLine();
-                
-                int accIndex;
-                cout << "| Enter account number: ";
-                cin >> accIndex;
-                accIndex--;
-                
-                if (accIndex < 0 || accIndex >= accounts.size()) {
-                    displaySectionHeader("ERROR");
-                    cout << "| Invalid account selection!             |\n";
-                    displayHorizontalLine();
+                Account* account = promptForAccount(bank, "Enter account number", "Invalid account selection!");
+                if (account == nullptr) {
                     break;
                 }
                 
@@ -557,7 +2266,7 @@ int main() {
                 cin >> limit;
                 
                 displayHorizontalLine();
-                accounts[accIndex]->displayTransactionHistory(limit);
+                displayTransactionHistory(ReadView(), *account, limit);
                 displayHorizontalLine();
                 break;
             }
@@ -568,17 +2277,12 @@ int main() {
                 cout << "| Goodbye!                                |\n";
                 displayHorizontalLine();
                 
-                for (auto& acc : accounts) {
-                    for (auto& trans : acc->getTransactions()) {
-                        delete trans;
-                    }
-                    delete acc;
+                snapshots.reset();
+                metrics.reset();
+                if (!snapshotPath.empty()) {
+                    writeSnapshotOrWarn(bank, snapshotPath);
                 }
-                
-                for (auto& cust : customers) {
-                    delete cust;
-                }
-                
+                writeMetricsOrWarn(bank, options.metricsPath);
                 return 0;
                 
             default:
@@ -0,0 +1,2515 @@
+#include "bank_core.h"
+
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+Cents dollarsToCents(double dollars) {
+    return (Cents)llround(dollars * 100.0);
+}
+
+string formatCents(Cents cents) {
+    string sign = cents < 0 ? "-" : "";
+    uint64_t magnitude = cents < 0 ? (uint64_t)0 - (uint64_t)cents : (uint64_t)cents;
+    string fraction = to_string(magnitude % 100);
+    if (fraction.size() < 2) fraction = "0" + fraction;
+    return sign + to_string(magnitude / 100) + "." + fraction;
+}
+
+int64_t currentEpochNanoseconds() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+DescriptionTable descriptionTable;
+
+uint32_t crc32(const void* data, size_t length, uint32_t crc) {
+    static uint32_t table[256];
+    static once_flag tableReady;
+    call_once(tableReady, []() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+            table[i] = value;
+        }
+    });
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// SHA-256 (FIPS 180-4). Blocks go through the x86 SHA extensions when the CPU
+// has them, which is roughly ten times faster than the portable rounds below.
+const uint32_t SHA256_ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+inline uint32_t rotateRight(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+void sha256BlocksPortable(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 |
+                   data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g)) +
+                          SHA256_ROUND_CONSTANTS[i] + w[i];
+            uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Four rounds per step; the message schedule for step i comes from the previous four
+__attribute__((target("sha,sse4.1"))) void sha256BlocksShaExtensions(uint32_t state[8], const uint8_t* data,
+                                                                     size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1);
+    __m128i hgfe = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B);
+    __m128i abef = _mm_alignr_epi8(dcba, hgfe, 8);
+    __m128i cdgh = _mm_blend_epi16(hgfe, dcba, 0xF0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i savedAbef = abef;
+        __m128i savedCdgh = cdgh;
+        __m128i schedule[4];
+        for (int step = 0; step < 16; step++) {
+            __m128i& words = schedule[step % 4];
+            if (step < 4) {
+                words = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + step * 16)), byteSwap);
+            } else {
+                __m128i previous = schedule[(step + 3) % 4];
+                __m128i mixed = _mm_add_epi32(_mm_sha256msg1_epu32(words, schedule[(step + 1) % 4]),
+                                              _mm_alignr_epi8(previous, schedule[(step + 2) % 4], 4));
+                words = _mm_sha256msg2_epu32(mixed, previous);
+            }
+            __m128i message = _mm_add_epi32(
+                words, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&SHA256_ROUND_CONSTANTS[step * 4])));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, savedAbef);
+        cdgh = _mm_add_epi32(cdgh, savedCdgh);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+typedef void (*Sha256BlockFunction)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+Sha256BlockFunction selectSha256Blocks() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) return sha256BlocksShaExtensions;
+#endif
+    return sha256BlocksPortable;
+}
+
+const Sha256BlockFunction sha256Blocks = selectSha256Blocks();
+
+Sha256Digest sha256(const void* data, size_t length) {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    size_t fullBlocks = length / 64;
+    sha256Blocks(state, bytes, fullBlocks);
+
+    // The rest, the 0x80 terminator and the bit length fill one or two final blocks
+    uint8_t tail[128] = {};
+    size_t rest = length % 64;
+    memcpy(tail, bytes + fullBlocks * 64, rest);
+    tail[rest] = 0x80;
+    size_t tailBytes = rest + 9 <= 64 ? 64 : 128;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tailBytes - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    sha256Blocks(state, tail, tailBytes / 64);
+
+    Sha256Digest digest;
+    for (int i = 0; i < 8; i++) {
+        digest.bytes[i * 4] = (uint8_t)(state[i] >> 24);
+        digest.bytes[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest.bytes[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest.bytes[i * 4 + 3] = (uint8_t)state[i];
+    }
+    return digest;
+}
+
+string formatDigest(const Sha256Digest& digest) {
+    static const char hex[] = "0123456789abcdef";
+    string text;
+    for (uint8_t byte : digest.bytes) {
+        text.push_back(hex[byte >> 4]);
+        text.push_back(hex[byte & 0xF]);
+    }
+    return text;
+}
+
+void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+bool getVarint(const char*& cursor, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && cursor < end; shift += 7) {
+        uint8_t byte = (uint8_t)*cursor++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+uint64_t zigzagEncode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t zigzagDecode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+TransactionArenaStats transactionArenaStats;
+
+ColdHistoryStore* TransactionLog::coldStore = nullptr;
+size_t TransactionLog::residentChunkLimit = 0;
+
+bool TransactionLog::walkSpilled(size_t newest,
+                                 const function<bool(size_t, const HistoryCheckpoint&)>& visit) const {
+    // Start from the newest segment of newest's group and follow the back links
+    size_t group = newest / CHECKPOINT_GROUP;
+    size_t chunkIndex = min((group + 1) * CHECKPOINT_GROUP, spilledChunks()) - 1;
+    uint64_t reference = spilledGroups[group].newestSegment;
+    while (true) {
+        ColdSegmentHeader header;
+        if (coldStore == nullptr || !coldStore->readSegmentHeader(reference, header) ||
+            header.accountNumber != ownerNumber) {
+            return false;
+        }
+        if (chunkIndex <= newest &&
+            !visit(chunkIndex, {header.firstTimestampNs, header.balanceBefore, reference, header.chainDigest})) {
+            return true;
+        }
+        if (chunkIndex == 0) return true;
+        chunkIndex--;
+        reference = header.previousSegment;
+    }
+}
+
+bool TransactionLog::checkpointRange(size_t first, size_t last, vector<HistoryCheckpoint>& out) const {
+    out.clear();
+    size_t spilledCount = spilledChunks();
+    if (first < spilledCount) {
+        bool readable = walkSpilled(min(last, spilledCount - 1),
+                                    [&](size_t chunkIndex, const HistoryCheckpoint& checkpoint) {
+                                        out.push_back(checkpoint);
+                                        return chunkIndex > first;
+                                    });
+        if (!readable) return false;
+        reverse(out.begin(), out.end());
+    }
+    for (size_t chunkIndex = max(first, spilledCount); chunkIndex <= last; chunkIndex++) {
+        out.push_back(checkpoints[chunkIndex - spilledCount]);
+    }
+    return true;
+}
+
+bool TransactionLog::loadChunk(size_t chunkIndex, const HistoryCheckpoint& checkpoint, vector<Transaction>& out) const {
+    uint64_t first = (uint64_t)chunkIndex * CHUNK_RECORDS;
+    if (first >= spilled) {
+        out.clear();
+        uint64_t last = min<uint64_t>(size(), first + CHUNK_RECORDS);
+        for (uint64_t index = first; index < last; index++) {
+            out.push_back(resident(index));
+        }
+        return true;
+    }
+    ColdSegmentHeader header;
+    return coldStore != nullptr && coldStore->readSegment(checkpoint.coldSegment, header, out);
+}
+
+bool TransactionLog::chunkBefore(int64_t timestampNs, size_t& chunkIndex, HistoryCheckpoint& checkpoint) const {
+    if (!checkpoints.empty() && (spilledGroups.empty() || checkpoints[0].firstTimestampNs < timestampNs)) {
+        auto next = lower_bound(checkpoints.begin(), checkpoints.end(), timestampNs,
+                                [](const HistoryCheckpoint& entry, int64_t time) {
+                                    return entry.firstTimestampNs < time;
+                                });
+        size_t local = next == checkpoints.begin() ? 0 : (size_t)(next - checkpoints.begin()) - 1;
+        chunkIndex = spilledChunks() + local;
+        checkpoint = checkpoints[local];
+        return true;
+    }
+    if (spilledGroups.empty()) return false;
+    auto next = lower_bound(spilledGroups.begin(), spilledGroups.end(), timestampNs,
+                            [](const SpilledGroup& group, int64_t time) { return group.firstTimestampNs < time; });
+    size_t group = next == spilledGroups.begin() ? 0 : (size_t)(next - spilledGroups.begin()) - 1;
+    size_t newest = min((group + 1) * CHECKPOINT_GROUP, spilledChunks()) - 1;
+    bool found = false;
+    bool readable = walkSpilled(newest, [&](size_t index, const HistoryCheckpoint& entry) {
+        if (entry.firstTimestampNs >= timestampNs && index > 0) return true;
+        chunkIndex = index;
+        checkpoint = entry;
+        found = true;
+        return false;
+    });
+    return readable && found;
+}
+
+void TransactionLog::collectRange(uint64_t first, size_t limit, vector<Transaction>& out) const {
+    out.clear();
+    uint64_t last = min<uint64_t>(size(), first + limit);
+    if (first >= last) return;
+    size_t firstChunk = (size_t)(first / CHUNK_RECORDS);
+    vector<HistoryCheckpoint> range;
+    if (!checkpointRange(firstChunk, (size_t)((last - 1) / CHUNK_RECORDS), range)) return;
+    vector<Transaction> chunk;
+    for (size_t i = 0; i < range.size(); i++) {
+        uint64_t chunkStart = (uint64_t)(firstChunk + i) * CHUNK_RECORDS;
+        if (!loadChunk(firstChunk + i, range[i], chunk)) continue;
+        for (size_t j = 0; j < chunk.size(); j++) {
+            uint64_t index = chunkStart + j;
+            if (index >= first && index < last) out.push_back(chunk[j]);
+        }
+    }
+}
+
+Cents TransactionLog::balanceAt(int64_t timestampNs) const {
+    size_t chunkIndex;
+    HistoryCheckpoint checkpoint;
+    if (!chunkBefore(timestampNs + 1, chunkIndex, checkpoint)) return runningBalance;
+    Cents balance = checkpoint.balanceBefore;
+    if (timestampNs < checkpoint.firstTimestampNs) return balance;
+    vector<Transaction> chunk;
+    loadChunk(chunkIndex, checkpoint, chunk);
+    for (const Transaction& record : chunk) {
+        if (record.getTimestampNs() > timestampNs) break;
+        balance += record.getTypeCode() == TransactionType::Credit ? record.getAmount() : -record.getAmount();
+    }
+    return balance;
+}
+
+Cents TransactionLog::collectBetween(int64_t fromNs, int64_t toNs, vector<Transaction>& out) const {
+    out.clear();
+    Cents opening = balanceAt(fromNs - 1);
+    if (empty() || fromNs >= toNs) return opening;
+    // Records stamped exactly fromNs may sit at the end of the chunk before the
+    // first one that starts at fromNs, so the scan starts one chunk early
+    size_t firstChunk, lastChunk;
+    HistoryCheckpoint checkpoint;
+    if (!chunkBefore(fromNs, firstChunk, checkpoint) || !chunkBefore(toNs, lastChunk, checkpoint)) return opening;
+    vector<HistoryCheckpoint> range;
+    if (!checkpointRange(firstChunk, lastChunk, range)) return opening;
+    vector<Transaction> chunk;
+    for (size_t i = 0; i < range.size(); i++) {
+        if (range[i].firstTimestampNs >= toNs) break;
+        if (!loadChunk(firstChunk + i, range[i], chunk)) continue;
+        for (const Transaction& record : chunk) {
+            if (record.getTimestampNs() >= fromNs && record.getTimestampNs() < toNs) out.push_back(record);
+        }
+    }
+    return opening;
+}
+
+// Bytes a record contributes to its leaf, so a full leaf hashes 264 bytes (five SHA-256 blocks)
+const size_t LEAF_RECORD_BYTES = 33;
+
+// Leaf digest of up to LEAF_RECORDS records, each laid out as 33 little-endian bytes
+Sha256Digest recordLeaf(const Transaction* records, size_t count) {
+    uint8_t bytes[TransactionLog::LEAF_RECORDS * LEAF_RECORD_BYTES];
+    for (size_t i = 0; i < count; i++) {
+        const Transaction& record = records[i];
+        uint8_t* out = bytes + i * LEAF_RECORD_BYTES;
+        uint64_t transactionId = record.getTransactionNumber();
+        int64_t timestampNs = record.getTimestampNs();
+        Cents amount = record.getAmount();
+        uint32_t descriptionId = record.getDescriptionId();
+        uint32_t counterparty = record.getCounterparty();
+        memcpy(out, &transactionId, 8);
+        memcpy(out + 8, &timestampNs, 8);
+        memcpy(out + 16, &amount, 8);
+        memcpy(out + 24, &descriptionId, 4);
+        memcpy(out + 28, &counterparty, 4);
+        out[32] = (uint8_t)record.getTypeCode();
+    }
+    return sha256(bytes, count * LEAF_RECORD_BYTES);
+}
+
+Sha256Digest TransactionLog::merkleRoot(Sha256Digest* nodes, size_t count) {
+    if (count == 0) return Sha256Digest();
+    for (size_t width = count; width > 1; width = (width + 1) / 2) {
+        for (size_t i = 0; i < width / 2; i++) {
+            nodes[i] = sha256(&nodes[i * 2], sizeof(Sha256Digest) * 2);
+        }
+        if (width % 2 != 0) {
+            nodes[width / 2] = nodes[width - 1];
+        }
+    }
+    return nodes[0];
+}
+
+Sha256Digest TransactionLog::chunkRoot(const Transaction* records, size_t recordCount) {
+    Sha256Digest leaves[CHUNK_RECORDS / LEAF_RECORDS];
+    recordCount = min<size_t>(recordCount, CHUNK_RECORDS);
+    size_t leafCount = 0;
+    for (size_t first = 0; first < recordCount; first += LEAF_RECORDS) {
+        leaves[leafCount++] = recordLeaf(records + first, min(LEAF_RECORDS, recordCount - first));
+    }
+    return merkleRoot(leaves, leafCount);
+}
+
+Sha256Digest TransactionLog::genesisDigest(uint32_t accountNumber, uint64_t transactionBase, Cents openingBalance) {
+    uint8_t bytes[32];
+    memcpy(bytes, "ledger-chain", 12);
+    memcpy(bytes + 12, &accountNumber, 4);
+    memcpy(bytes + 16, &transactionBase, 8);
+    memcpy(bytes + 24, &openingBalance, 8);
+    return sha256(bytes, sizeof(bytes));
+}
+
+Sha256Digest TransactionLog::chainLink(const Sha256Digest& previous, const Sha256Digest& root,
+                                       uint64_t firstTransactionId, Cents balanceBefore) {
+    uint8_t bytes[80];
+    memcpy(bytes, previous.bytes, 32);
+    memcpy(bytes + 32, root.bytes, 32);
+    memcpy(bytes + 64, &firstTransactionId, 8);
+    memcpy(bytes + 72, &balanceBefore, 8);
+    return sha256(bytes, sizeof(bytes));
+}
+
+void TransactionLog::sealNewestChunk() {
+    size_t chunkIndex = (size_t)(size() / CHUNK_RECORDS) - 1;
+    const Transaction* records = &resident(size() - CHUNK_RECORDS);
+    HistoryCheckpoint& checkpoint = checkpoints[chunkIndex - spilledChunks()];
+    Sha256Digest previous;
+    if (chunkIndex == 0) {
+        previous = genesisDigest(ownerNumber, records[0].getTransactionNumber() - 1, checkpoint.balanceBefore);
+    } else if (chunkIndex > spilledChunks()) {
+        previous = checkpoints[chunkIndex - 1 - spilledChunks()].chainDigest;
+    } else {
+        // Only one chunk is kept resident, so the previous digest is in the newest segment's header
+        vector<HistoryCheckpoint> range;
+        if (checkpointRange(chunkIndex - 1, chunkIndex - 1, range)) previous = range[0].chainDigest;
+    }
+    checkpoint.chainDigest = chainLink(previous, chunkRoot(records, CHUNK_RECORDS), records[0].getTransactionNumber(),
+                                       checkpoint.balanceBefore);
+}
+
+AccountAuditResult TransactionLog::audit(AccountAuditMark& mark, uint64_t transactionBase, Cents balance) const {
+    AccountAuditResult result;
+    size_t sealed = (size_t)(size() / CHUNK_RECORDS);
+    size_t chunkIndex = 0;
+    if (mark.audited && mark.transactionBase == transactionBase && mark.sealedChunks <= sealed) {
+        chunkIndex = (size_t)mark.sealedChunks;
+        result.chunksSkipped = chunkIndex;
+    } else {
+        result.rebased = mark.audited;
+    }
+
+    // Checkpoints from the mark's last chunk (or chunk 0) on, read back in one walk
+    size_t firstNeeded = chunkIndex > 0 ? chunkIndex - 1 : 0;
+    vector<HistoryCheckpoint> range;
+    if (!empty() && !checkpointRange(firstNeeded, (size_t)((size() - 1) / CHUNK_RECORDS), range)) {
+        result.readable = false;
+        return result;
+    }
+    Cents openingBalance = range.empty() ? runningBalance : range[0].balanceBefore;
+    Sha256Digest previous = genesisDigest(ownerNumber, transactionBase, openingBalance);
+    Cents running = openingBalance;
+    if (chunkIndex > 0) {
+        // Everything up to the mark is vouched for if the chain still ends where it did
+        if (range[0].chainDigest != mark.chainDigest) {
+            result.chainIntact = false;
+            return result;
+        }
+        previous = mark.chainDigest;
+        running = mark.balance;
+    }
+
+    vector<Transaction> chunk;
+    for (; chunkIndex < sealed; chunkIndex++) {
+        const HistoryCheckpoint& checkpoint = range[chunkIndex - firstNeeded];
+        if (!loadChunk(chunkIndex, checkpoint, chunk) || chunk.size() != CHUNK_RECORDS) {
+            result.readable = false;
+            return result;
+        }
+        uint64_t firstId = transactionBase + (uint64_t)chunkIndex * CHUNK_RECORDS + 1;
+        Sha256Digest link = chainLink(previous, chunkRoot(chunk.data(), chunk.size()), firstId, running);
+        if (checkpoint.balanceBefore != running || link != checkpoint.chainDigest) {
+            result.chainIntact = false;
+            return result;
+        }
+        for (size_t i = 0; i < chunk.size(); i++) {
+            if (chunk[i].getTransactionNumber() != firstId + i) {
+                result.chainIntact = false;
+                return result;
+            }
+            running += chunk[i].getTypeCode() == TransactionType::Credit ? chunk[i].getAmount() : -chunk[i].getAmount();
+        }
+        previous = link;
+        result.chunksVerified++;
+        result.recordsVerified += chunk.size();
+    }
+
+    // The unsealed tail is only summed; it is sealed, and chained, once it fills
+    Cents sealedBalance = running;
+    for (uint64_t index = (uint64_t)sealed * CHUNK_RECORDS; index < size(); index++) {
+        const Transaction& record = resident(index);
+        if (record.getTransactionNumber() != transactionBase + index + 1) {
+            result.chainIntact = false;
+            return result;
+        }
+        running += record.getTypeCode() == TransactionType::Credit ? record.getAmount() : -record.getAmount();
+        result.recordsVerified++;
+    }
+    result.balanceMatches = running == balance;
+    if (result.balanceMatches) {
+        mark.audited = true;
+        mark.transactionBase = transactionBase;
+        mark.sealedChunks = sealed;
+        mark.balance = sealedBalance;
+        mark.chainDigest = previous;
+    }
+    return result;
+}
+
+MetricsRegistry bankMetrics;
+VelocityRules velocityRules;
+ReadEpochs readEpochs;
+
+uint64_t ReadEpochs::enterWrite(unsigned& stripe) {
+    static atomic<unsigned> nextStripe(0);
+    thread_local unsigned threadStripe = nextStripe.fetch_add(1, memory_order_relaxed) % WRITER_STRIPES;
+    stripe = threadStripe;
+    // A view that closes the epoch between the two loads may already have found
+    // this stripe empty, so the writer backs out and joins the next epoch
+    while (true) {
+        uint64_t epoch = current.load();
+        stripes[stripe].active[epoch & 1].fetch_add(1);
+        if (current.load() == epoch) return epoch;
+        stripes[stripe].active[epoch & 1].fetch_sub(1);
+    }
+}
+
+uint64_t ReadEpochs::openRead() {
+    lock_guard<mutex> lock(readersMutex);
+    uint64_t epoch = current.load();
+    openReads.insert(epoch);
+    reclaimBound.store(*openReads.begin());
+    current.store(epoch + 1);
+    // Earlier epochs were drained by the views that closed them
+    for (WriterStripe& stripe : stripes) {
+        while (stripe.active[epoch & 1].load() != 0) {
+            this_thread::yield();
+        }
+    }
+    return epoch;
+}
+
+void ReadEpochs::closeRead(uint64_t epoch) {
+    lock_guard<mutex> lock(readersMutex);
+    auto it = openReads.find(epoch);
+    if (it != openReads.end()) openReads.erase(it);
+    reclaimBound.store(openReads.empty() ? current.load() : *openReads.begin());
+}
+
+CustomerOutflow::~CustomerOutflow() {}
+
+void Customer::addAccount(AccountHandle account) {
+    accounts.push_back(account);
+}
+
+VelocityRules::VelocityRules() : enabled(false), alertCount(0) {
+    defaultSettings(settings);
+    for (int rule = 0; rule < RULE_COUNT; rule++) {
+        settings[rule].action = RuleAction::Off;
+        bucketWidthNs[rule] = 1;
+    }
+}
+
+void VelocityRules::defaultSettings(VelocityRuleSettings (&rules)[RULE_COUNT]) {
+    rules[RULE_WITHDRAWAL_COUNT] = {RuleAction::Flag, 10, 60};
+    rules[RULE_ACCOUNT_OUTFLOW] = {RuleAction::Flag, 1000000, 3600};           // $10,000 an hour
+    rules[RULE_CUSTOMER_OUTFLOW] = {RuleAction::Flag, 2500000, 86400};         // $25,000 a day
+    rules[RULE_NEW_ACCOUNT_CREDIT] = {RuleAction::Flag, 500000, 86400};        // $5,000 in its first day
+}
+
+void VelocityRules::configure(const VelocityRuleSettings (&rules)[RULE_COUNT]) {
+    enabled = false;
+    for (int rule = 0; rule < RULE_COUNT; rule++) {
+        settings[rule] = rules[rule];
+        settings[rule].windowSeconds = max<int64_t>(settings[rule].windowSeconds, 1);
+        bucketWidthNs[rule] = max<int64_t>(settings[rule].windowSeconds * 1000000000LL / SlidingWindow::BUCKETS, 1);
+        enabled = enabled || settings[rule].action != RuleAction::Off;
+    }
+}
+
+void VelocityRules::report(VelocityRule rule, uint32_t accountNumber, uint32_t counterparty, Cents amount,
+                           int64_t timestampNs) {
+    bankMetrics.recordRuleHit(rule);
+    VelocityAlert alert = {timestampNs, accountNumber, counterparty, amount, rule, settings[rule].action};
+    lock_guard<mutex> lock(alertsMutex);
+    if (alerts.size() < ALERT_HISTORY) {
+        alerts.push_back(alert);
+    } else {
+        alerts[alertCount % ALERT_HISTORY] = alert;
+    }
+    alertCount++;
+}
+
+vector<VelocityAlert> VelocityRules::getRecentAlerts() const {
+    lock_guard<mutex> lock(alertsMutex);
+    vector<VelocityAlert> recent;
+    recent.reserve(alerts.size());
+    for (size_t i = 1; i <= alerts.size(); i++) {
+        recent.push_back(alerts[(alertCount - i) % ALERT_HISTORY]);
+    }
+    return recent;
+}
+
+thread_local uint64_t transferLockConflicts = 0;
+
+void lockCountingConflicts(mutex& accountLock) {
+    if (!accountLock.try_lock()) {
+        transferLockConflicts++;
+        accountLock.lock();
+    }
+}
+
+const char* describeStatus(OperationStatus status) {
+    switch (status) {
+        case OperationStatus::Ok: return "Success";
+        case OperationStatus::InvalidAmount: return "Invalid amount";
+        case OperationStatus::InsufficientFunds: return "Insufficient funds";
+        case OperationStatus::SameAccount: return "Cannot transfer to the same account";
+        case OperationStatus::Blocked: return "Blocked by a velocity rule";
+    }
+    return "Unknown status";
+}
+
+Account::~Account() {
+    freeVersions(olderVersions.load());
+}
+
+size_t Account::freeVersions(AccountVersion* version) {
+    size_t freed = 0;
+    while (version != nullptr) {
+        AccountVersion* older = version->older.load(memory_order_relaxed);
+        delete version;
+        version = older;
+        freed++;
+    }
+    return freed;
+}
+
+AccountVersion* Account::cutVersions(uint64_t bound) {
+    // Views read at or after bound and stop at the first version stamped at or
+    // before their epoch, so none of them gets past the newest such version
+    if (versionEpoch.load(memory_order_relaxed) <= bound) {
+        return olderVersions.exchange(nullptr, memory_order_acq_rel);
+    }
+    AccountVersion* keep = olderVersions.load(memory_order_acquire);
+    while (keep != nullptr && keep->epoch > bound) {
+        keep = keep->older.load(memory_order_acquire);
+    }
+    return keep != nullptr ? keep->older.exchange(nullptr, memory_order_acq_rel) : nullptr;
+}
+
+void Account::publishVersion(uint64_t epoch) {
+    // The version in place belongs to a closed epoch once a view has moved
+    // writers on, so it is kept in the list before it is overwritten, in a
+    // copy no view can reach any more when there is one. Readers check
+    // versionEpoch before and after reading it, like a sequence lock.
+    uint64_t stamped = versionEpoch.load(memory_order_relaxed);
+    if (stamped != epoch) {
+        AccountVersion* copy = cutVersions(readEpochs.getReclaimBound());
+        AccountVersion* newest = olderVersions.load(memory_order_relaxed);
+        if (copy != nullptr) {
+            freeVersions(copy->older.load(memory_order_relaxed));
+            copy->epoch = stamped;
+            copy->balance = versionBalance.load(memory_order_relaxed);
+            copy->transactionCount = versionTransactionCount.load(memory_order_relaxed);
+            copy->older.store(newest, memory_order_relaxed);
+        } else {
+            copy = new AccountVersion(stamped, versionBalance.load(memory_order_relaxed),
+                                      versionTransactionCount.load(memory_order_relaxed), newest);
+        }
+        olderVersions.store(copy, memory_order_release);
+        versionEpoch.store(epoch, memory_order_release);
+        atomic_thread_fence(memory_order_release);
+    }
+    versionBalance.store(balance, memory_order_relaxed);
+    versionTransactionCount.store(transactionBase + transactions.size(), memory_order_relaxed);
+}
+
+OperationResult Account::deposit(Cents amount, uint32_t descriptionId, uint32_t counterparty) {
+    OperationTimer timer(METRIC_DEPOSIT);
+    lock_guard<mutex> lock(accountMutex);
+    WriteEpoch epoch;
+    OperationStatus status = applyCredit(amount, descriptionId, counterparty, currentEpochNanoseconds());
+    if (status == OperationStatus::Ok) {
+        publishVersion(epoch.value());
+        logLastEntry(WalRecordType::Credit);
+    }
+    return {status, balance};
+}
+
+OperationResult Account::withdraw(Cents amount, uint32_t descriptionId, uint32_t counterparty) {
+    OperationTimer timer(METRIC_WITHDRAW);
+    lock_guard<mutex> lock(accountMutex);
+    int64_t timestampNs = currentEpochNanoseconds();
+    if (velocityRules.isEnabled() && canDebit(amount) &&
+        !screenDebit(descriptionId, amount, counterparty, timestampNs)) {
+        return {OperationStatus::Blocked, balance};
+    }
+    WriteEpoch epoch;
+    OperationStatus status = applyDebit(amount, descriptionId, counterparty, timestampNs);
+    if (status == OperationStatus::Ok) {
+        publishVersion(epoch.value());
+        logLastEntry(WalRecordType::Debit);
+    }
+    return {status, balance};
+}
+
+WalEntryPayload Account::lastEntryPayload() const {
+    const Transaction& entry = transactions[transactions.size() - 1];
+    WalEntryPayload payload = {};
+    payload.accountNumber = accountNumberValue;
+    payload.descriptionId = entry.getDescriptionId();
+    payload.counterparty = entry.getCounterparty();
+    payload.transactionId = entry.getTransactionNumber();
+    payload.amount = entry.getAmount();
+    payload.timestampNs = entry.getTimestampNs();
+    return payload;
+}
+
+void Account::logLastEntry(WalRecordType type) {
+    if (ledgerLog == nullptr) return;
+    WalEntryPayload payload = lastEntryPayload();
+    ledgerLog->append(type, &payload, sizeof(payload));
+}
+
+bool Account::screenDebit(uint32_t descriptionId, Cents amount, uint32_t counterparty, int64_t timestampNs,
+                          bool count) {
+    if (descriptionId != DESCRIPTION_WITHDRAWAL && descriptionId != DESCRIPTION_TRANSFER_TO) {
+        return true;
+    }
+    if (!velocityWindows) {
+        velocityWindows.reset(new SlidingWindow[2]);
+    }
+    bool hits[RULE_COUNT] = {};
+    if (descriptionId == DESCRIPTION_WITHDRAWAL && velocityRules.isActive(RULE_WITHDRAWAL_COUNT)) {
+        uint64_t recent = velocityWindows[0].countAt(timestampNs, velocityRules.getBucketWidth(RULE_WITHDRAWAL_COUNT));
+        hits[RULE_WITHDRAWAL_COUNT] = recent + 1 > velocityRules.getSettings(RULE_WITHDRAWAL_COUNT).limit;
+    }
+    if (velocityRules.isActive(RULE_ACCOUNT_OUTFLOW)) {
+        Cents recent = velocityWindows[1].amountAt(timestampNs, velocityRules.getBucketWidth(RULE_ACCOUNT_OUTFLOW)) +
+                       held;
+        hits[RULE_ACCOUNT_OUTFLOW] = (uint64_t)(recent + amount) > velocityRules.getSettings(RULE_ACCOUNT_OUTFLOW).limit;
+    }
+
+    bool blocked = false;
+    for (int rule = 0; rule < RULE_COUNT; rule++) {
+        blocked = blocked || (hits[rule] && velocityRules.getSettings((VelocityRule)rule).action == RuleAction::Block);
+    }
+    // The customer's window and pending total are shared by its accounts, so
+    // they are checked and added to under one hold of its lock
+    bool customerRule = velocityRules.isActive(RULE_CUSTOMER_OUTFLOW);
+    if (customerRule || !count) {
+        int64_t width = velocityRules.getBucketWidth(RULE_CUSTOMER_OUTFLOW);
+        lock_guard<mutex> lock(ownerOutflow->windowMutex);
+        if (customerRule) {
+            if (!ownerOutflow->window) {
+                ownerOutflow->window.reset(new SlidingWindow());
+            }
+            Cents recent = ownerOutflow->window->amountAt(timestampNs, width) + ownerOutflow->pending;
+            hits[RULE_CUSTOMER_OUTFLOW] =
+                (uint64_t)(recent + amount) > velocityRules.getSettings(RULE_CUSTOMER_OUTFLOW).limit;
+            blocked = blocked || (hits[RULE_CUSTOMER_OUTFLOW] &&
+                                  velocityRules.getSettings(RULE_CUSTOMER_OUTFLOW).action == RuleAction::Block);
+        }
+        if (!blocked && count && customerRule) {
+            ownerOutflow->window->add(timestampNs, width, amount);
+        } else if (!blocked && !count) {
+            ownerOutflow->pending += amount;
+        }
+    }
+
+    for (int rule = 0; rule < RULE_COUNT; rule++) {
+        if (hits[rule]) velocityRules.report((VelocityRule)rule, accountNumberValue, counterparty, amount, timestampNs);
+    }
+    if (blocked) {
+        bankMetrics.recordRejection(REJECT_VELOCITY_RULE);
+        return false;
+    }
+    if (!count) {
+        return true;
+    }
+    if (descriptionId == DESCRIPTION_WITHDRAWAL) {
+        velocityWindows[0].add(timestampNs, velocityRules.getBucketWidth(RULE_WITHDRAWAL_COUNT), amount);
+    }
+    velocityWindows[1].add(timestampNs, velocityRules.getBucketWidth(RULE_ACCOUNT_OUTFLOW), amount);
+    return true;
+}
+
+bool Account::screenTransferCredit(Cents amount, uint32_t counterparty, int64_t timestampNs) {
+    const VelocityRuleSettings& rule = velocityRules.getSettings(RULE_NEW_ACCOUNT_CREDIT);
+    if (rule.action == RuleAction::Off || openedNs == 0 || (uint64_t)amount < rule.limit ||
+        timestampNs - openedNs >= rule.windowSeconds * 1000000000LL) {
+        return true;
+    }
+    velocityRules.report(RULE_NEW_ACCOUNT_CREDIT, accountNumberValue, counterparty, amount, timestampNs);
+    if (rule.action != RuleAction::Block) {
+        return true;
+    }
+    bankMetrics.recordRejection(REJECT_VELOCITY_RULE);
+    return false;
+}
+
+void Account::adjustPendingOutflow(Cents change) {
+    lock_guard<mutex> lock(ownerOutflow->windowMutex);
+    ownerOutflow->pending = max<Cents>(ownerOutflow->pending + change, 0);
+}
+
+// Used for replayed debits, so recovery refills the windows, and for cross-shard debits as they commit
+void Account::recordDebit(uint32_t descriptionId, Cents amount, int64_t timestampNs) {
+    if (descriptionId != DESCRIPTION_WITHDRAWAL && descriptionId != DESCRIPTION_TRANSFER_TO) {
+        return;
+    }
+    if (!velocityWindows) {
+        velocityWindows.reset(new SlidingWindow[2]);
+    }
+    if (descriptionId == DESCRIPTION_WITHDRAWAL) {
+        velocityWindows[0].add(timestampNs, velocityRules.getBucketWidth(RULE_WITHDRAWAL_COUNT), amount);
+    }
+    velocityWindows[1].add(timestampNs, velocityRules.getBucketWidth(RULE_ACCOUNT_OUTFLOW), amount);
+    lock_guard<mutex> lock(ownerOutflow->windowMutex);
+    if (!ownerOutflow->window) {
+        ownerOutflow->window.reset(new SlidingWindow());
+    }
+    ownerOutflow->window->add(timestampNs, velocityRules.getBucketWidth(RULE_CUSTOMER_OUTFLOW), amount);
+}
+
+OperationStatus Account::applyCredit(Cents amount, uint32_t descriptionId, uint32_t counterparty,
+                                     int64_t timestampNs) {
+    if (amount <= 0) {
+        bankMetrics.recordRejection(REJECT_INVALID_AMOUNT);
+        return OperationStatus::InvalidAmount;
+    }
+    balance += amount;
+    transactions.emplace(transactionBase + transactions.size() + 1, descriptionId, amount, TransactionType::Credit,
+                         counterparty, timestampNs);
+    bankMetrics.recordTransactions(1);
+    return OperationStatus::Ok;
+}
+
+OperationStatus Account::applyDebit(Cents amount, uint32_t descriptionId, uint32_t counterparty,
+                                    int64_t timestampNs) {
+    if (amount <= 0) {
+        bankMetrics.recordRejection(REJECT_INVALID_AMOUNT);
+        return OperationStatus::InvalidAmount;
+    }
+    if (balance - held < amount) {
+        bankMetrics.recordRejection(REJECT_INSUFFICIENT_FUNDS);
+        return OperationStatus::InsufficientFunds;
+    }
+    balance -= amount;
+    transactions.emplace(transactionBase + transactions.size() + 1, descriptionId, amount, TransactionType::Debit,
+                         counterparty, timestampNs);
+    bankMetrics.recordTransactions(1);
+    return OperationStatus::Ok;
+}
+
+OperationResult Account::transfer(Account& targetAccount, Cents amount) {
+    OperationTimer timer(METRIC_TRANSFER);
+    if (this == &targetAccount) {
+        bankMetrics.recordRejection(REJECT_SAME_ACCOUNT);
+        return {OperationStatus::SameAccount, getBalance()};
+    }
+    
+    // Both accounts are locked in ascending account-number order, so two
+    // transfers running in opposite directions can never deadlock
+    Account& first = accountNumberValue < targetAccount.accountNumberValue ? *this : targetAccount;
+    Account& second = &first == this ? targetAccount : *this;
+    lockCountingConflicts(first.accountMutex);
+    lockCountingConflicts(second.accountMutex);
+    lock_guard<mutex> firstLock(first.accountMutex, adopt_lock);
+    lock_guard<mutex> secondLock(second.accountMutex, adopt_lock);
+    
+    int64_t timestampNs = currentEpochNanoseconds();
+    if (velocityRules.isEnabled() && canDebit(amount) &&
+        (!targetAccount.screenTransferCredit(amount, accountNumberValue, timestampNs) ||
+         !screenDebit(DESCRIPTION_TRANSFER_TO, amount, targetAccount.accountNumberValue, timestampNs))) {
+        return {OperationStatus::Blocked, balance};
+    }
+    WriteEpoch epoch;
+    OperationStatus status = applyDebit(amount, DESCRIPTION_TRANSFER_TO, targetAccount.accountNumberValue, timestampNs);
+    if (status != OperationStatus::Ok) {
+        return {status, balance};
+    }
+    targetAccount.applyCredit(amount, DESCRIPTION_TRANSFER_FROM, accountNumberValue, timestampNs);
+    publishVersion(epoch.value());
+    targetAccount.publishVersion(epoch.value());
+    
+    if (ledgerLog != nullptr) {
+        WalTransferPayload payload = {};
+        payload.sourceAccount = accountNumberValue;
+        payload.targetAccount = targetAccount.accountNumberValue;
+        payload.sourceTransactionId = transactionBase + transactions.size();
+        payload.targetTransactionId = targetAccount.transactionBase + targetAccount.transactions.size();
+        payload.amount = amount;
+        payload.timestampNs = timestampNs;
+        ledgerLog->append(WalRecordType::Transfer, &payload, sizeof(payload));
+    }
+    return {OperationStatus::Ok, balance};
+}
+
+bool TransferBatchPlan::build(const TransferLeg* legs, size_t legCount, size_t& failedLeg) {
+    accountNumbers.clear();
+    accountNumbers.reserve(legCount * 2);
+    for (size_t i = 0; i < legCount; i++) {
+        if (legs[i].amount <= 0 || legs[i].source == legs[i].target) {
+            failedLeg = i;
+            return false;
+        }
+        accountNumbers.push_back(legs[i].source);
+        accountNumbers.push_back(legs[i].target);
+    }
+    sort(accountNumbers.begin(), accountNumbers.end());
+    accountNumbers.erase(unique(accountNumbers.begin(), accountNumbers.end()), accountNumbers.end());
+
+    size_t accountCount = accountNumbers.size();
+    netChange.assign(accountCount, 0);
+    legStart.assign(accountCount + 1, 0);
+    vector<uint32_t> sides(legCount * 2);
+    for (size_t i = 0; i < legCount; i++) {
+        for (int side = 0; side < 2; side++) {
+            uint32_t number = side == 0 ? legs[i].source : legs[i].target;
+            uint32_t index = (uint32_t)(lower_bound(accountNumbers.begin(), accountNumbers.end(), number) -
+                                        accountNumbers.begin());
+            sides[i * 2 + side] = index;
+            netChange[index] += side == 0 ? -legs[i].amount : legs[i].amount;
+            legStart[index + 1]++;
+        }
+    }
+    for (size_t i = 0; i < accountCount; i++) {
+        legStart[i + 1] += legStart[i];
+    }
+    legIndexes.resize(legCount * 2);
+    vector<uint32_t> filled(legStart.begin(), legStart.end() - 1);
+    for (size_t i = 0; i < legCount; i++) {
+        legIndexes[filled[sides[i * 2]]++] = (uint32_t)i;
+        legIndexes[filled[sides[i * 2 + 1]]++] = (uint32_t)i;
+    }
+    return true;
+}
+
+// Calls entry(type, amount, counterparty, descriptionId) for account accountIndex's
+// entries of the batch in booking order: its credits, then its debits
+template <typename EntryFunction>
+void forEachBatchEntry(const TransferBatchPlan& plan, size_t accountIndex, const TransferLeg* legs,
+                       EntryFunction entry) {
+    uint32_t number = plan.accountNumbers[accountIndex];
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t k = plan.legStart[accountIndex]; k < plan.legStart[accountIndex + 1]; k++) {
+            const TransferLeg& leg = legs[plan.legIndexes[k]];
+            if (pass == 0 && leg.target == number) {
+                entry(TransactionType::Credit, leg.amount, leg.source, DESCRIPTION_TRANSFER_FROM);
+            } else if (pass == 1 && leg.source == number) {
+                entry(TransactionType::Debit, leg.amount, leg.target, DESCRIPTION_TRANSFER_TO);
+            }
+        }
+    }
+}
+
+TransferBatchResult Account::applyTransferBatch(Account* const* accounts, const TransferBatchPlan& plan,
+                                                const TransferLeg* legs, size_t legCount, WriteAheadLog* log) {
+    TransferBatchResult result;
+    size_t accountCount = plan.accountNumbers.size();
+    result.accounts = accountCount;
+    vector<unique_lock<mutex>> locks;
+    locks.reserve(accountCount);
+    for (size_t i = 0; i < accountCount; i++) {
+        lockCountingConflicts(accounts[i]->accountMutex);
+        locks.emplace_back(accounts[i]->accountMutex, adopt_lock);
+    }
+    for (size_t i = 0; i < accountCount; i++) {
+        const Account& account = *accounts[i];
+        if (plan.netChange[i] < 0 && account.balance - account.held + plan.netChange[i] < 0) {
+            bankMetrics.recordRejection(REJECT_INSUFFICIENT_FUNDS);
+            result.status = OperationStatus::InsufficientFunds;
+            result.failedAccount = account.accountNumberValue;
+            return result;
+        }
+    }
+
+    int64_t timestampNs = currentEpochNanoseconds();
+    WriteEpoch epoch;
+    string payload;
+    if (log != nullptr) {
+        WalBatchHeader header = {timestampNs, (uint32_t)legCount, (uint32_t)accountCount};
+        payload.reserve(sizeof(header) + accountCount * sizeof(WalBatchAccount) + legCount * sizeof(TransferLeg));
+        payload.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    for (size_t i = 0; i < accountCount; i++) {
+        Account& account = *accounts[i];
+        uint64_t transactionId = account.transactionBase + account.transactions.size() + 1;
+        if (log != nullptr) {
+            WalBatchAccount entry = {account.accountNumberValue, 0, transactionId};
+            payload.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        }
+        forEachBatchEntry(plan, i, legs, [&](TransactionType type, Cents amount, uint32_t counterparty,
+                                             uint32_t descriptionId) {
+            account.transactions.emplace(transactionId++, descriptionId, amount, type, counterparty, timestampNs);
+            if (type == TransactionType::Debit && velocityRules.isEnabled()) {
+                account.recordDebit(descriptionId, amount, timestampNs);
+            }
+        });
+        account.balance += plan.netChange[i];
+        account.publishVersion(epoch.value());
+    }
+    bankMetrics.recordTransactions(legCount * 2);
+    if (log != nullptr) {
+        payload.append(reinterpret_cast<const char*>(legs), legCount * sizeof(TransferLeg));
+        log->append(WalRecordType::TransferBatch, payload.data(), payload.size());
+    }
+    return result;
+}
+
+void Account::restoreBatchEntries(const TransferBatchPlan& plan, size_t accountIndex, const TransferLeg* legs,
+                                  uint64_t firstTransactionId, int64_t timestampNs) {
+    uint64_t transactionId = firstTransactionId;
+    forEachBatchEntry(plan, accountIndex, legs, [&](TransactionType type, Cents amount, uint32_t counterparty,
+                                                    uint32_t descriptionId) {
+        restoreTransaction(type, transactionId++, amount, descriptionId, counterparty, timestampNs);
+    });
+}
+
+OperationResult Account::holdFunds(Cents amount) {
+    lock_guard<mutex> lock(accountMutex);
+    OperationResult result = applyHold(amount);
+    if (result.ok() && velocityRules.isEnabled()) {
+        adjustPendingOutflow(amount);
+    }
+    return result;
+}
+
+OperationResult Account::applyHold(Cents amount) {
+    if (amount <= 0) {
+        bankMetrics.recordRejection(REJECT_INVALID_AMOUNT);
+        return {OperationStatus::InvalidAmount, balance};
+    }
+    if (balance - held < amount) {
+        bankMetrics.recordRejection(REJECT_INSUFFICIENT_FUNDS);
+        return {OperationStatus::InsufficientFunds, balance};
+    }
+    held += amount;
+    return {OperationStatus::Ok, balance};
+}
+
+OperationResult Account::holdForTransfer(Cents amount, uint32_t counterparty) {
+    lock_guard<mutex> lock(accountMutex);
+    if (velocityRules.isEnabled() && canDebit(amount) &&
+        !screenDebit(DESCRIPTION_TRANSFER_TO, amount, counterparty, currentEpochNanoseconds(), false)) {
+        return {OperationStatus::Blocked, balance};
+    }
+    return applyHold(amount);
+}
+
+OperationResult Account::admitTransferCredit(Cents amount, uint32_t counterparty) {
+    lock_guard<mutex> lock(accountMutex);
+    if (amount <= 0) {
+        bankMetrics.recordRejection(REJECT_INVALID_AMOUNT);
+        return {OperationStatus::InvalidAmount, balance};
+    }
+    if (velocityRules.isEnabled() && !screenTransferCredit(amount, counterparty, currentEpochNanoseconds())) {
+        return {OperationStatus::Blocked, balance};
+    }
+    return {OperationStatus::Ok, balance};
+}
+
+void Account::releaseHold(Cents amount) {
+    lock_guard<mutex> lock(accountMutex);
+    held = max<Cents>(held - amount, 0);
+    if (velocityRules.isEnabled()) {
+        adjustPendingOutflow(-amount);
+    }
+}
+
+OperationResult Account::settlePrepared(TransactionType side, Cents amount, uint32_t counterparty,
+                                        uint64_t transferId) {
+    OperationTimer timer(METRIC_TRANSFER);
+    lock_guard<mutex> lock(accountMutex);
+    WriteEpoch epoch;
+    int64_t timestampNs = currentEpochNanoseconds();
+    OperationStatus status;
+    if (side == TransactionType::Debit) {
+        held = max<Cents>(held - amount, 0);
+        if (velocityRules.isEnabled()) {
+            adjustPendingOutflow(-amount);
+        }
+        status = applyDebit(amount, DESCRIPTION_TRANSFER_TO, counterparty, timestampNs);
+    } else {
+        status = applyCredit(amount, DESCRIPTION_TRANSFER_FROM, counterparty, timestampNs);
+    }
+    if (status == OperationStatus::Ok) {
+        publishVersion(epoch.value());
+        if (side == TransactionType::Debit && velocityRules.isEnabled()) {
+            recordDebit(DESCRIPTION_TRANSFER_TO, amount, timestampNs);
+        }
+    }
+    if (status == OperationStatus::Ok && ledgerLog != nullptr) {
+        WalSettlePayload payload = {};
+        payload.transferId = transferId;
+        payload.entry = lastEntryPayload();
+        payload.side = (uint8_t)side;
+        ledgerLog->append(WalRecordType::TransferSettled, &payload, sizeof(payload));
+    }
+    return {status, balance};
+}
+
+OperationResult Bank::prepareTransfer(uint64_t transferId, TransactionType side, Account& account,
+                                      uint32_t counterparty, Cents amount) {
+    lock_guard<mutex> lock(transferMutex);
+    if (pendingTransfers.count(transferId) != 0) {
+        return {OperationStatus::Ok, account.getBalance()};
+    }
+    OperationResult result = side == TransactionType::Debit ? account.holdForTransfer(amount, counterparty)
+                                                            : account.admitTransferCredit(amount, counterparty);
+    if (!result.ok()) {
+        return result;
+    }
+
+    PendingTransfer transfer = {transferId, account.getAccountNumberValue(), counterparty, amount, side, 0};
+    if (ledgerLog != nullptr) {
+        transfer.prepareLsn = ledgerLog->getAppendedLsn();
+        WalPreparePayload payload = {};
+        payload.transferId = transferId;
+        payload.accountNumber = transfer.account;
+        payload.counterparty = counterparty;
+        payload.amount = amount;
+        payload.side = (uint8_t)side;
+        ledgerLog->append(WalRecordType::TransferPrepared, &payload, sizeof(payload));
+    }
+    pendingTransfers[transferId] = transfer;
+    return result;
+}
+
+size_t Bank::reclaimVersions() {
+    lock_guard<mutex> sweepLock(reclaimMutex);
+    uint64_t bound = readEpochs.getReclaimBound();
+    // Accounts not built from a loaded snapshot yet have no old versions
+    vector<Customer*> customerList;
+    vector<Account*> accountList;
+    uint64_t logPosition;
+    captureBuiltDirectory(customerList, accountList, logPosition);
+    size_t freed = 0;
+    for (Account* account : accountList) {
+        freed += account->reclaimVersions(bound);
+    }
+    return freed;
+}
+
+TransferBatchResult Bank::applyTransferBatch(const TransferLeg* legs, size_t legCount) {
+    TransferBatchResult result;
+    TransferBatchPlan plan;
+    size_t failedLeg;
+    if (!plan.build(legs, legCount, failedLeg)) {
+        bool self = legs[failedLeg].source == legs[failedLeg].target;
+        bankMetrics.recordRejection(self ? REJECT_SAME_ACCOUNT : REJECT_INVALID_AMOUNT);
+        result.status = self ? OperationStatus::SameAccount : OperationStatus::InvalidAmount;
+        result.failedAccount = legs[failedLeg].source;
+        return result;
+    }
+    vector<Account*> touched(plan.accountNumbers.size());
+    for (size_t i = 0; i < touched.size(); i++) {
+        touched[i] = findAccountByNumber(plan.accountNumbers[i]);
+        if (touched[i] == nullptr) {
+            result.unknownAccount = true;
+            result.failedAccount = plan.accountNumbers[i];
+            return result;
+        }
+    }
+    return Account::applyTransferBatch(touched.data(), plan, legs, legCount, ledgerLog);
+}
+
+bool Bank::resolveTransfer(uint64_t transferId, bool commit) {
+    lock_guard<mutex> lock(transferMutex);
+    auto it = pendingTransfers.find(transferId);
+    if (it == pendingTransfers.end()) {
+        return false;
+    }
+    PendingTransfer transfer = it->second;
+    pendingTransfers.erase(it);
+    Account* account = findAccountByNumber(transfer.account);
+    if (commit) {
+        account->settlePrepared(transfer.side, transfer.amount, transfer.counterparty, transferId);
+        return true;
+    }
+    if (transfer.side == TransactionType::Debit) {
+        account->releaseHold(transfer.amount);
+    }
+    if (ledgerLog != nullptr) {
+        ledgerLog->append(WalRecordType::TransferCancelled, &transferId, sizeof(transferId));
+    }
+    return true;
+}
+
+vector<PendingTransfer> Bank::getPendingTransfers() const {
+    lock_guard<mutex> lock(transferMutex);
+    vector<PendingTransfer> pending;
+    pending.reserve(pendingTransfers.size());
+    for (const auto& entry : pendingTransfers) {
+        pending.push_back(entry.second);
+    }
+    return pending;
+}
+
+void Bank::restorePreparedTransfer(const PendingTransfer& transfer) {
+    lock_guard<mutex> lock(transferMutex);
+    if (!pendingTransfers.emplace(transfer.transferId, transfer).second) {
+        return;
+    }
+    if (transfer.side == TransactionType::Debit) {
+        findAccountByNumber(transfer.account)->holdFunds(transfer.amount);
+    }
+}
+
+void Bank::restoreResolvedTransfer(uint64_t transferId) {
+    lock_guard<mutex> lock(transferMutex);
+    auto it = pendingTransfers.find(transferId);
+    if (it == pendingTransfers.end()) {
+        return;
+    }
+    if (it->second.side == TransactionType::Debit) {
+        findAccountByNumber(it->second.account)->releaseHold(it->second.amount);
+    }
+    pendingTransfers.erase(it);
+}
+
+void Account::addTransaction(const Transaction& transaction) {
+    lock_guard<mutex> lock(accountMutex);
+    WriteEpoch epoch;
+    transactions.emplace(transaction);
+    bankMetrics.recordTransactions(1);
+    publishVersion(epoch.value());
+}
+
+void Account::restoreTransaction(TransactionType type, uint64_t transactionId, Cents amount,
+                                 uint32_t descriptionId, uint32_t counterparty, int64_t timestampNs) {
+    lock_guard<mutex> lock(accountMutex);
+    if (transactionId <= transactionBase + transactions.size()) {
+        return;
+    }
+    if (openedNs == 0 && transactionBase + transactions.size() == 0) {
+        openedNs = timestampNs;
+    }
+    WriteEpoch epoch;
+    balance += type == TransactionType::Credit ? amount : -amount;
+    transactions.emplace(transactionId, descriptionId, amount, type, counterparty, timestampNs);
+    bankMetrics.recordTransactions(1);
+    publishVersion(epoch.value());
+    if (type == TransactionType::Debit && velocityRules.isEnabled()) {
+        recordDebit(descriptionId, amount, timestampNs);
+    }
+}
+
+void Account::restoreSnapshotState(Cents snapshotBalance, uint64_t transactionCount) {
+    lock_guard<mutex> lock(accountMutex);
+    WriteEpoch epoch;
+    balance = snapshotBalance;
+    transactionBase = transactionCount;
+    openedNs = 0;
+    transactions.setOpeningBalance(snapshotBalance);
+    publishVersion(epoch.value());
+}
+
+Cents Account::getBalanceAt(int64_t timestampNs) const {
+    lock_guard<mutex> lock(accountMutex);
+    return transactions.balanceAt(timestampNs);
+}
+
+AccountStatement Account::getStatement(int64_t fromNs, int64_t toNs) const {
+    AccountStatement statement;
+    statement.fromNs = fromNs;
+    statement.toNs = toNs;
+    lock_guard<mutex> lock(accountMutex);
+    statement.openingBalance = transactions.collectBetween(fromNs, toNs, statement.entries);
+    statement.closingBalance = statement.openingBalance;
+    for (const Transaction& entry : statement.entries) {
+        statement.closingBalance += entry.getTypeCode() == TransactionType::Credit ? entry.getAmount()
+                                                                                  : -entry.getAmount();
+    }
+    return statement;
+}
+
+void Account::getHistory(uint64_t skip, size_t limit, vector<Transaction>& out) const {
+    lock_guard<mutex> lock(accountMutex);
+    uint64_t end = transactions.size() - min<uint64_t>(skip, transactions.size());
+    uint64_t first = end - min<uint64_t>(limit, end);
+    transactions.collectRange(first, (size_t)(end - first), out);
+}
+
+bool Account::readAt(const ReadView& view, Cents& viewBalance, uint64_t& transactionCount) const {
+    uint64_t stamped = versionEpoch.load(memory_order_acquire);
+    while (stamped <= view.getEpoch()) {
+        viewBalance = versionBalance.load(memory_order_relaxed);
+        transactionCount = versionTransactionCount.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t again = versionEpoch.load(memory_order_acquire);
+        if (again == stamped) return true;
+        stamped = again;
+    }
+    // A later epoch has replaced the version in place, so it was kept in the list first
+    const AccountVersion* version = olderVersions.load(memory_order_acquire);
+    while (version != nullptr && version->epoch > view.getEpoch()) {
+        version = version->older.load(memory_order_acquire);
+    }
+    if (version == nullptr) return false;
+    viewBalance = version->balance;
+    transactionCount = version->transactionCount;
+    return true;
+}
+
+void Account::getHistoryAt(const ReadView& view, uint64_t skip, size_t limit, vector<Transaction>& out) const {
+    out.clear();
+    Cents viewBalance;
+    uint64_t transactionCount;
+    if (!readAt(view, viewBalance, transactionCount)) return;
+    uint64_t base;
+    {
+        lock_guard<mutex> lock(accountMutex);
+        base = transactionBase;
+    }
+    uint64_t end = transactionCount - min(base, transactionCount);
+    end -= min<uint64_t>(skip, end);
+    uint64_t first = end - min<uint64_t>(limit, end);
+    vector<Transaction> chunk;
+    for (uint64_t start = first; start < end;) {
+        uint64_t stop = min<uint64_t>(end, start - start % TransactionLog::CHUNK_RECORDS + TransactionLog::CHUNK_RECORDS);
+        {
+            lock_guard<mutex> lock(accountMutex);
+            transactions.collectRange(start, (size_t)(stop - start), chunk);
+        }
+        out.insert(out.end(), chunk.begin(), chunk.end());
+        start = stop;
+    }
+}
+
+AccountStatement Account::getStatementAt(const ReadView& view, int64_t fromNs, int64_t toNs) const {
+    Cents viewBalance;
+    uint64_t transactionCount;
+    if (!readAt(view, viewBalance, transactionCount)) {
+        return {fromNs, toNs, 0, 0, {}};
+    }
+    AccountStatement statement = getStatement(fromNs, toNs);
+    vector<Transaction> firstLater;
+    {
+        lock_guard<mutex> lock(accountMutex);
+        transactions.collectRange(transactionCount - min(transactionBase, transactionCount), 1, firstLater);
+    }
+    // Records are stamped in order, so when the first one booked after view is
+    // stamped before fromNs the view has nothing from fromNs on, and the live
+    // opening balance would include records it never saw
+    if (!firstLater.empty() && firstLater[0].getTimestampNs() < fromNs) {
+        return {fromNs, toNs, viewBalance, viewBalance, {}};
+    }
+    auto later = find_if(statement.entries.begin(), statement.entries.end(), [&](const Transaction& entry) {
+        return entry.getTransactionNumber() > transactionCount;
+    });
+    for (auto it = later; it != statement.entries.end(); ++it) {
+        statement.closingBalance -= it->getTypeCode() == TransactionType::Credit ? it->getAmount() : -it->getAmount();
+    }
+    statement.entries.erase(later, statement.entries.end());
+    return statement;
+}
+
+size_t Account::reclaimVersions(uint64_t bound) {
+    if (olderVersions.load(memory_order_acquire) == nullptr) return 0;
+    AccountVersion* stale;
+    {
+        // Keeps a writer from pushing a version while the list is cut
+        lock_guard<mutex> lock(accountMutex);
+        stale = cutVersions(bound);
+    }
+    return freeVersions(stale);
+}
+
+bool parseIdNumber(const string& id, const char* prefix, uint32_t& number) {
+    size_t prefixLength = strlen(prefix);
+    if (id.size() <= prefixLength || id.size() > prefixLength + 9) return false;
+    for (size_t i = 0; i < prefixLength; i++) {
+        if (toupper((unsigned char)id[i]) != prefix[i]) return false;
+    }
+    number = 0;
+    for (size_t i = prefixLength; i < id.size(); i++) {
+        if (!isdigit((unsigned char)id[i])) return false;
+        number = number * 10 + (id[i] - '0');
+    }
+    return true;
+}
+
+string CustomerPrefixIndex::normalize(CustomerSearchField field, const string& text) {
+    string key;
+    key.reserve(text.size());
+    for (char character : text) {
+        unsigned char value = (unsigned char)character;
+        if (field == CustomerSearchField::Phone) {
+            if (isdigit(value)) key.push_back(character);
+        } else {
+            key.push_back((char)tolower(value));
+        }
+    }
+    return key;
+}
+
+CustomerPrefixIndex::Entry CustomerPrefixIndex::makeEntry(const string& key, uint32_t customerNumber) {
+    Entry entry;
+    memset(entry.key, 0, KEY_BYTES);
+    memcpy(entry.key, key.data(), min(key.size(), KEY_BYTES));
+    entry.customerNumber = customerNumber;
+    return entry;
+}
+
+void CustomerPrefixIndex::absorbPending() const {
+    if (pending.empty()) return;
+    size_t unsortedCount = recent.size() + pending.size();
+    if (unsortedCount <= 1024 || unsortedCount * 16 <= sorted.size()) {
+        recent.insert(pending.begin(), pending.end());
+    } else {
+        size_t middle = sorted.size();
+        sorted.insert(sorted.end(), recent.begin(), recent.end());
+        sorted.insert(sorted.end(), pending.begin(), pending.end());
+        recent.clear();
+        sort(sorted.begin() + middle, sorted.end());
+        inplace_merge(sorted.begin(), sorted.begin() + middle, sorted.end());
+    }
+    pending.clear();
+}
+
+void CustomerPrefixIndex::insert(const string& key, uint32_t customerNumber) {
+    pending.push_back(makeEntry(key, customerNumber));
+}
+
+bool CustomerPrefixIndex::find(const string& prefix, bool exact, const CustomerSearchCursor& after, size_t limit,
+                               const function<bool(uint32_t)>& confirm, vector<uint32_t>& out,
+                               CustomerSearchCursor& next) const {
+    size_t kept = min(prefix.size(), KEY_BYTES);
+    bool needsConfirm = exact ? prefix.size() >= KEY_BYTES : prefix.size() > KEY_BYTES;
+    auto inRange = [&](const Entry& entry) { return memcmp(entry.key, prefix.data(), kept) == 0; };
+    auto matches = [&](const Entry& entry) {
+        if (exact && kept < KEY_BYTES && entry.key[kept] != '\0') return false;
+        return !needsConfirm || confirm(entry.customerNumber);
+    };
+    absorbPending();
+
+    // Both sources are ordered the same way, so the matches are merged as they are read
+    Entry start = after.valid ? makeEntry(after.key, after.customerNumber) : makeEntry(prefix, 0);
+    auto sortedIt = after.valid ? upper_bound(sorted.begin(), sorted.end(), start)
+                                : lower_bound(sorted.begin(), sorted.end(), start);
+    auto recentIt = after.valid ? recent.upper_bound(start) : recent.lower_bound(start);
+    next = after;
+    while (true) {
+        bool sortedLive = sortedIt != sorted.end() && inRange(*sortedIt);
+        bool recentLive = recentIt != recent.end() && inRange(*recentIt);
+        if (!sortedLive && !recentLive) return false;
+        const Entry& entry = !recentLive || (sortedLive && *sortedIt < *recentIt) ? *sortedIt++ : *recentIt++;
+        if (!matches(entry)) continue;
+        if (out.size() >= limit) return true;
+        out.push_back(entry.customerNumber);
+        next.key.assign(entry.key, KEY_BYTES);
+        next.customerNumber = entry.customerNumber;
+        next.valid = true;
+    }
+}
+
+bool readWholeFile(const string& path, string& contents) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) return false;
+    file.seekg(0, ios::end);
+    streamoff size = file.tellg();
+    file.seekg(0, ios::beg);
+    contents.resize((size_t)max<streamoff>(size, 0));
+    file.read(&contents[0], contents.size());
+    return (bool)file || file.eof();
+}
+
+uint32_t numberFromId(const string& id) {
+    uint32_t number = 0;
+    for (char character : id) {
+        if (isdigit((unsigned char)character)) number = number * 10 + (character - '0');
+    }
+    return number;
+}
+
+bool readLengthPrefixed(const char*& cursor, const char* end, string& text) {
+    uint16_t length;
+    if (end - cursor < (ptrdiff_t)sizeof(length)) return false;
+    memcpy(&length, cursor, sizeof(length));
+    cursor += sizeof(length);
+    if (end - cursor < length) return false;
+    text.assign(cursor, length);
+    cursor += length;
+    return true;
+}
+
+bool replayLedgerRecord(Bank& bank, WalRecordType type, const char* payload, size_t length,
+                        uint64_t recordOffset, LedgerRecoverySummary& summary) {
+    const char* end = payload + length;
+    switch (type) {
+        case WalRecordType::CreateCustomer: {
+            uint32_t customerNumber;
+            string name, address, phone;
+            if (length < sizeof(customerNumber)) return false;
+            memcpy(&customerNumber, payload, sizeof(customerNumber));
+            const char* cursor = payload + sizeof(customerNumber);
+            if (!readLengthPrefixed(cursor, end, name) || !readLengthPrefixed(cursor, end, address) ||
+                !readLengthPrefixed(cursor, end, phone)) {
+                return false;
+            }
+            if (bank.findCustomerByNumber(customerNumber) != nullptr) {
+                return true; // already restored from a snapshot
+            }
+            summary.customers++;
+            return bank.restoreCustomer(customerNumber, std::move(name), std::move(address), std::move(phone)) != nullptr;
+        }
+        case WalRecordType::OpenAccount: {
+            uint32_t numbers[2];
+            string accountType;
+            if (length < sizeof(numbers)) return false;
+            memcpy(numbers, payload, sizeof(numbers));
+            const char* cursor = payload + sizeof(numbers);
+            Customer* owner = bank.findCustomerByNumber(numbers[1]);
+            if (owner == nullptr || !readLengthPrefixed(cursor, end, accountType)) return false;
+            if (bank.findAccountByNumber(numbers[0]) != nullptr) {
+                return true; // already restored from a snapshot
+            }
+            Account* account = bank.openAccount(owner, accountType, numbers[0]);
+            if (account == nullptr) return false;
+            account->clearOpenedTime();
+            summary.accounts++;
+            return true;
+        }
+        case WalRecordType::Credit:
+        case WalRecordType::Debit: {
+            WalEntryPayload entry;
+            if (length != sizeof(entry)) return false;
+            memcpy(&entry, payload, sizeof(entry));
+            Account* account = bank.findAccountByNumber(entry.accountNumber);
+            if (account == nullptr) return false;
+            account->restoreTransaction(type == WalRecordType::Credit ? TransactionType::Credit : TransactionType::Debit,
+                                        entry.transactionId, entry.amount, entry.descriptionId,
+                                        entry.counterparty, entry.timestampNs);
+            summary.entries++;
+            return true;
+        }
+        case WalRecordType::Transfer: {
+            WalTransferPayload transfer;
+            if (length != sizeof(transfer)) return false;
+            memcpy(&transfer, payload, sizeof(transfer));
+            Account* source = bank.findAccountByNumber(transfer.sourceAccount);
+            Account* target = bank.findAccountByNumber(transfer.targetAccount);
+            if (source == nullptr || target == nullptr) return false;
+            source->restoreTransaction(TransactionType::Debit, transfer.sourceTransactionId, transfer.amount,
+                                       DESCRIPTION_TRANSFER_TO, transfer.targetAccount, transfer.timestampNs);
+            target->restoreTransaction(TransactionType::Credit, transfer.targetTransactionId, transfer.amount,
+                                       DESCRIPTION_TRANSFER_FROM, transfer.sourceAccount, transfer.timestampNs);
+            summary.entries++;
+            return true;
+        }
+        case WalRecordType::TransferBatch: {
+            WalBatchHeader header;
+            if (length < sizeof(header)) return false;
+            memcpy(&header, payload, sizeof(header));
+            size_t accountBytes = (size_t)header.accountCount * sizeof(WalBatchAccount);
+            if (length != sizeof(header) + accountBytes + (size_t)header.legCount * sizeof(TransferLeg)) return false;
+            vector<TransferLeg> legs(header.legCount);
+            memcpy(legs.data(), payload + sizeof(header) + accountBytes, legs.size() * sizeof(TransferLeg));
+            TransferBatchPlan plan;
+            size_t failedLeg;
+            if (!plan.build(legs.data(), legs.size(), failedLeg) || plan.accountNumbers.size() != header.accountCount) {
+                return false;
+            }
+            const char* cursor = payload + sizeof(header);
+            for (size_t i = 0; i < header.accountCount; i++, cursor += sizeof(WalBatchAccount)) {
+                WalBatchAccount entry;
+                memcpy(&entry, cursor, sizeof(entry));
+                Account* account = bank.findAccountByNumber(entry.accountNumber);
+                if (account == nullptr || entry.accountNumber != plan.accountNumbers[i]) return false;
+                account->restoreBatchEntries(plan, i, legs.data(), entry.firstTransactionId, header.timestampNs);
+            }
+            summary.entries += header.legCount;
+            return true;
+        }
+        case WalRecordType::TransferPrepared: {
+            WalPreparePayload prepare;
+            if (length != sizeof(prepare)) return false;
+            memcpy(&prepare, payload, sizeof(prepare));
+            if (bank.findAccountByNumber(prepare.accountNumber) == nullptr) return false;
+            PendingTransfer transfer = {prepare.transferId, prepare.accountNumber, prepare.counterparty,
+                                        prepare.amount, (TransactionType)prepare.side, recordOffset};
+            bank.restorePreparedTransfer(transfer);
+            return true;
+        }
+        case WalRecordType::TransferSettled: {
+            WalSettlePayload settle;
+            if (length != sizeof(settle)) return false;
+            memcpy(&settle, payload, sizeof(settle));
+            Account* account = bank.findAccountByNumber(settle.entry.accountNumber);
+            if (account == nullptr) return false;
+            bank.restoreResolvedTransfer(settle.transferId);
+            account->restoreTransaction((TransactionType)settle.side, settle.entry.transactionId, settle.entry.amount,
+                                        settle.entry.descriptionId, settle.entry.counterparty,
+                                        settle.entry.timestampNs);
+            summary.entries++;
+            return true;
+        }
+        case WalRecordType::TransferCancelled: {
+            uint64_t transferId;
+            if (length != sizeof(transferId)) return false;
+            memcpy(&transferId, payload, sizeof(transferId));
+            bank.restoreResolvedTransfer(transferId);
+            return true;
+        }
+        case WalRecordType::TransferDecided:
+        case WalRecordType::TransferFinished:
+            break;
+    }
+    return false;
+}
+
+bool replayLedgerLog(Bank& bank, const string& path, LedgerRecoverySummary& summary, uint64_t startOffset) {
+    string contents;
+    if (!readWholeFile(path, contents)) {
+        return true; // no log yet
+    }
+
+    // A snapshot taken against a longer log than this one: replay all of it, the
+    // entries the snapshot already holds are skipped
+    size_t offset = startOffset <= contents.size() ? (size_t)startOffset : 0;
+    while (offset + sizeof(WalRecordHeader) <= contents.size()) {
+        WalRecordHeader header;
+        memcpy(&header, contents.data() + offset, sizeof(header));
+        size_t recordEnd = offset + sizeof(header) + header.payloadLength;
+        if (recordEnd > contents.size()) break;
+        const char* payload = contents.data() + offset + sizeof(header);
+        if (crc32(payload, header.payloadLength, crc32(&header.type, 1)) != header.checksum) break;
+        if (!replayLedgerRecord(bank, (WalRecordType)header.type, payload, header.payloadLength, offset, summary)) {
+            summary.validBytes = offset;
+            summary.rejectedRecord = true;
+            summary.rejectedRecordType = header.type;
+            return false;
+        }
+        offset = recordEnd;
+    }
+
+    summary.validBytes = offset;
+    if (offset < contents.size()) {
+        summary.truncatedTail = true;
+        if (truncate(path.c_str(), (off_t)offset) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Here we write and load binary snapshots of every customer and account. The
+// file is a header followed by fixed-width customer and account tables, each in
+// number order, and a string table. Loading maps the file and checks the tables
+// in one pass, with no text parsing, and keeps the mapping. A Customer or Account
+// object is built from its record only when it is first looked up (a binary
+// search of the table), so a cold start does not depend on building every
+// object: 10M accounts load in about 0.1 s, where building them all takes about
+// 9 s on one core. Only log records written after the snapshot's log offset
+// need to be replayed afterwards.
+const char SNAPSHOT_MAGIC[8] = {'B', 'K', 'S', 'N', 'A', 'P', '0', '1'};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t customerCount;
+    uint64_t accountCount;
+    uint64_t logOffset;             // replay the ledger log from here after loading
+    uint64_t customerTableOffset;
+    uint64_t accountTableOffset;
+    uint64_t stringTableOffset;
+    uint64_t fileSize;
+    int64_t createdAtNs;
+    uint32_t headerChecksum;        // CRC-32 of everything above
+    uint32_t reserved;
+};
+
+struct SnapshotCustomer {
+    uint32_t customerNumber;
+    uint16_t nameLength;
+    uint16_t addressLength;
+    uint16_t phoneLength;
+    uint16_t reserved[3];
+    uint64_t textOffset;            // name, address and phone stored back to back
+};
+
+struct SnapshotAccount {
+    uint32_t accountNumber;
+    uint32_t customerNumber;
+    uint64_t transactionCount;
+    Cents balance;
+    uint64_t typeOffset;
+    uint32_t typeLength;
+    uint32_t reserved;
+};
+
+uint32_t snapshotHeaderChecksum(const SnapshotHeader& header) {
+    return crc32(&header, offsetof(SnapshotHeader, headerChecksum));
+}
+
+class LoadedSnapshot {
+private:
+    void* mapping;
+    size_t mappingSize;
+
+public:
+    const SnapshotCustomer* customerTable;
+    const SnapshotAccount* accountTable;
+    size_t customerCount;
+    size_t accountCount;
+    const char* strings;
+    // The accounts of customer row c are the account rows listed from
+    // accountRows[accountStart[c]] up to accountRows[accountStart[c + 1]], in order
+    vector<uint32_t> accountStart;
+    vector<uint32_t> accountRows;
+
+    static constexpr size_t NOT_FOUND = SIZE_MAX;
+
+    LoadedSnapshot(void* mapping, size_t mappingSize, const SnapshotHeader& header)
+        : mapping(mapping), mappingSize(mappingSize),
+          customerTable(reinterpret_cast<const SnapshotCustomer*>(static_cast<const char*>(mapping) +
+                                                                  header.customerTableOffset)),
+          accountTable(reinterpret_cast<const SnapshotAccount*>(static_cast<const char*>(mapping) +
+                                                                header.accountTableOffset)),
+          customerCount((size_t)header.customerCount), accountCount((size_t)header.accountCount),
+          strings(static_cast<const char*>(mapping) + header.stringTableOffset) {}
+    LoadedSnapshot(const LoadedSnapshot&) = delete;
+    LoadedSnapshot& operator=(const LoadedSnapshot&) = delete;
+    ~LoadedSnapshot() { munmap(mapping, mappingSize); }
+
+    // Row of the record with this number, or NOT_FOUND
+    size_t findCustomer(uint32_t number) const {
+        const SnapshotCustomer* end = customerTable + customerCount;
+        const SnapshotCustomer* entry = lower_bound(customerTable, end, number,
+            [](const SnapshotCustomer& candidate, uint32_t wanted) { return candidate.customerNumber < wanted; });
+        return entry != end && entry->customerNumber == number ? (size_t)(entry - customerTable) : NOT_FOUND;
+    }
+
+    size_t findAccount(uint32_t number) const {
+        const SnapshotAccount* end = accountTable + accountCount;
+        const SnapshotAccount* entry = lower_bound(accountTable, end, number,
+            [](const SnapshotAccount& candidate, uint32_t wanted) { return candidate.accountNumber < wanted; });
+        return entry != end && entry->accountNumber == number ? (size_t)(entry - accountTable) : NOT_FOUND;
+    }
+};
+
+void Bank::attachLoadedSnapshot(shared_ptr<const LoadedSnapshot> snapshot) {
+    lock_guard<mutex> lock(directoryMutex);
+    unbuiltCustomers = snapshot->customerCount;
+    unbuiltAccounts = snapshot->accountCount;
+    if (snapshot->customerCount > 0) {
+        nextCustomerNumber = max(nextCustomerNumber,
+                                 snapshot->customerTable[snapshot->customerCount - 1].customerNumber + 1);
+    }
+    if (snapshot->accountCount > 0) {
+        nextAccountNumber = max(nextAccountNumber, snapshot->accountTable[snapshot->accountCount - 1].accountNumber + 1);
+    }
+    loadedSnapshot = std::move(snapshot);
+    snapshotPending.store(true, memory_order_release);
+}
+
+Customer* Bank::buildLoadedCustomer(size_t row, vector<Account*>& builtAccounts) {
+    const LoadedSnapshot& snapshot = *loadedSnapshot;
+    const SnapshotCustomer& entry = snapshot.customerTable[row];
+    const char* text = snapshot.strings + entry.textOffset;
+    Customer* customer = insertCustomer(entry.customerNumber, string(text, entry.nameLength),
+                                        string(text + entry.nameLength, entry.addressLength),
+                                        string(text + entry.nameLength + entry.addressLength, entry.phoneLength));
+    unbuiltCustomers--;
+    CustomerHandle handle = customerIndex.at(entry.customerNumber);
+    for (uint32_t i = snapshot.accountStart[row]; i < snapshot.accountStart[row + 1]; i++) {
+        const SnapshotAccount& account = snapshot.accountTable[snapshot.accountRows[i]];
+        builtAccounts.push_back(insertAccount(account.accountNumber, handle,
+                                              string(snapshot.strings + account.typeOffset, account.typeLength),
+                                              account.balance, account.transactionCount));
+        unbuiltAccounts--;
+    }
+    return customer;
+}
+
+Customer* Bank::lookupCustomer(uint32_t number) {
+    auto it = customerIndex.find(number);
+    if (it != customerIndex.end()) return customerSlab.get(it->second);
+    size_t row = loadedSnapshot != nullptr ? loadedSnapshot->findCustomer(number) : LoadedSnapshot::NOT_FOUND;
+    if (row == LoadedSnapshot::NOT_FOUND) return nullptr;
+    Customer* customer = buildLoadedCustomer(row, accounts);
+    customers.push_back(customer);
+    return customer;
+}
+
+// An account is built with its owner's, which loadSnapshot checked is in the snapshot too
+Account* Bank::lookupAccount(uint32_t number) {
+    auto it = accountIndex.find(number);
+    if (it != accountIndex.end()) return accountSlab.get(it->second);
+    size_t row = loadedSnapshot != nullptr ? loadedSnapshot->findAccount(number) : LoadedSnapshot::NOT_FOUND;
+    if (row == LoadedSnapshot::NOT_FOUND) return nullptr;
+    lookupCustomer(loadedSnapshot->accountTable[row].customerNumber);
+    return accountSlab.get(accountIndex.at(number));
+}
+
+void Bank::buildLoadedSnapshot() {
+    const LoadedSnapshot& snapshot = *loadedSnapshot;
+    customers.clear();
+    accounts.clear();
+    reserve(snapshot.customerCount + customersSinceLoad.size(), snapshot.accountCount + accountsSinceLoad.size());
+
+    // Accounts built here are put at their row; those built earlier are found in the index
+    vector<Account*> accountByRow(snapshot.accountCount);
+    vector<Account*> builtAccounts;
+    for (size_t row = 0; row < snapshot.customerCount; row++) {
+        auto it = customerIndex.find(snapshot.customerTable[row].customerNumber);
+        if (it != customerIndex.end()) {
+            customers.push_back(customerSlab.get(it->second));
+            continue;
+        }
+        builtAccounts.clear();
+        customers.push_back(buildLoadedCustomer(row, builtAccounts));
+        for (size_t i = 0; i < builtAccounts.size(); i++) {
+            accountByRow[snapshot.accountRows[snapshot.accountStart[row] + i]] = builtAccounts[i];
+        }
+    }
+    customers.insert(customers.end(), customersSinceLoad.begin(), customersSinceLoad.end());
+    for (size_t row = 0; row < snapshot.accountCount; row++) {
+        Account* account = accountByRow[row];
+        accounts.push_back(account != nullptr ? account
+                                              : accountSlab.get(accountIndex.at(snapshot.accountTable[row].accountNumber)));
+    }
+    accounts.insert(accounts.end(), accountsSinceLoad.begin(), accountsSinceLoad.end());
+
+    vector<Customer*>().swap(customersSinceLoad);
+    vector<Account*>().swap(accountsSinceLoad);
+    loadedSnapshot.reset();
+    snapshotPending.store(false, memory_order_release);
+}
+
+Customer* Bank::findLoadedCustomer(uint32_t number) const {
+    lock_guard<mutex> lock(directoryMutex);
+    return const_cast<Bank*>(this)->lookupCustomer(number);
+}
+
+Account* Bank::findLoadedAccount(uint32_t number) const {
+    lock_guard<mutex> lock(directoryMutex);
+    return const_cast<Bank*>(this)->lookupAccount(number);
+}
+
+void Bank::completeDirectory() const {
+    if (!snapshotPending.load(memory_order_acquire)) return;
+    lock_guard<mutex> lock(directoryMutex);
+    if (snapshotPending) const_cast<Bank*>(this)->buildLoadedSnapshot();
+}
+
+// Calls visitRecord for each saved record and visitObject for each object,
+// merged in number order; an object replaces the saved record with the same
+// number. Both inputs are in number order.
+template <typename Record, typename Object, typename RecordNumber, typename ObjectNumber, typename VisitRecord,
+          typename VisitObject>
+void visitInNumberOrder(const Record* records, size_t recordCount, RecordNumber recordNumber,
+                        const vector<Object*>& objects, ObjectNumber objectNumber, VisitRecord visitRecord,
+                        VisitObject visitObject) {
+    size_t record = 0;
+    size_t object = 0;
+    while (record < recordCount || object < objects.size()) {
+        if (object == objects.size() ||
+            (record < recordCount && recordNumber(records[record]) < objectNumber(objects[object]))) {
+            visitRecord(records[record++]);
+            continue;
+        }
+        if (record < recordCount && recordNumber(records[record]) == objectNumber(objects[object])) record++;
+        visitObject(objects[object++]);
+    }
+}
+
+bool writeSnapshot(Bank& bank, const string& path, SnapshotSummary& summary) {
+    auto start = chrono::steady_clock::now();
+    vector<Customer*> customerList;
+    vector<Account*> accountList;
+    uint64_t logOffset;
+    // Records of a loaded snapshot that were never used are copied from it as they are
+    shared_ptr<const LoadedSnapshot> loaded = bank.captureBuiltDirectory(customerList, accountList, logOffset);
+    const SnapshotCustomer* loadedCustomers = loaded != nullptr ? loaded->customerTable : nullptr;
+    const SnapshotAccount* loadedAccounts = loaded != nullptr ? loaded->accountTable : nullptr;
+    size_t loadedCustomerCount = loaded != nullptr ? loaded->customerCount : 0;
+    size_t loadedAccountCount = loaded != nullptr ? loaded->accountCount : 0;
+
+    // The lists are in number order unless accounts were given scattered numbers
+    // (a shard) or some were built from a snapshot out of order
+    auto customerNumber = [](const Customer* customer) { return numberFromId(customer->getCustomerId()); };
+    auto accountNumber = [](const Account* account) { return account->getAccountNumberValue(); };
+    auto savedCustomerNumber = [](const SnapshotCustomer& entry) { return entry.customerNumber; };
+    auto savedAccountNumber = [](const SnapshotAccount& entry) { return entry.accountNumber; };
+    auto byCustomerNumber = [&](const Customer* left, const Customer* right) {
+        return customerNumber(left) < customerNumber(right);
+    };
+    auto byAccountNumber = [&](const Account* left, const Account* right) {
+        return accountNumber(left) < accountNumber(right);
+    };
+    if (!is_sorted(customerList.begin(), customerList.end(), byCustomerNumber)) {
+        sort(customerList.begin(), customerList.end(), byCustomerNumber);
+    }
+    if (!is_sorted(accountList.begin(), accountList.end(), byAccountNumber)) {
+        sort(accountList.begin(), accountList.end(), byAccountNumber);
+    }
+
+    string temporaryPath = path + ".tmp";
+    FILE* file = fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr) return false;
+    vector<char> streamBuffer(1 << 20);
+    setvbuf(file, streamBuffer.data(), _IOFBF, streamBuffer.size());
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.logOffset = logOffset;
+    header.customerTableOffset = sizeof(SnapshotHeader);
+    header.createdAtNs = currentEpochNanoseconds();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    auto writeText = [&](const string& text) {
+        size_t length = min<size_t>(text.size(), 0xFFFF);
+        ok = ok && fwrite(text.data(), 1, length, file) == length;
+    };
+
+    uint64_t stringBytes = 0;
+    auto writeCustomerEntry = [&](SnapshotCustomer entry) {
+        entry.textOffset = stringBytes;
+        stringBytes += entry.nameLength + entry.addressLength + entry.phoneLength;
+        ok = ok && fwrite(&entry, sizeof(entry), 1, file) == 1;
+        header.customerCount++;
+    };
+    visitInNumberOrder(loadedCustomers, loadedCustomerCount, savedCustomerNumber, customerList, customerNumber,
+                       writeCustomerEntry, [&](const Customer* customer) {
+        SnapshotCustomer entry = {};
+        entry.customerNumber = customerNumber(customer);
+        entry.nameLength = (uint16_t)min<size_t>(customer->getName().size(), 0xFFFF);
+        entry.addressLength = (uint16_t)min<size_t>(customer->getAddress().size(), 0xFFFF);
+        entry.phoneLength = (uint16_t)min<size_t>(customer->getPhoneNumber().size(), 0xFFFF);
+        writeCustomerEntry(entry);
+    });
+
+    // Account types repeat a lot ("Savings", "Checking"), so each distinct one is stored once
+    unordered_map<string, uint64_t> typeOffsets;
+    unordered_map<uint64_t, uint64_t> savedTypeOffsets;
+    vector<const string*> typeOrder;
+    auto typeOffset = [&](const string& type) {
+        auto inserted = typeOffsets.emplace(type, stringBytes);
+        if (inserted.second) {
+            typeOrder.push_back(&inserted.first->first);
+            stringBytes += inserted.first->first.size();
+        }
+        return inserted.first->second;
+    };
+    auto writeAccountEntry = [&](const SnapshotAccount& entry) {
+        ok = ok && fwrite(&entry, sizeof(entry), 1, file) == 1;
+        header.accountCount++;
+    };
+    visitInNumberOrder(loadedAccounts, loadedAccountCount, savedAccountNumber, accountList, accountNumber,
+                       [&](SnapshotAccount entry) {
+        auto known = savedTypeOffsets.find(entry.typeOffset);
+        if (known == savedTypeOffsets.end()) {
+            string type(loaded->strings + entry.typeOffset, entry.typeLength);
+            known = savedTypeOffsets.emplace(entry.typeOffset, typeOffset(type)).first;
+        }
+        entry.typeOffset = known->second;
+        writeAccountEntry(entry);
+    }, [&](const Account* account) {
+        SnapshotAccount entry = {};
+        entry.accountNumber = accountNumber(account);
+        entry.customerNumber = numberFromId(bank.getCustomer(account->getOwner())->getCustomerId());
+        account->readState(entry.balance, entry.transactionCount);
+        entry.typeOffset = typeOffset(account->getAccountType());
+        entry.typeLength = (uint32_t)account->getAccountType().size();
+        writeAccountEntry(entry);
+    });
+
+    visitInNumberOrder(loadedCustomers, loadedCustomerCount, savedCustomerNumber, customerList, customerNumber,
+                       [&](const SnapshotCustomer& entry) {
+        size_t length = (size_t)entry.nameLength + entry.addressLength + entry.phoneLength;
+        ok = ok && fwrite(loaded->strings + entry.textOffset, 1, length, file) == length;
+    }, [&](const Customer* customer) {
+        writeText(customer->getName());
+        writeText(customer->getAddress());
+        writeText(customer->getPhoneNumber());
+    });
+    for (const string* type : typeOrder) {
+        writeText(*type);
+    }
+
+    header.accountTableOffset = header.customerTableOffset + header.customerCount * sizeof(SnapshotCustomer);
+    header.stringTableOffset = header.accountTableOffset + header.accountCount * sizeof(SnapshotAccount);
+    header.fileSize = header.stringTableOffset + stringBytes;
+    header.headerChecksum = snapshotHeaderChecksum(header);
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fflush(file) == 0;
+
+    // Everything the snapshot reflects must be durable in the log before the snapshot replaces the old one
+    ok = ok && bank.commitLedger();
+    ok = ok && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(temporaryPath.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+
+    summary.customers = header.customerCount;
+    summary.accounts = header.accountCount;
+    summary.logOffset = logOffset;
+    summary.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+bool loadSnapshot(Bank& bank, const string& path, SnapshotSummary& summary, bool& found) {
+    auto start = chrono::steady_clock::now();
+    found = false;
+    int fileDescriptor = ::open(path.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) return false;
+    found = true;
+
+    struct stat fileInfo;
+    if (fstat(fileDescriptor, &fileInfo) != 0 || (size_t)fileInfo.st_size < sizeof(SnapshotHeader)) {
+        ::close(fileDescriptor);
+        return false;
+    }
+    size_t fileSize = (size_t)fileInfo.st_size;
+    void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    ::close(fileDescriptor);
+    if (mapping == MAP_FAILED) return false;
+    madvise(mapping, fileSize, MADV_SEQUENTIAL);
+
+    const char* base = static_cast<const char*>(mapping);
+    const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(base);
+    bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+                 header->headerChecksum == snapshotHeaderChecksum(*header) && header->fileSize == fileSize &&
+                 header->accountTableOffset == header->customerTableOffset + header->customerCount * sizeof(SnapshotCustomer) &&
+                 header->stringTableOffset == header->accountTableOffset + header->accountCount * sizeof(SnapshotAccount) &&
+                 header->stringTableOffset <= fileSize;
+    if (!valid) {
+        munmap(mapping, fileSize);
+        return false;
+    }
+
+    const SnapshotCustomer* customerTable = reinterpret_cast<const SnapshotCustomer*>(base + header->customerTableOffset);
+    const SnapshotAccount* accountTable = reinterpret_cast<const SnapshotAccount*>(base + header->accountTableOffset);
+    const char* strings = base + header->stringTableOffset;
+    size_t stringBytes = fileSize - header->stringTableOffset;
+    uint64_t customerCount = header->customerCount;
+    uint64_t accountCount = header->accountCount;
+    uint64_t logOffset = header->logOffset;
+
+    // One pass checks everything building a record would: text within the string
+    // table, numbers strictly ascending (so unique, and found by binary search)
+    // and every owner present. It also counts each customer's accounts, so that a
+    // customer can be built with all of them. Owners are found through a table
+    // indexed by customer number. Tables out of order (written before they were
+    // sorted), or customer numbers too sparse for that table, are built in full
+    // instead.
+    uint32_t firstCustomer = customerCount > 0 ? customerTable[0].customerNumber : 0;
+    uint32_t lastCustomer = customerCount > 0 ? customerTable[customerCount - 1].customerNumber : 0;
+    uint64_t customerRange = customerCount > 0 ? (uint64_t)lastCustomer - firstCustomer + 1 : 0;
+    bool deferred = customerRange <= 8 * customerCount && accountCount < UINT32_MAX;
+    const uint32_t NO_CUSTOMER = UINT32_MAX;
+    vector<uint32_t> customerRows(deferred ? customerRange : 0, NO_CUSTOMER);
+    vector<uint32_t> accountStart(deferred ? customerCount + 1 : 0);
+    for (uint64_t i = 0; i < customerCount && valid; i++) {
+        const SnapshotCustomer& entry = customerTable[i];
+        valid = entry.textOffset + entry.nameLength + entry.addressLength + entry.phoneLength <= stringBytes;
+        if (entry.customerNumber > lastCustomer || (i > 0 && entry.customerNumber <= customerTable[i - 1].customerNumber)) {
+            deferred = false;
+        }
+        if (deferred) customerRows[entry.customerNumber - firstCustomer] = (uint32_t)i;
+    }
+    auto ownerRow = [&](const SnapshotAccount& entry) {
+        uint64_t offset = (uint64_t)entry.customerNumber - firstCustomer;
+        return entry.customerNumber >= firstCustomer && offset < customerRange ? customerRows[offset] : NO_CUSTOMER;
+    };
+    uint64_t transactions = 0;
+    for (uint64_t i = 0; i < accountCount && valid; i++) {
+        const SnapshotAccount& entry = accountTable[i];
+        valid = entry.typeOffset + entry.typeLength <= stringBytes;
+        transactions += entry.transactionCount;
+        if (i > 0 && entry.accountNumber <= accountTable[i - 1].accountNumber) deferred = false;
+        if (deferred) {
+            uint32_t owner = ownerRow(entry);
+            valid = valid && owner != NO_CUSTOMER;
+            if (valid) accountStart[owner + 1]++;
+        }
+    }
+
+    if (!valid) {
+        munmap(mapping, fileSize);
+    } else if (deferred && customerCount + accountCount > 0) {
+        shared_ptr<LoadedSnapshot> snapshot = make_shared<LoadedSnapshot>(mapping, fileSize, *header);
+        for (size_t row = 0; row < customerCount; row++) {
+            accountStart[row + 1] += accountStart[row];
+        }
+        vector<uint32_t> nextSlot(accountStart.begin(), accountStart.end() - 1);
+        snapshot->accountRows.resize(accountCount);
+        for (uint64_t i = 0; i < accountCount; i++) {
+            snapshot->accountRows[nextSlot[ownerRow(accountTable[i])]++] = (uint32_t)i;
+        }
+        snapshot->accountStart = std::move(accountStart);
+        madvise(mapping, fileSize, MADV_RANDOM);
+        bank.attachLoadedSnapshot(std::move(snapshot));
+    } else {
+        bank.reserve(customerCount, accountCount);
+        for (uint64_t i = 0; i < customerCount && valid; i++) {
+            const SnapshotCustomer& entry = customerTable[i];
+            const char* text = strings + entry.textOffset;
+            valid = bank.restoreCustomer(entry.customerNumber, string(text, entry.nameLength),
+                                         string(text + entry.nameLength, entry.addressLength),
+                                         string(text + entry.nameLength + entry.addressLength, entry.phoneLength)) != nullptr;
+        }
+        for (uint64_t i = 0; i < accountCount && valid; i++) {
+            const SnapshotAccount& entry = accountTable[i];
+            valid = bank.restoreAccount(entry.accountNumber, entry.customerNumber,
+                                        string(strings + entry.typeOffset, entry.typeLength), entry.balance,
+                                        entry.transactionCount) != nullptr;
+        }
+        munmap(mapping, fileSize);
+    }
+    if (valid) bankMetrics.recordTransactions(transactions);
+
+    summary.customers = customerCount;
+    summary.accounts = accountCount;
+    summary.logOffset = logOffset;
+    summary.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return valid;
+}
+
+bool writeMetricsFile(const Bank& bank, const string& path) {
+    MetricsTotals totals;
+    bankMetrics.collect(totals);
+
+    string temporaryPath = path + ".tmp";
+    {
+        ofstream out(temporaryPath);
+        if (!out) return false;
+        out << "# HELP bank_operations_total Account operations attempted.\n";
+        out << "# TYPE bank_operations_total counter\n";
+        for (int op = 0; op < METRIC_OPERATION_COUNT; op++) {
+            out << "bank_operations_total{operation=\"" << METRIC_OPERATION_NAMES[op] << "\"} "
+                << totals.operations[op] << "\n";
+        }
+        out << "# HELP bank_operation_rejections_total Operations refused, by reason.\n";
+        out << "# TYPE bank_operation_rejections_total counter\n";
+        for (int r = 0; r < REJECT_REASON_COUNT; r++) {
+            out << "bank_operation_rejections_total{reason=\"" << METRIC_REJECTION_NAMES[r] << "\"} "
+                << totals.rejections[r] << "\n";
+        }
+        out << "# HELP bank_velocity_rule_hits_total Payments that tripped a velocity rule (flagged or blocked).\n";
+        out << "# TYPE bank_velocity_rule_hits_total counter\n";
+        for (int r = 0; r < RULE_COUNT; r++) {
+            out << "bank_velocity_rule_hits_total{rule=\"" << VELOCITY_RULE_NAMES[r] << "\"} "
+                << totals.ruleHits[r] << "\n";
+        }
+        out << "# HELP bank_operation_latency_seconds Time spent inside an account operation, sampled 1 in "
+            << LATENCY_SAMPLE_EVERY << " per thread.\n";
+        out << "# TYPE bank_operation_latency_seconds histogram\n";
+        for (int op = 0; op < METRIC_OPERATION_COUNT; op++) {
+            uint64_t cumulative = 0;
+            for (int b = 0; b <= LATENCY_BUCKETS; b++) {
+                cumulative += totals.latencyBuckets[op][b];
+                out << "bank_operation_latency_seconds_bucket{operation=\"" << METRIC_OPERATION_NAMES[op]
+                    << "\",le=\"";
+                if (b == LATENCY_BUCKETS) {
+                    out << "+Inf";
+                } else {
+                    out << ((uint64_t)1 << (b + LATENCY_FIRST_BUCKET_BITS)) * 1e-9;
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "bank_operation_latency_seconds_sum{operation=\"" << METRIC_OPERATION_NAMES[op] << "\"} "
+                << totals.latencySumNs[op] * 1e-9 << "\n";
+            out << "bank_operation_latency_seconds_count{operation=\"" << METRIC_OPERATION_NAMES[op] << "\"} "
+                << cumulative << "\n";
+        }
+        out << "# HELP bank_customers Customers in the bank.\n";
+        out << "# TYPE bank_customers gauge\n";
+        out << "bank_customers " << bank.getCustomerCount() << "\n";
+        out << "# HELP bank_accounts Accounts in the bank.\n";
+        out << "# TYPE bank_accounts gauge\n";
+        out << "bank_accounts " << bank.getAccountCount() << "\n";
+        out << "# HELP bank_transactions Transactions recorded across all accounts.\n";
+        out << "# TYPE bank_transactions gauge\n";
+        out << "bank_transactions " << totals.transactions << "\n";
+        if (!out.flush()) return false;
+    }
+    return rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+const char AUDIT_STATE_MAGIC[8] = {'B', 'A', 'N', 'K', 'A', 'U', 'D', '1'};
+
+struct AuditStateEntry {
+    uint32_t accountNumber;
+    uint32_t reserved;
+    uint64_t transactionBase;
+    uint64_t sealedChunks;
+    Cents balance;
+    Sha256Digest chainDigest;
+};
+
+bool LedgerAuditState::load(const string& path) {
+    string contents;
+    if (!readWholeFile(path, contents)) {
+        return true;
+    }
+    size_t headerBytes = sizeof(AUDIT_STATE_MAGIC) + sizeof(uint64_t);
+    uint64_t count;
+    if (contents.size() < headerBytes + sizeof(uint32_t) ||
+        memcmp(contents.data(), AUDIT_STATE_MAGIC, sizeof(AUDIT_STATE_MAGIC)) != 0) {
+        return false;
+    }
+    memcpy(&count, contents.data() + sizeof(AUDIT_STATE_MAGIC), sizeof(count));
+    size_t bodyBytes = headerBytes + count * sizeof(AuditStateEntry);
+    uint32_t checksum;
+    if (contents.size() != bodyBytes + sizeof(checksum)) return false;
+    memcpy(&checksum, contents.data() + bodyBytes, sizeof(checksum));
+    if (crc32(contents.data(), bodyBytes) != checksum) return false;
+
+    marks.clear();
+    marks.reserve(count);
+    const char* cursor = contents.data() + headerBytes;
+    for (uint64_t i = 0; i < count; i++, cursor += sizeof(AuditStateEntry)) {
+        AuditStateEntry entry;
+        memcpy(&entry, cursor, sizeof(entry));
+        AccountAuditMark& mark = marks[entry.accountNumber];
+        mark.audited = true;
+        mark.transactionBase = entry.transactionBase;
+        mark.sealedChunks = entry.sealedChunks;
+        mark.balance = entry.balance;
+        mark.chainDigest = entry.chainDigest;
+    }
+    return true;
+}
+
+bool LedgerAuditState::save(const string& path) const {
+    string contents(AUDIT_STATE_MAGIC, sizeof(AUDIT_STATE_MAGIC));
+    uint64_t count = 0;
+    contents.append(sizeof(count), '\0');
+    for (const auto& item : marks) {
+        if (!item.second.audited) continue;
+        AuditStateEntry entry = {};
+        entry.accountNumber = item.first;
+        entry.transactionBase = item.second.transactionBase;
+        entry.sealedChunks = item.second.sealedChunks;
+        entry.balance = item.second.balance;
+        entry.chainDigest = item.second.chainDigest;
+        contents.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        count++;
+    }
+    memcpy(&contents[sizeof(AUDIT_STATE_MAGIC)], &count, sizeof(count));
+    uint32_t checksum = crc32(contents.data(), contents.size());
+    contents.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+
+    string temporaryPath = path + ".tmp";
+    {
+        ofstream out(temporaryPath, ios::binary);
+        if (!out || !out.write(contents.data(), (streamsize)contents.size()) || !out.flush()) return false;
+    }
+    return rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+LedgerAuditSummary auditLedger(const Bank& bank, LedgerAuditState& state, unsigned threadCount) {
+    auto start = chrono::steady_clock::now();
+    if (threadCount == 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+    vector<Customer*> customerList;
+    vector<Account*> accountList;
+    bank.captureDirectory(customerList, accountList);
+
+    // Every mark exists before the threads start, so they never insert into the map
+    vector<AccountAuditMark*> marks(accountList.size());
+    for (size_t i = 0; i < accountList.size(); i++) {
+        marks[i] = &state.mark(accountList[i]->getAccountNumberValue());
+    }
+    vector<AccountAuditResult> results(accountList.size());
+    vector<Sha256Digest> heads(accountList.size());
+
+    const size_t batchSize = 64;
+    atomic<size_t> nextAccount(0);
+    auto worker = [&]() {
+        while (true) {
+            size_t first = nextAccount.fetch_add(batchSize, memory_order_relaxed);
+            if (first >= accountList.size()) return;
+            size_t last = min(accountList.size(), first + batchSize);
+            for (size_t i = first; i < last; i++) {
+                const Account& account = *accountList[i];
+                results[i] = account.audit(*marks[i]);
+                uint8_t head[60];
+                uint32_t number = account.getAccountNumberValue();
+                memcpy(head, &number, 4);
+                memcpy(head + 4, &marks[i]->transactionBase, 8);
+                memcpy(head + 12, &marks[i]->sealedChunks, 8);
+                memcpy(head + 20, &marks[i]->balance, 8);
+                memcpy(head + 28, marks[i]->chainDigest.bytes, 32);
+                heads[i] = sha256(head, sizeof(head));
+            }
+        }
+    };
+    vector<thread> workers;
+    for (unsigned t = 1; t < threadCount; t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (thread& running : workers) {
+        running.join();
+    }
+
+    LedgerAuditSummary summary;
+    summary.accounts = accountList.size();
+    summary.threads = threadCount;
+    for (size_t i = 0; i < accountList.size(); i++) {
+        const AccountAuditResult& result = results[i];
+        uint32_t number = accountList[i]->getAccountNumberValue();
+        summary.chunksVerified += result.chunksVerified;
+        summary.chunksSkipped += result.chunksSkipped;
+        summary.recordsVerified += result.recordsVerified;
+        summary.rebased += result.rebased ? 1 : 0;
+        if (!result.readable) {
+            summary.unreadable.push_back(number);
+        } else if (!result.chainIntact) {
+            summary.brokenChains.push_back(number);
+        } else if (!result.balanceMatches) {
+            summary.balanceMismatches.push_back(number);
+        }
+    }
+    summary.bookRoot = TransactionLog::merkleRoot(heads.data(), heads.size());
+    summary.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return summary;
+}
+
+TransferScheduler::TransferScheduler(int64_t tickNs, int64_t startNs)
+    : tickNs(max<int64_t>(tickNs, 1)), nextTick((uint64_t)max<int64_t>(startNs, 0) / (uint64_t)this->tickNs + 1),
+      nextTickCascaded(false), cascaded(0) {
+    fill(heads, heads + WHEEL_LEVELS * WHEEL_SLOTS, (uint32_t)NO_SLOT);
+    fill(levelZeroOccupied, levelZeroOccupied + WHEEL_SLOTS / 64, 0);
+}
+
+void TransferScheduler::link(uint32_t slot, uint64_t earliestTick) {
+    ScheduledTransfer& order = *orders.atSlot(slot);
+    uint64_t placed = max(order.dueTick, earliestTick);
+    uint64_t delta = placed - nextTick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS) != 0) {
+        // Past the top level's reach: park it in the furthest slot; it is placed again when that slot is emptied
+        placed = nextTick + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    uint32_t index = (uint32_t)level * WHEEL_SLOTS + (uint32_t)((placed >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    order.wheelSlot = (uint16_t)index;
+    order.previous = NO_SLOT;
+    order.next = heads[index];
+    if (order.next != NO_SLOT) {
+        orders.atSlot(order.next)->previous = slot;
+    }
+    heads[index] = slot;
+    if (index < WHEEL_SLOTS) {
+        levelZeroOccupied[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+}
+
+void TransferScheduler::unlink(uint32_t slot) {
+    ScheduledTransfer& order = *orders.atSlot(slot);
+    if (order.previous != NO_SLOT) {
+        orders.atSlot(order.previous)->next = order.next;
+    } else {
+        heads[order.wheelSlot] = order.next;
+        if (order.next == NO_SLOT && order.wheelSlot < WHEEL_SLOTS) {
+            levelZeroOccupied[order.wheelSlot / 64] &= ~((uint64_t)1 << (order.wheelSlot % 64));
+        }
+    }
+    if (order.next != NO_SLOT) {
+        orders.atSlot(order.next)->previous = order.previous;
+    }
+}
+
+// Empties the slot of level that covers nextTick into the levels below it
+void TransferScheduler::cascade(int level) {
+    uint32_t index = (uint32_t)level * WHEEL_SLOTS +
+                     (uint32_t)((nextTick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    uint32_t slot = heads[index];
+    heads[index] = NO_SLOT;
+    while (slot != NO_SLOT) {
+        uint32_t following = orders.atSlot(slot)->next;
+        link(slot, nextTick);
+        cascaded++;
+        slot = following;
+    }
+}
+
+uint64_t TransferScheduler::schedule(uint32_t source, uint32_t target, Cents amount, int64_t firstDueNs,
+                                     int64_t intervalNs, uint32_t count) {
+    if (intervalNs != 0 && (intervalNs < tickNs || intervalNs / tickNs > 0xFFFFFFFFLL)) return 0;
+    ScheduledTransfer order = {};
+    order.source = source;
+    order.target = target;
+    order.amount = amount;
+    order.dueTick = (uint64_t)max<int64_t>(firstDueNs, 0) / (uint64_t)tickNs;
+    order.intervalTicks = (uint32_t)(intervalNs / tickNs);
+    order.remaining = order.intervalTicks == 0 ? 1 : count;
+    SlabHandle<ScheduledTransfer> handle = orders.emplace(order);
+    link(handle.slot, nextTick);
+    return (uint64_t)handle.generation << 32 | handle.slot;
+}
+
+bool TransferScheduler::cancel(uint64_t orderId) {
+    SlabHandle<ScheduledTransfer> handle{(uint32_t)orderId, (uint32_t)(orderId >> 32)};
+    if (orders.get(handle) == nullptr) return false;
+    unlink(handle.slot);
+    orders.release(handle);
+    return true;
+}
+
+size_t TransferScheduler::collectDue(int64_t nowNs, size_t limit, vector<DueTransfer>& out) {
+    uint64_t nowTick = (uint64_t)max<int64_t>(nowNs, 0) / (uint64_t)tickNs;
+    size_t collected = 0;
+    while (nextTick <= nowTick && collected < limit) {
+        if (!nextTickCascaded) {
+            // Highest level first, so an order can fall all the way down in one tick
+            int top = 0;
+            while (top < WHEEL_LEVELS - 1 && (nextTick & (((uint64_t)1 << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+                top++;
+            }
+            for (int level = top; level >= 1; level--) {
+                cascade(level);
+            }
+            nextTickCascaded = true;
+        }
+
+        uint32_t& head = heads[nextTick & (WHEEL_SLOTS - 1)];
+        while (head != NO_SLOT && collected < limit) {
+            uint32_t slot = head;
+            ScheduledTransfer& order = *orders.atSlot(slot);
+            unlink(slot);
+            if (order.dueTick > nextTick) {
+                link(slot, nextTick + 1); // parked beyond the wheel's reach; not due yet
+                continue;
+            }
+            SlabHandle<ScheduledTransfer> handle = orders.handleAt(slot);
+            DueTransfer due;
+            due.orderId = (uint64_t)handle.generation << 32 | slot;
+            due.source = order.source;
+            due.target = order.target;
+            due.amount = order.amount;
+            due.dueNs = (int64_t)(order.dueTick * (uint64_t)tickNs);
+            out.push_back(due);
+            collected++;
+
+            if (order.remaining == 1) {
+                orders.release(handle);
+            } else {
+                if (order.remaining != 0) order.remaining--;
+                order.dueTick += order.intervalTicks;
+                // Never back into the slot being emptied, even when catching up on missed ticks
+                link(slot, nextTick + 1);
+            }
+        }
+        if (head != NO_SLOT) break;
+        nextTick++;
+        nextTickCascaded = false;
+
+        // Jump to the next occupied level-0 slot, stopping at the end of this turn where a cascade is due
+        uint32_t index = (uint32_t)(nextTick & (WHEEL_SLOTS - 1));
+        if (index == 0) continue;
+        uint64_t skipTo = (nextTick | (WHEEL_SLOTS - 1)) + 1;
+        for (uint32_t word = index / 64; word < WHEEL_SLOTS / 64; word++) {
+            uint64_t bits = levelZeroOccupied[word];
+            if (word == index / 64) bits &= ~(uint64_t)0 << (index % 64);
+            if (bits != 0) {
+                skipTo = (nextTick & ~(uint64_t)(WHEEL_SLOTS - 1)) + word * 64 + (uint32_t)__builtin_ctzll(bits);
+                break;
+            }
+        }
+        nextTick = min(skipTo, nowTick + 1);
+    }
+    return collected;
+}
+
+StandingOrderRun runDueTransfers(Bank& bank, TransferScheduler& scheduler, int64_t nowNs, size_t batchSize) {
+    StandingOrderRun run;
+    vector<DueTransfer> batch;
+    batch.reserve(max<size_t>(batchSize, 1));
+    while (true) {
+        batch.clear();
+        if (scheduler.collectDue(nowNs, max<size_t>(batchSize, 1), batch) == 0) break;
+        for (const DueTransfer& due : batch) {
+            Account* source = bank.findAccountByNumber(due.source);
+            Account* target = bank.findAccountByNumber(due.target);
+            if (source != nullptr && target != nullptr && source->transfer(*target, due.amount).ok()) {
+                run.applied++;
+            } else {
+                run.rejected++;
+            }
+        }
+        run.due += batch.size();
+        run.batches++;
+        run.durable = bank.commitLedger() && run.durable;
+    }
+    return run;
+}
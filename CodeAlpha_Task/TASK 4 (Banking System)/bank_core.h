@@ -0,0 +1,2169 @@
+// Core banking model: customers, accounts, the transaction ledger and its
+// persistence. Nothing in here writes to the console. Operations report what
+// happened through OperationStatus, and the menu program and batch drivers in
+// "4th Question (Banking System).cpp" decide what to show.
+#ifndef BANK_CORE_H
+#define BANK_CORE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <ctime>
+#include <cctype>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <memory>
+#include <type_traits>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+class Customer;
+class Account;
+class Transaction;
+class SlidingWindow;
+class ReadView;
+
+// Names an object in a Slab: its slot and the generation the slot was on when
+// the object was placed there. Once the object is released the slot moves to
+// a new generation, so an old handle finds nothing instead of whatever reuses
+// the slot. The zero handle never names anything.
+template <typename T>
+struct SlabHandle {
+    uint32_t slot = 0;
+    uint32_t generation = 0;
+
+    bool valid() const { return generation != 0; }
+    bool operator==(const SlabHandle& other) const { return slot == other.slot && generation == other.generation; }
+    bool operator!=(const SlabHandle& other) const { return !(*this == other); }
+};
+
+typedef SlabHandle<Customer> CustomerHandle;
+typedef SlabHandle<Account> AccountHandle;
+
+// Objects of one type, built in place in pages of PAGE_OBJECTS instead of one
+// allocation each. Pages never move, so an object's address is stable for its
+// lifetime, and objects placed one after another sit next to each other in
+// memory. Freed slots are reused, under a new generation.
+//
+// A slot's generation is odd while it holds an object and even while it is
+// free, which makes "is this handle still good" one comparison. The owner
+// serializes emplace and release; get may run from many threads at once
+// between them.
+template <typename T>
+class Slab {
+public:
+    static const size_t PAGE_OBJECTS = 64;
+
+private:
+    struct Page {
+        typename aligned_storage<sizeof(T), alignof(T)>::type objects[PAGE_OBJECTS];
+    };
+
+    vector<unique_ptr<Page>> pages;
+    vector<uint32_t> generations;
+    vector<uint32_t> freeSlots;
+    size_t live;
+
+    T* address(uint32_t slot) const {
+        return reinterpret_cast<T*>(&pages[slot / PAGE_OBJECTS]->objects[slot % PAGE_OBJECTS]);
+    }
+
+public:
+    Slab() : live(0) {}
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    ~Slab() {
+        for (uint32_t slot = 0; slot < generations.size(); slot++) {
+            if (generations[slot] % 2 != 0) address(slot)->~T();
+        }
+    }
+
+    // Makes room for objectCount objects in all, pages included
+    void reserve(size_t objectCount) {
+        generations.reserve(objectCount);
+        pages.reserve((objectCount + PAGE_OBJECTS - 1) / PAGE_OBJECTS);
+        while (pages.size() * PAGE_OBJECTS < objectCount) {
+            pages.emplace_back(new Page);
+        }
+    }
+
+    template <typename... Args>
+    SlabHandle<T> emplace(Args&&... args) {
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = (uint32_t)generations.size();
+            if (slot / PAGE_OBJECTS == pages.size()) {
+                pages.emplace_back(new Page);
+            }
+            generations.push_back(0);
+        }
+        new (address(slot)) T(std::forward<Args>(args)...);
+        generations[slot]++;
+        live++;
+        return SlabHandle<T>{slot, generations[slot]};
+    }
+
+    // nullptr once the object has been released
+    T* get(SlabHandle<T> handle) const {
+        if (handle.slot >= generations.size() || generations[handle.slot] != handle.generation ||
+            !handle.valid()) {
+            return nullptr;
+        }
+        return address(handle.slot);
+    }
+
+    // The object in a slot known to be in use, for owners that link objects by slot number
+    T* atSlot(uint32_t slot) const { return address(slot); }
+    SlabHandle<T> handleAt(uint32_t slot) const { return SlabHandle<T>{slot, generations[slot]}; }
+
+    // Destroys the object; false if the handle was already stale
+    bool release(SlabHandle<T> handle) {
+        if (get(handle) == nullptr) return false;
+        address(handle.slot)->~T();
+        generations[handle.slot]++;
+        freeSlots.push_back(handle.slot);
+        live--;
+        return true;
+    }
+
+    size_t size() const { return live; }
+};
+
+// Outgoing payments across all of one customer's accounts, for the velocity
+// rules. The window is created on first use; the accounts share it under windowMutex.
+struct CustomerOutflow {
+    mutex windowMutex;
+    unique_ptr<SlidingWindow> window;
+    int64_t pending = 0;        // cents of prepared cross-shard debits not settled yet, kept while the rules are on
+
+    ~CustomerOutflow();
+};
+
+class Customer {
+private:
+    string customerId;
+    string name;
+    string address;
+    string phoneNumber;
+    vector<AccountHandle> accounts;
+    CustomerOutflow outflow;
+
+public:
+    Customer(string id, string name, string address, string phone)
+        : customerId(std::move(id)), name(std::move(name)), address(std::move(address)),
+          phoneNumber(std::move(phone)) {}
+
+    string getCustomerId() const { return customerId; }
+    string getName() const { return name; }
+    string getAddress() const { return address; }
+    string getPhoneNumber() const { return phoneNumber; }
+    const vector<AccountHandle>& getAccounts() const { return accounts; }
+    // Customers are never released (Bank keeps them for good), so their
+    // accounts may keep a pointer to this
+    CustomerOutflow* getOutflow() { return &outflow; }
+
+    void addAccount(AccountHandle account);
+};
+
+// Money is kept as a whole number of cents so balances never pick up rounding error
+typedef int64_t Cents;
+
+Cents dollarsToCents(double dollars);
+
+string formatCents(Cents cents);
+
+int64_t currentEpochNanoseconds();
+
+enum class TransactionType : uint8_t {
+    Credit = 0,
+    Debit = 1
+};
+
+// Here we intern description text so a ledger record carries a 32-bit id
+// instead of its own string. The common descriptions are registered up front.
+class DescriptionTable {
+private:
+    vector<string> texts;
+    unordered_map<string, uint32_t> ids;
+    mutable mutex tableMutex;
+
+public:
+    DescriptionTable() {
+        intern("Deposit");
+        intern("Withdrawal");
+        intern("Transfer to");
+        intern("Transfer from");
+        intern("Interest");
+        intern("Maintenance fee");
+    }
+
+    uint32_t intern(const string& text) {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = ids.find(text);
+        if (it != ids.end()) return it->second;
+        uint32_t id = (uint32_t)texts.size();
+        texts.push_back(text);
+        ids.emplace(text, id);
+        return id;
+    }
+
+    string text(uint32_t id) const {
+        lock_guard<mutex> lock(tableMutex);
+        return texts[id];
+    }
+};
+
+const uint32_t DESCRIPTION_DEPOSIT = 0;
+const uint32_t DESCRIPTION_WITHDRAWAL = 1;
+const uint32_t DESCRIPTION_TRANSFER_TO = 2;
+const uint32_t DESCRIPTION_TRANSFER_FROM = 3;
+const uint32_t DESCRIPTION_INTEREST = 4;
+const uint32_t DESCRIPTION_FEE = 5;
+
+extern DescriptionTable descriptionTable;
+
+// Here we keep one fixed-width ledger record per operation. Everything is a
+// number; the strings shown to the user are only built by the getters below.
+class Transaction {
+private:
+    uint64_t transactionId;
+    int64_t timestampNs;
+    Cents amount;
+    uint32_t descriptionId;
+    uint32_t counterparty;      // account number on the other side of a transfer, 0 if none
+    TransactionType type;
+
+public:
+    Transaction(uint64_t transId, uint32_t descId, Cents amt, TransactionType type,
+                uint32_t counterparty = 0, int64_t timestampNs = currentEpochNanoseconds())
+        : transactionId(transId), timestampNs(timestampNs), amount(amt),
+          descriptionId(descId), counterparty(counterparty), type(type) {}
+
+    uint64_t getTransactionNumber() const { return transactionId; }
+    int64_t getTimestampNs() const { return timestampNs; }
+    uint32_t getDescriptionId() const { return descriptionId; }
+    uint32_t getCounterparty() const { return counterparty; }
+    Cents getAmount() const { return amount; }
+    TransactionType getTypeCode() const { return type; }
+
+    string getTransactionId() const { return "T" + to_string(transactionId); }
+
+    string getTimestamp() const {
+        time_t seconds = (time_t)(timestampNs / 1000000000LL);
+        string text = ctime(&seconds);
+        return text.substr(0, text.length()-1); // Remove newline
+    }
+
+    string getDescription() const {
+        string text = descriptionTable.text(descriptionId);
+        return counterparty == 0 ? text : text + " ACCT" + to_string(counterparty);
+    }
+
+    string getType() const { return type == TransactionType::Credit ? "Credit" : "Debit"; }
+};
+
+uint32_t crc32(const void* data, size_t length, uint32_t crc = 0);
+
+struct Sha256Digest {
+    uint8_t bytes[32];
+
+    bool operator==(const Sha256Digest& other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+    bool operator!=(const Sha256Digest& other) const { return !(*this == other); }
+};
+
+Sha256Digest sha256(const void* data, size_t length);
+
+string formatDigest(const Sha256Digest& digest);
+
+void putVarint(string& out, uint64_t value);
+
+bool getVarint(const char*& cursor, const char* end, uint64_t& value);
+
+uint64_t zigzagEncode(int64_t value);
+
+int64_t zigzagDecode(uint64_t value);
+
+// Every cold segment holds one spilled chunk of an account's history and points
+// back at the segment spilled before it, so an account's history can be walked
+// from the file alone. The header also carries the chunk's checkpoint (see
+// TransactionLog), which is dropped from memory once the chunk is spilled.
+struct ColdSegmentHeader {
+    uint32_t payloadBytes;
+    uint32_t checksum;              // CRC-32 of the payload
+    uint32_t accountNumber;
+    uint32_t recordCount;
+    uint64_t previousSegment;       // reference of the account's previous segment, 0 for the first
+    uint64_t firstTransactionId;
+    int64_t firstTimestampNs;
+    Cents balanceBefore;
+    Sha256Digest chainDigest;
+};
+
+struct ColdHistoryStats {
+    atomic<uint64_t> segmentsWritten{0};
+    atomic<uint64_t> recordsSpilled{0};
+    atomic<uint64_t> bytesWritten{0};
+    atomic<uint64_t> segmentsRead{0};
+};
+
+// Here we keep spilled history in one append-only file. Records are delta and
+// varint encoded, which typically shrinks a 40-byte record to around a dozen
+// bytes. Writers reserve their range with an atomic add and write it with
+// pwrite, so spilling from many accounts at once needs no lock.
+class ColdHistoryStore {
+private:
+    int fileDescriptor;
+    atomic<uint64_t> endOffset;
+    mutable ColdHistoryStats stats;
+
+public:
+    ColdHistoryStore() : fileDescriptor(-1), endOffset(0) {}
+    ColdHistoryStore(const ColdHistoryStore&) = delete;
+    ColdHistoryStore& operator=(const ColdHistoryStore&) = delete;
+
+    ~ColdHistoryStore() {
+        if (fileDescriptor >= 0) ::close(fileDescriptor);
+    }
+
+    // The store only lives as long as the process; history is rebuilt from the ledger log on startup
+    bool open(const string& path) {
+        fileDescriptor = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        return fileDescriptor >= 0;
+    }
+
+    // Returns a reference to the new segment (offset + 1), or 0 when it could not be written
+    uint64_t appendSegment(uint32_t accountNumber, uint64_t previousSegment, const Transaction* records,
+                           size_t recordCount, Cents balanceBefore, const Sha256Digest& chainDigest) {
+        string segment(sizeof(ColdSegmentHeader), '\0');
+        uint64_t previousId = records[0].getTransactionNumber() - 1;
+        int64_t previousTimestamp = records[0].getTimestampNs();
+        for (size_t i = 0; i < recordCount; i++) {
+            const Transaction& record = records[i];
+            putVarint(segment, record.getTransactionNumber() - previousId);
+            putVarint(segment, zigzagEncode(record.getTimestampNs() - previousTimestamp));
+            putVarint(segment, zigzagEncode(record.getAmount()));
+            putVarint(segment, record.getDescriptionId());
+            putVarint(segment, record.getCounterparty());
+            segment.push_back((char)record.getTypeCode());
+            previousId = record.getTransactionNumber();
+            previousTimestamp = record.getTimestampNs();
+        }
+
+        ColdSegmentHeader header = {};
+        header.payloadBytes = (uint32_t)(segment.size() - sizeof(header));
+        header.checksum = crc32(segment.data() + sizeof(header), header.payloadBytes);
+        header.accountNumber = accountNumber;
+        header.recordCount = (uint32_t)recordCount;
+        header.previousSegment = previousSegment;
+        header.firstTransactionId = records[0].getTransactionNumber();
+        header.firstTimestampNs = records[0].getTimestampNs();
+        header.balanceBefore = balanceBefore;
+        header.chainDigest = chainDigest;
+        memcpy(&segment[0], &header, sizeof(header));
+
+        uint64_t offset = endOffset.fetch_add(segment.size(), memory_order_relaxed);
+        if (pwrite(fileDescriptor, segment.data(), segment.size(), (off_t)offset) != (ssize_t)segment.size()) {
+            return 0;
+        }
+        stats.segmentsWritten.fetch_add(1, memory_order_relaxed);
+        stats.recordsSpilled.fetch_add(recordCount, memory_order_relaxed);
+        stats.bytesWritten.fetch_add(segment.size(), memory_order_relaxed);
+        return offset + 1;
+    }
+
+    bool readSegmentHeader(uint64_t reference, ColdSegmentHeader& header) const {
+        return reference != 0 &&
+               pread(fileDescriptor, &header, sizeof(header), (off_t)(reference - 1)) == (ssize_t)sizeof(header);
+    }
+
+    bool readSegment(uint64_t reference, ColdSegmentHeader& header, vector<Transaction>& records) const {
+        if (!readSegmentHeader(reference, header)) return false;
+        uint64_t offset = reference - 1;
+        string payload(header.payloadBytes, '\0');
+        if (pread(fileDescriptor, &payload[0], payload.size(), (off_t)(offset + sizeof(header))) !=
+                (ssize_t)payload.size() ||
+            crc32(payload.data(), payload.size()) != header.checksum) {
+            return false;
+        }
+        stats.segmentsRead.fetch_add(1, memory_order_relaxed);
+
+        records.clear();
+        records.reserve(header.recordCount);
+        const char* cursor = payload.data();
+        const char* end = cursor + payload.size();
+        uint64_t id = header.firstTransactionId - 1;
+        int64_t timestamp = header.firstTimestampNs;
+        for (uint32_t i = 0; i < header.recordCount; i++) {
+            uint64_t idDelta, timeDelta, amount, descriptionId, counterparty;
+            if (!getVarint(cursor, end, idDelta) || !getVarint(cursor, end, timeDelta) ||
+                !getVarint(cursor, end, amount) || !getVarint(cursor, end, descriptionId) ||
+                !getVarint(cursor, end, counterparty) || cursor >= end) {
+                return false;
+            }
+            TransactionType type = (TransactionType)*cursor++;
+            id += idDelta;
+            timestamp += zigzagDecode(timeDelta);
+            records.emplace_back(id, (uint32_t)descriptionId, zigzagDecode(amount), type,
+                                 (uint32_t)counterparty, timestamp);
+        }
+        return true;
+    }
+
+    const ColdHistoryStats& getStats() const { return stats; }
+};
+
+// Running totals for every TransactionLog, reported after a batch. Only touched
+// once per chunk, so relaxed atomics keep them cheap under concurrent transfers.
+struct TransactionArenaStats {
+    atomic<size_t> chunkAllocations{0};
+    atomic<size_t> chunkFrees{0};
+    atomic<size_t> bytesReserved{0};
+    atomic<size_t> peakBytesReserved{0};
+};
+
+extern TransactionArenaStats transactionArenaStats;
+
+// Here we store an account's transactions in fixed-size chunks. Records are
+// constructed in place, sit next to each other in memory, and every chunk is
+// released in one go when the account goes away instead of one delete per record.
+//
+// When a cold store is configured only the newest residentChunkLimit chunks stay
+// in memory. The chunks form a ring: once the limit is reached the oldest chunk
+// is spilled to the store and its memory is reused for the next records, so a
+// busy account's footprint stays constant. Indexes passed to operator[] count
+// from the account's first record; only [firstResident(), size()) is in memory.
+//
+// Every chunk also leaves a checkpoint behind: the time of its first record,
+// the balance just before it and its chain digest. Resident chunks keep theirs
+// in memory; a spilled chunk's checkpoint travels in its segment header. To find
+// spilled chunks again the log keeps one entry per CHECKPOINT_GROUP of them (the
+// group's first timestamp and newest segment, a quarter of a bit per record), so
+// a point-in-time balance or a date-range statement binary searches the groups,
+// walks back at most a group's worth of segment headers and reads a chunk or
+// two. Records are assumed to be appended in time order, as live operations and
+// ledger replay both do.
+//
+// A chunk is sealed the moment it fills: each run of 8 records (264 bytes, five
+// SHA-256 blocks) is hashed into one leaf of a four-leaf Merkle tree, and the
+// checkpoint's chain digest hashes the previous chunk's digest with that root,
+// the chunk's first transaction number and the balance before it. Sealing a
+// chunk of 32 records costs 28 compression blocks (20 for the leaves, 6 for
+// the tree, 2 for the link), where a leaf per record would cost 96.
+// Changing any sealed record, or a checkpoint balance, breaks every digest
+// from there on, which is what an audit looks for. The first chunk chains from
+// a digest of the account number, the transaction count before it and the
+// opening balance.
+struct HistoryCheckpoint {
+    int64_t firstTimestampNs;
+    Cents balanceBefore;
+    uint64_t coldSegment;       // cold store reference when read back for a spilled chunk, 0 while resident
+    Sha256Digest chainDigest;   // set when the chunk is sealed
+};
+
+// Where the last clean audit of an account stopped. Its first sealedChunks
+// chunks were verified; chainDigest and balance are the values after them.
+struct AccountAuditMark {
+    bool audited = false;
+    uint64_t transactionBase = 0;
+    uint64_t sealedChunks = 0;
+    Cents balance = 0;
+    Sha256Digest chainDigest = {};
+};
+
+struct AccountAuditResult {
+    uint64_t chunksVerified = 0;
+    uint64_t chunksSkipped = 0;     // covered by the mark
+    uint64_t recordsVerified = 0;
+    bool rebased = false;           // the mark did not fit (a snapshot restore since), so audited in full
+    bool chainIntact = true;
+    bool balanceMatches = true;
+    bool readable = true;           // every spilled chunk could be read back
+
+    bool clean() const { return chainIntact && balanceMatches && readable; }
+};
+
+class TransactionLog {
+public:
+    static constexpr size_t CHUNK_RECORDS = 32;
+    static constexpr size_t LEAF_RECORDS = 8;
+    static constexpr size_t CHECKPOINT_GROUP = 16;
+
+    // Called once at startup, before any account exists
+    static void configureTiering(ColdHistoryStore* store, size_t residentRecords) {
+        coldStore = store;
+        residentChunkLimit = max<size_t>(1, (residentRecords + CHUNK_RECORDS - 1) / CHUNK_RECORDS);
+    }
+
+    static ColdHistoryStore* getColdStore() { return coldStore; }
+
+private:
+    static ColdHistoryStore* coldStore;
+    static size_t residentChunkLimit;
+
+    struct SpilledGroup {
+        int64_t firstTimestampNs;   // of the group's first chunk
+        uint64_t newestSegment;     // cold store reference of the group's newest spilled chunk
+    };
+
+    vector<Transaction*> chunks;    // ring of chunks, the oldest resident one at chunks[headChunk]
+    size_t headChunk;
+    size_t count;                   // resident records
+    uint64_t spilled;               // records moved to the cold store
+    uint32_t ownerNumber;
+    vector<HistoryCheckpoint> checkpoints;  // resident chunks only, the first is chunk spilledChunks()
+    vector<SpilledGroup> spilledGroups;     // one per CHECKPOINT_GROUP spilled chunks
+    Cents runningBalance;           // balance after the newest record
+
+    size_t spilledChunks() const { return (size_t)(spilled / CHUNK_RECORDS); }
+    // Reads spilled checkpoints back from their segment headers, newest first from
+    // chunk newest down, until visit returns false; false if a header is unreadable
+    bool walkSpilled(size_t newest, const function<bool(size_t, const HistoryCheckpoint&)>& visit) const;
+    // Checkpoints of chunks [first, last] in order, spilled ones read back from the cold store
+    bool checkpointRange(size_t first, size_t last, vector<HistoryCheckpoint>& out) const;
+    // Copies chunk number chunkIndex, with checkpoint from checkpointRange, from memory or the cold store
+    bool loadChunk(size_t chunkIndex, const HistoryCheckpoint& checkpoint, vector<Transaction>& out) const;
+    // Last chunk whose first record is stamped before timestampNs, or 0 when none is
+    bool chunkBefore(int64_t timestampNs, size_t& chunkIndex, HistoryCheckpoint& checkpoint) const;
+    void sealNewestChunk();
+
+    void allocateChunk() {
+        if (headChunk != 0) {
+            rotate(chunks.begin(), chunks.begin() + headChunk, chunks.end());
+            headChunk = 0;
+        }
+        size_t bytes = CHUNK_RECORDS * sizeof(Transaction);
+        chunks.push_back(static_cast<Transaction*>(::operator new(bytes)));
+        transactionArenaStats.chunkAllocations.fetch_add(1, memory_order_relaxed);
+        size_t reserved = transactionArenaStats.bytesReserved.fetch_add(bytes, memory_order_relaxed) + bytes;
+        size_t peak = transactionArenaStats.peakBytesReserved.load(memory_order_relaxed);
+        while (reserved > peak &&
+               !transactionArenaStats.peakBytesReserved.compare_exchange_weak(peak, reserved, memory_order_relaxed)) {
+        }
+    }
+
+    bool spillOldestChunk() {
+        const HistoryCheckpoint& oldest = checkpoints.front();
+        uint64_t previous = spilledGroups.empty() ? 0 : spilledGroups.back().newestSegment;
+        uint64_t segment = coldStore->appendSegment(ownerNumber, previous, chunks[headChunk], CHUNK_RECORDS,
+                                                    oldest.balanceBefore, oldest.chainDigest);
+        if (segment == 0) return false;
+        if (spilledChunks() % CHECKPOINT_GROUP == 0) {
+            spilledGroups.push_back({oldest.firstTimestampNs, segment});
+        } else {
+            spilledGroups.back().newestSegment = segment;
+        }
+        checkpoints.erase(checkpoints.begin());
+        headChunk = (headChunk + 1) % chunks.size();
+        count -= CHUNK_RECORDS;
+        spilled += CHUNK_RECORDS;
+        return true;
+    }
+
+    const Transaction& resident(uint64_t index) const {
+        size_t local = (size_t)(index - spilled);
+        return chunks[(headChunk + local / CHUNK_RECORDS) % chunks.size()][local % CHUNK_RECORDS];
+    }
+
+public:
+    TransactionLog()
+        : headChunk(0), count(0), spilled(0), ownerNumber(0), runningBalance(0) {}
+    TransactionLog(const TransactionLog&) = delete;
+    TransactionLog& operator=(const TransactionLog&) = delete;
+
+    ~TransactionLog() {
+        static_assert(is_trivially_destructible<Transaction>::value, "records are released without destructors");
+        for (Transaction* chunk : chunks) {
+            ::operator delete(chunk);
+            transactionArenaStats.chunkFrees.fetch_add(1, memory_order_relaxed);
+            transactionArenaStats.bytesReserved.fetch_sub(CHUNK_RECORDS * sizeof(Transaction), memory_order_relaxed);
+        }
+    }
+
+    void setOwner(uint32_t accountNumber) { ownerNumber = accountNumber; }
+    // Balance before the first record; set when the account starts from a snapshot
+    void setOpeningBalance(Cents balance) { runningBalance = balance; }
+
+    template <typename... Args>
+    Transaction& emplace(Args&&... args) {
+        if (count == chunks.size() * CHUNK_RECORDS) {
+            bool reused = coldStore != nullptr && chunks.size() >= residentChunkLimit && spillOldestChunk();
+            if (!reused) {
+                allocateChunk();
+            }
+        }
+        size_t local = count;
+        Transaction* slot = chunks[(headChunk + local / CHUNK_RECORDS) % chunks.size()] + local % CHUNK_RECORDS;
+        new (slot) Transaction(std::forward<Args>(args)...);
+        if (size() % CHUNK_RECORDS == 0) {
+            checkpoints.push_back({slot->getTimestampNs(), runningBalance, 0, Sha256Digest()});
+        }
+        runningBalance += slot->getTypeCode() == TransactionType::Credit ? slot->getAmount() : -slot->getAmount();
+        count++;
+        if (size() % CHUNK_RECORDS == 0) {
+            sealNewestChunk();
+        }
+        return *slot;
+    }
+
+    uint64_t size() const { return spilled + count; }
+    bool empty() const { return size() == 0; }
+    uint64_t firstResident() const { return spilled; }
+    size_t residentCount() const { return count; }
+
+    const Transaction& operator[](uint64_t index) const { return resident(index); }
+
+    // Copies records [first, first + limit) into out in order, reading spilled
+    // ones back from the cold store
+    void collectRange(uint64_t first, size_t limit, vector<Transaction>& out) const;
+    // Balance after every record stamped at or before timestampNs
+    Cents balanceAt(int64_t timestampNs) const;
+    // Copies the records stamped in [fromNs, toNs) into out and returns the balance before them
+    Cents collectBetween(int64_t fromNs, int64_t toNs, vector<Transaction>& out) const;
+
+    static Sha256Digest chunkRoot(const Transaction* records, size_t recordCount);
+    // Reduces nodes in place to their Merkle root; an odd node out is carried up unchanged
+    static Sha256Digest merkleRoot(Sha256Digest* nodes, size_t count);
+    static Sha256Digest genesisDigest(uint32_t accountNumber, uint64_t transactionBase, Cents openingBalance);
+    static Sha256Digest chainLink(const Sha256Digest& previous, const Sha256Digest& root, uint64_t firstTransactionId,
+                                  Cents balanceBefore);
+
+    // Re-hashes the sealed chunks after the mark (all of them when the mark does
+    // not fit transactionBase), checks their numbering, balances and chain, sums
+    // the unsealed tail and compares the total with balance. Advances the mark
+    // only when everything checks out.
+    AccountAuditResult audit(AccountAuditMark& mark, uint64_t transactionBase, Cents balance) const;
+};
+
+// Every ledger change is written to the log as a header followed by a fixed
+// or length-prefixed payload. Only operations that succeeded are logged.
+enum class WalRecordType : uint8_t {
+    CreateCustomer = 1,
+    OpenAccount = 2,
+    Credit = 3,
+    Debit = 4,
+    Transfer = 5,
+    TransferPrepared = 6,       // one side of a cross-shard transfer, see Bank::prepareTransfer
+    TransferSettled = 7,
+    TransferCancelled = 8,
+    TransferDecided = 9,        // shard router decision log only
+    TransferFinished = 10,
+    TransferBatch = 11          // a netted batch, see Bank::applyTransferBatch
+};
+
+struct WalRecordHeader {
+    uint32_t payloadLength;
+    uint32_t checksum;          // CRC-32 of the type byte and the payload
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+struct WalEntryPayload {        // Credit and Debit
+    uint32_t accountNumber;
+    uint32_t descriptionId;
+    uint32_t counterparty;
+    uint32_t reserved;
+    uint64_t transactionId;
+    Cents amount;
+    int64_t timestampNs;
+};
+
+struct WalTransferPayload {
+    uint32_t sourceAccount;
+    uint32_t targetAccount;
+    uint64_t sourceTransactionId;
+    uint64_t targetTransactionId;
+    Cents amount;
+    int64_t timestampNs;
+};
+
+struct WalPreparePayload {      // TransferPrepared
+    uint64_t transferId;
+    uint32_t accountNumber;
+    uint32_t counterparty;
+    Cents amount;
+    uint8_t side;               // TransactionType this shard will book
+    uint8_t reserved[7];
+};
+
+struct WalSettlePayload {       // TransferSettled; TransferCancelled carries only the id
+    uint64_t transferId;
+    WalEntryPayload entry;
+    uint8_t side;
+    uint8_t reserved[7];
+};
+
+// TransferBatch: this header, then accountCount WalBatchAccount entries in
+// ascending account number, then legCount TransferLegs. Every account's
+// entries are numbered on from its firstTransactionId in TransferBatchPlan order.
+struct WalBatchHeader {
+    int64_t timestampNs;
+    uint32_t legCount;
+    uint32_t accountCount;
+};
+
+struct WalBatchAccount {
+    uint32_t accountNumber;
+    uint32_t reserved;
+    uint64_t firstTransactionId;
+};
+
+// One transfer inside a netted batch; also its layout in a TransferBatch record
+struct TransferLeg {
+    uint32_t source;
+    uint32_t target;
+    Cents amount;
+};
+
+// The accounts a batch touches, in ascending account number, each with its net
+// change and its legs. An account's entries are booked credits first, then
+// debits, each in batch order, so its running balance only falls towards the
+// final (checked) balance.
+struct TransferBatchPlan {
+    vector<uint32_t> accountNumbers;
+    vector<Cents> netChange;
+    vector<uint32_t> legStart;      // account i's legs are legIndexes[legStart[i], legStart[i + 1])
+    vector<uint32_t> legIndexes;
+
+    // False, with failedLeg set, if a leg has a non-positive amount or pays its own account
+    bool build(const TransferLeg* legs, size_t legCount, size_t& failedLeg);
+};
+
+
+// Here we keep an append-only write-ahead log with group commit. Callers copy
+// their record into an in-memory batch; a background thread writes the batch and
+// calls fdatasync once for all of it when the batch reaches commitBatchSize
+// records or its oldest record has waited commitLatencyBudget, whichever is first.
+class WriteAheadLog {
+private:
+    int fileDescriptor;
+    size_t commitBatchSize;
+    chrono::microseconds commitLatencyBudget;
+
+    mutable mutex bufferMutex;
+    condition_variable flushNeeded;
+    condition_variable durableAdvanced;
+    string pendingBytes;
+    size_t pendingRecords;
+    chrono::steady_clock::time_point oldestPending;
+    uint64_t appendedLsn;       // byte offset just past the last appended record
+    uint64_t durableLsn;        // byte offset up to which the file has been synced
+    bool flushRequested;
+    bool stopping;
+    bool writeFailed;
+    uint64_t groupCommits;
+    uint64_t recordsLogged;
+    thread flusher;
+
+    void flusherLoop() {
+        string writingBytes;
+        unique_lock<mutex> lock(bufferMutex);
+        while (true) {
+            if (pendingRecords == 0) {
+                if (stopping) break;
+                flushNeeded.wait(lock);
+                continue;
+            }
+            auto deadline = oldestPending + commitLatencyBudget;
+            while (!stopping && !flushRequested && pendingRecords < commitBatchSize &&
+                   chrono::steady_clock::now() < deadline) {
+                flushNeeded.wait_until(lock, deadline);
+            }
+
+            writingBytes.swap(pendingBytes);
+            uint64_t batchEndLsn = appendedLsn;
+            pendingRecords = 0;
+            flushRequested = false;
+            lock.unlock();
+
+            bool ok = writeFully(writingBytes.data(), writingBytes.size()) && fdatasync(fileDescriptor) == 0;
+            writingBytes.clear();
+
+            lock.lock();
+            if (!ok) writeFailed = true;
+            durableLsn = batchEndLsn;
+            groupCommits++;
+            durableAdvanced.notify_all();
+        }
+    }
+
+    bool writeFully(const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t written = ::write(fileDescriptor, data, length);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            length -= (size_t)written;
+        }
+        return true;
+    }
+
+public:
+    WriteAheadLog()
+        : fileDescriptor(-1), commitBatchSize(1024), commitLatencyBudget(2000), pendingRecords(0),
+          appendedLsn(0), durableLsn(0), flushRequested(false), stopping(false), writeFailed(false),
+          groupCommits(0), recordsLogged(0) {}
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() { close(); }
+
+    bool open(const string& path, size_t batchSize, chrono::microseconds latencyBudget) {
+        fileDescriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fileDescriptor < 0) return false;
+        commitBatchSize = max<size_t>(batchSize, 1);
+        commitLatencyBudget = latencyBudget;
+        appendedLsn = durableLsn = (uint64_t)lseek(fileDescriptor, 0, SEEK_END);
+        flusher = thread(&WriteAheadLog::flusherLoop, this);
+        return true;
+    }
+
+    void close() {
+        if (fileDescriptor < 0) return;
+        {
+            lock_guard<mutex> lock(bufferMutex);
+            stopping = true;
+        }
+        flushNeeded.notify_all();
+        flusher.join();
+        ::close(fileDescriptor);
+        fileDescriptor = -1;
+    }
+
+    // Returns the log position the record ends at; pass it to waitDurable()
+    uint64_t append(WalRecordType type, const void* payload, size_t length) {
+        WalRecordHeader header = {};
+        header.payloadLength = (uint32_t)length;
+        header.type = (uint8_t)type;
+        header.checksum = crc32(payload, length, crc32(&header.type, 1));
+
+        lock_guard<mutex> lock(bufferMutex);
+        if (pendingRecords == 0) {
+            oldestPending = chrono::steady_clock::now();
+        }
+        pendingBytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        pendingBytes.append(static_cast<const char*>(payload), length);
+        appendedLsn += sizeof(header) + length;
+        pendingRecords++;
+        recordsLogged++;
+        if (pendingRecords == 1 || pendingRecords >= commitBatchSize) {
+            flushNeeded.notify_one();
+        }
+        return appendedLsn;
+    }
+
+    bool waitDurable(uint64_t lsn) {
+        unique_lock<mutex> lock(bufferMutex);
+        durableAdvanced.wait(lock, [&]() { return durableLsn >= lsn || fileDescriptor < 0; });
+        return !writeFailed;
+    }
+
+    // Commits everything appended so far without waiting for the batch to fill
+    bool flush() {
+        uint64_t target;
+        {
+            lock_guard<mutex> lock(bufferMutex);
+            target = appendedLsn;
+            flushRequested = true;
+        }
+        flushNeeded.notify_one();
+        return waitDurable(target);
+    }
+
+    bool isOpen() const { return fileDescriptor >= 0; }
+    uint64_t getAppendedLsn() const {
+        lock_guard<mutex> lock(bufferMutex);
+        return appendedLsn;
+    }
+    uint64_t getGroupCommits() const {
+        lock_guard<mutex> lock(bufferMutex);
+        return groupCommits;
+    }
+    uint64_t getRecordsLogged() const {
+        lock_guard<mutex> lock(bufferMutex);
+        return recordsLogged;
+    }
+};
+
+// Runtime metrics. Every thread counts into its own cache-line aligned shard,
+// and only that thread ever writes to it, so a bump is a plain load and store
+// with no lock or atomic read-modify-write. A dump adds the shards up; the
+// totals it reads may be a few operations behind, which is fine for monitoring.
+enum MetricOperation {
+    METRIC_DEPOSIT,
+    METRIC_WITHDRAW,
+    METRIC_TRANSFER,
+    METRIC_OPERATION_COUNT
+};
+
+enum MetricRejection {
+    REJECT_INVALID_AMOUNT,
+    REJECT_INSUFFICIENT_FUNDS,
+    REJECT_SAME_ACCOUNT,
+    REJECT_VELOCITY_RULE,
+    REJECT_REASON_COUNT
+};
+
+// The streaming checks run on every withdrawal and transfer (see VelocityRules)
+enum VelocityRule {
+    RULE_WITHDRAWAL_COUNT,      // withdrawals from one account within the window
+    RULE_ACCOUNT_OUTFLOW,       // money leaving one account within the window
+    RULE_CUSTOMER_OUTFLOW,      // money leaving all of a customer's accounts within the window
+    RULE_NEW_ACCOUNT_CREDIT,    // one transfer of at least the limit into an account younger than the window
+    RULE_COUNT
+};
+
+const char* const METRIC_OPERATION_NAMES[METRIC_OPERATION_COUNT] = {"deposit", "withdraw", "transfer"};
+const char* const METRIC_REJECTION_NAMES[REJECT_REASON_COUNT] = {"invalid_amount", "insufficient_funds", "same_account",
+                                                                 "velocity_rule"};
+const char* const VELOCITY_RULE_NAMES[RULE_COUNT] = {"withdrawal_count", "account_outflow", "customer_outflow",
+                                                     "new_account_credit"};
+
+// Latency buckets are powers of two from 64 ns up to about 0.5 s, plus +Inf
+const int LATENCY_BUCKETS = 24;
+const int LATENCY_FIRST_BUCKET_BITS = 6;
+
+// Reading the clock costs about as much as a deposit, so each thread times only
+// one operation in this many; operation counts are still exact
+const uint64_t LATENCY_SAMPLE_EVERY = 8;
+
+struct alignas(64) MetricsShard {
+    atomic<uint64_t> operations[METRIC_OPERATION_COUNT];
+    atomic<uint64_t> rejections[REJECT_REASON_COUNT];
+    atomic<uint64_t> ruleHits[RULE_COUNT];
+    atomic<uint64_t> transactions;
+    atomic<uint64_t> latencyBuckets[METRIC_OPERATION_COUNT][LATENCY_BUCKETS + 1];
+    atomic<uint64_t> latencySumNs[METRIC_OPERATION_COUNT];
+    uint64_t sampleTick;            // private to the owning thread, never collected
+
+    MetricsShard() : sampleTick(0) { clear(); }
+
+    void clear() {
+        for (auto& counter : operations) counter.store(0, memory_order_relaxed);
+        for (auto& counter : rejections) counter.store(0, memory_order_relaxed);
+        for (auto& counter : ruleHits) counter.store(0, memory_order_relaxed);
+        transactions.store(0, memory_order_relaxed);
+        for (auto& buckets : latencyBuckets) {
+            for (auto& counter : buckets) counter.store(0, memory_order_relaxed);
+        }
+        for (auto& counter : latencySumNs) counter.store(0, memory_order_relaxed);
+    }
+};
+
+// Only the owning thread writes a shard, so the increment does not need to be atomic
+inline void bumpMetric(atomic<uint64_t>& counter, uint64_t amount = 1) {
+    counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+struct MetricsTotals {
+    uint64_t operations[METRIC_OPERATION_COUNT] = {};
+    uint64_t rejections[REJECT_REASON_COUNT] = {};
+    uint64_t ruleHits[RULE_COUNT] = {};
+    uint64_t transactions = 0;
+    uint64_t latencyBuckets[METRIC_OPERATION_COUNT][LATENCY_BUCKETS + 1] = {};
+    uint64_t latencySumNs[METRIC_OPERATION_COUNT] = {};
+};
+
+class MetricsRegistry {
+private:
+    mutable mutex shardsMutex;
+    vector<unique_ptr<MetricsShard>> shards;    // kept after their thread exits so no counts are lost
+
+    MetricsShard* addShard() {
+        lock_guard<mutex> lock(shardsMutex);
+        shards.emplace_back(new MetricsShard());
+        return shards.back().get();
+    }
+
+public:
+    MetricsShard& local() {
+        thread_local MetricsShard* shard = nullptr;
+        if (shard == nullptr) shard = addShard();
+        return *shard;
+    }
+
+    void recordRejection(MetricRejection reason) { bumpMetric(local().rejections[reason]); }
+    void recordRuleHit(VelocityRule rule) { bumpMetric(local().ruleHits[rule]); }
+    void recordTransactions(uint64_t count) { bumpMetric(local().transactions, count); }
+
+    void recordLatency(MetricsShard& shard, MetricOperation operation, uint64_t nanoseconds) {
+        int bucket = nanoseconds <= (1u << LATENCY_FIRST_BUCKET_BITS)
+                         ? 0
+                         : min(LATENCY_BUCKETS, 64 - __builtin_clzll(nanoseconds - 1) - LATENCY_FIRST_BUCKET_BITS);
+        bumpMetric(shard.latencyBuckets[operation][bucket]);
+        bumpMetric(shard.latencySumNs[operation], nanoseconds);
+    }
+
+    void collect(MetricsTotals& totals) const {
+        lock_guard<mutex> lock(shardsMutex);
+        for (const auto& shard : shards) {
+            for (int op = 0; op < METRIC_OPERATION_COUNT; op++) {
+                totals.operations[op] += shard->operations[op].load(memory_order_relaxed);
+                totals.latencySumNs[op] += shard->latencySumNs[op].load(memory_order_relaxed);
+                for (int b = 0; b <= LATENCY_BUCKETS; b++) {
+                    totals.latencyBuckets[op][b] += shard->latencyBuckets[op][b].load(memory_order_relaxed);
+                }
+            }
+            for (int r = 0; r < REJECT_REASON_COUNT; r++) {
+                totals.rejections[r] += shard->rejections[r].load(memory_order_relaxed);
+            }
+            for (int r = 0; r < RULE_COUNT; r++) {
+                totals.ruleHits[r] += shard->ruleHits[r].load(memory_order_relaxed);
+            }
+            totals.transactions += shard->transactions.load(memory_order_relaxed);
+        }
+    }
+};
+
+extern MetricsRegistry bankMetrics;
+
+// Counts one account operation and, for a sample of them, times it from
+// construction to destruction
+class OperationTimer {
+private:
+    MetricsShard& shard;
+    MetricOperation operation;
+    bool sampled;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit OperationTimer(MetricOperation operation)
+        : shard(bankMetrics.local()), operation(operation),
+          sampled(shard.sampleTick++ % LATENCY_SAMPLE_EVERY == 0) {
+        if (sampled) start = chrono::steady_clock::now();
+    }
+
+    ~OperationTimer() {
+        bumpMetric(shard.operations[operation]);
+        if (!sampled) return;
+        auto elapsed = chrono::steady_clock::now() - start;
+        bankMetrics.recordLatency(shard, operation,
+                                  (uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+// Log-linear latency histogram. Values are grouped by power of two and every
+// power of two is split into 16 linear sub-buckets, so a percentile is reported
+// within about 6% of the true value with a fixed 8 KB table.
+class LatencyHistogram {
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t sum;
+    uint64_t maxValue;
+
+    static size_t bucketIndex(uint64_t value) {
+        if (value < SUB_BUCKETS) return (size_t)value;
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return (size_t)(shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Largest value that lands in the bucket, so percentiles never under-report
+    static uint64_t bucketUpperBound(size_t index) {
+        if (index < SUB_BUCKETS) return index;
+        int shift = (int)(index / SUB_BUCKETS) - 1;
+        uint64_t lower = (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+        return lower + ((uint64_t)1 << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() : counts(64 * SUB_BUCKETS, 0), total(0), sum(0), maxValue(0) {}
+
+    void record(uint64_t nanoseconds) {
+        counts[bucketIndex(nanoseconds)]++;
+        total++;
+        sum += nanoseconds;
+        maxValue = max(maxValue, nanoseconds);
+    }
+
+    uint64_t getCount() const { return total; }
+    uint64_t getMax() const { return maxValue; }
+    double getMean() const { return total == 0 ? 0 : (double)sum / total; }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        maxValue = max(maxValue, other.maxValue);
+    }
+
+    // Raw counters, for handing a histogram from one process to another
+    void save(string& out) const {
+        uint64_t header[3] = {total, sum, maxValue};
+        out.append(reinterpret_cast<const char*>(header), sizeof(header));
+        out.append(reinterpret_cast<const char*>(counts.data()), counts.size() * sizeof(uint64_t));
+    }
+
+    bool load(const string& in) {
+        if (in.size() != (3 + counts.size()) * sizeof(uint64_t)) return false;
+        uint64_t header[3];
+        memcpy(header, in.data(), sizeof(header));
+        memcpy(counts.data(), in.data() + sizeof(header), counts.size() * sizeof(uint64_t));
+        total = header[0];
+        sum = header[1];
+        maxValue = header[2];
+        return true;
+    }
+
+    uint64_t percentile(double fraction) const {
+        if (total == 0) return 0;
+        uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(fraction * total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) return min(bucketUpperBound(i), maxValue);
+        }
+        return maxValue;
+    }
+};
+
+// Count and sum of the events in a sliding window, kept as a ring of BUCKETS
+// per-bucket totals plus running sums. Moving the window forward retires whole
+// buckets, so an event costs O(1) amortized and the memory is fixed however
+// long the account lives. The window ends in the bucket holding the newest
+// event and so spans between BUCKETS - 1 and BUCKETS bucket widths. Callers
+// pass the same width every time and serialize access.
+class SlidingWindow {
+public:
+    static const int BUCKETS = 16;
+
+private:
+    int64_t newestBucket;
+    uint32_t counts[BUCKETS];
+    Cents amounts[BUCKETS];
+    uint64_t totalCount;
+    Cents totalAmount;
+
+    void advance(int64_t bucket) {
+        if (bucket <= newestBucket) return;
+        if (bucket - newestBucket >= BUCKETS) {
+            memset(counts, 0, sizeof(counts));
+            memset(amounts, 0, sizeof(amounts));
+            totalCount = 0;
+            totalAmount = 0;
+        } else {
+            for (int64_t retired = newestBucket + 1; retired <= bucket; retired++) {
+                int slot = (int)(retired % BUCKETS);
+                totalCount -= counts[slot];
+                totalAmount -= amounts[slot];
+                counts[slot] = 0;
+                amounts[slot] = 0;
+            }
+        }
+        newestBucket = bucket;
+    }
+
+public:
+    SlidingWindow() : newestBucket(0), counts(), amounts(), totalCount(0), totalAmount(0) {}
+
+    // Totals over the window ending at timestampNs
+    uint64_t countAt(int64_t timestampNs, int64_t bucketWidthNs) {
+        advance(timestampNs / bucketWidthNs);
+        return totalCount;
+    }
+    Cents amountAt(int64_t timestampNs, int64_t bucketWidthNs) {
+        advance(timestampNs / bucketWidthNs);
+        return totalAmount;
+    }
+
+    // An event older than the window (from a replayed log, say) is ignored
+    void add(int64_t timestampNs, int64_t bucketWidthNs, Cents amount) {
+        int64_t bucket = timestampNs / bucketWidthNs;
+        if (bucket <= newestBucket - BUCKETS) return;
+        advance(bucket);
+        int slot = (int)(bucket % BUCKETS);
+        counts[slot]++;
+        amounts[slot] += amount;
+        totalCount++;
+        totalAmount += amount;
+    }
+};
+
+enum class RuleAction : uint8_t {
+    Off,
+    Flag,                       // count it and keep an alert, let the payment through
+    Block                       // refuse the payment with OperationStatus::Blocked
+};
+
+struct VelocityRuleSettings {
+    RuleAction action;
+    uint64_t limit;             // a count for RULE_WITHDRAWAL_COUNT, cents for the others
+    int64_t windowSeconds;      // for RULE_NEW_ACCOUNT_CREDIT: how long an account counts as new
+};
+
+struct VelocityAlert {
+    int64_t timestampNs;
+    uint32_t accountNumber;
+    uint32_t counterparty;
+    Cents amount;
+    VelocityRule rule;
+    RuleAction action;
+};
+
+// Streaming velocity and anomaly checks on the ledger write path. Accounts and
+// customers keep their own SlidingWindows, created the first time money leaves
+// them, and check them while the account is locked, so a check is a few
+// additions with no lookup and no shared state. Hits are counted per thread in
+// bankMetrics; the most recent ALERT_HISTORY alerts are kept here. Replayed
+// ledger entries are fed back into the windows, so a restart does not reset a
+// limit. Everything is off until configure is called.
+class VelocityRules {
+public:
+    static const size_t ALERT_HISTORY = 256;
+
+private:
+    VelocityRuleSettings settings[RULE_COUNT];
+    int64_t bucketWidthNs[RULE_COUNT];
+    bool enabled;
+    mutable mutex alertsMutex;
+    vector<VelocityAlert> alerts;   // ring of the last ALERT_HISTORY
+    uint64_t alertCount;
+
+public:
+    VelocityRules();
+
+    static void defaultSettings(VelocityRuleSettings (&rules)[RULE_COUNT]);
+
+    // Must run before any account operation; windows already filled are not rescaled
+    void configure(const VelocityRuleSettings (&rules)[RULE_COUNT]);
+    bool isEnabled() const { return enabled; }
+    const VelocityRuleSettings& getSettings(VelocityRule rule) const { return settings[rule]; }
+    int64_t getBucketWidth(VelocityRule rule) const { return bucketWidthNs[rule]; }
+    bool isActive(VelocityRule rule) const { return settings[rule].action != RuleAction::Off; }
+
+    void report(VelocityRule rule, uint32_t accountNumber, uint32_t counterparty, Cents amount, int64_t timestampNs);
+    // Most recent first
+    vector<VelocityAlert> getRecentAlerts() const;
+    uint64_t getAlertCount() const {
+        lock_guard<mutex> lock(alertsMutex);
+        return alertCount;
+    }
+};
+
+extern VelocityRules velocityRules;
+
+// Here we let reports read every balance at one point in time without locking
+// accounts. Each change to a balance is stamped with the current read epoch;
+// opening a view closes that epoch (moves writers on to the next one and waits
+// for the ones still inside it to finish) and the view then reads, for every
+// account, the newest version stamped at or before it. A transfer runs inside
+// one epoch, so a view sees both of its sides or neither. Writers only count
+// themselves in and out on a per-thread stripe; they never wait for a reader.
+class ReadEpochs {
+public:
+    static const unsigned WRITER_STRIPES = 16;
+
+private:
+    struct alignas(64) WriterStripe {
+        atomic<uint32_t> active[2];     // writers inside an epoch, by its parity
+    };
+
+    atomic<uint64_t> current;
+    atomic<uint64_t> reclaimBound;      // see getReclaimBound; never moves back
+    WriterStripe stripes[WRITER_STRIPES];
+    mutex readersMutex;                 // one view opens at a time; guards openReads
+    multiset<uint64_t> openReads;
+
+public:
+    ReadEpochs() : current(1), reclaimBound(1) {
+        for (WriterStripe& stripe : stripes) {
+            stripe.active[0] = 0;
+            stripe.active[1] = 0;
+        }
+    }
+    ReadEpochs(const ReadEpochs&) = delete;
+    ReadEpochs& operator=(const ReadEpochs&) = delete;
+
+    uint64_t getCurrent() const { return current.load(); }
+    // Returns the epoch the caller's changes belong to until leaveWrite
+    uint64_t enterWrite(unsigned& stripe);
+    void leaveWrite(uint64_t epoch, unsigned stripe) { stripes[stripe].active[epoch & 1].fetch_sub(1); }
+    // Closes the current epoch and returns it once every write stamped with it has finished
+    uint64_t openRead();
+    void closeRead(uint64_t epoch);
+    // No open or future view reads before this epoch, so of the versions stamped
+    // at or before it only the newest can still be read
+    uint64_t getReclaimBound() const { return reclaimBound.load(); }
+};
+
+extern ReadEpochs readEpochs;
+
+// Holds an epoch for the length of one change, which may span several accounts
+class WriteEpoch {
+private:
+    uint64_t epoch;
+    unsigned stripe;
+
+public:
+    WriteEpoch() : epoch(readEpochs.enterWrite(stripe)) {}
+    ~WriteEpoch() { readEpochs.leaveWrite(epoch, stripe); }
+    WriteEpoch(const WriteEpoch&) = delete;
+    WriteEpoch& operator=(const WriteEpoch&) = delete;
+
+    uint64_t value() const { return epoch; }
+};
+
+// An account's balance and transaction count as of the end of an epoch that a
+// view has since closed. The newest version lives in the account itself; it
+// is copied here when the first change of a later epoch replaces it. A copy
+// never changes while a view can reach it; once none can it may be reused.
+struct AccountVersion {
+    uint64_t epoch;
+    Cents balance;
+    uint64_t transactionCount;
+    atomic<AccountVersion*> older;
+
+    AccountVersion(uint64_t epoch, Cents balance, uint64_t transactionCount, AccountVersion* older)
+        : epoch(epoch), balance(balance), transactionCount(transactionCount), older(older) {}
+};
+
+// What became of an account operation. The core never prints; callers turn the
+// status into a message with describeStatus if they need one.
+enum class OperationStatus : uint8_t {
+    Ok,
+    InvalidAmount,
+    InsufficientFunds,
+    SameAccount,
+    Blocked                     // refused by a velocity rule
+};
+
+const char* describeStatus(OperationStatus status);
+
+struct OperationResult {
+    OperationStatus status;
+    Cents balance;              // the account's balance afterwards (the source account for a transfer)
+
+    bool ok() const { return status == OperationStatus::Ok; }
+};
+
+// Transactions stamped in [fromNs, toNs) and the balances either side of them
+struct AccountStatement {
+    int64_t fromNs;
+    int64_t toNs;
+    Cents openingBalance;
+    Cents closingBalance;
+    vector<Transaction> entries;
+};
+
+struct TransferBatchResult {
+    OperationStatus status = OperationStatus::Ok;
+    uint32_t failedAccount = 0;     // the account status is about (or that does not exist)
+    bool unknownAccount = false;
+    size_t accounts = 0;            // distinct accounts touched
+};
+
+class Account {
+private:
+    string accountNumber;
+    uint32_t accountNumberValue;
+    string accountType;
+    Cents balance;
+    Cents held;                 // set aside for prepared cross-shard debits; not spendable
+    CustomerHandle owner;
+    CustomerOutflow* ownerOutflow;  // the owner's, shared with its other accounts
+    TransactionLog transactions;
+    uint64_t transactionBase;   // transactions that happened before the retained history (restored from a snapshot)
+    mutable mutex accountMutex;
+    WriteAheadLog* ledgerLog;
+    int64_t openedNs;           // for RULE_NEW_ACCOUNT_CREDIT; 0 when not known (restored from a snapshot)
+    unique_ptr<SlidingWindow[]> velocityWindows;    // [0] withdrawals, [1] outflow; created on first use
+    // The newest version, updated in place (see ReadEpochs); older ones newest first
+    atomic<uint64_t> versionEpoch;
+    atomic<Cents> versionBalance;
+    atomic<uint64_t> versionTransactionCount;
+    atomic<AccountVersion*> olderVersions;
+
+    // Callers must already hold accountMutex
+    OperationStatus applyCredit(Cents amount, uint32_t descriptionId, uint32_t counterparty, int64_t timestampNs);
+    OperationStatus applyDebit(Cents amount, uint32_t descriptionId, uint32_t counterparty, int64_t timestampNs);
+    OperationResult applyHold(Cents amount);
+    bool canDebit(Cents amount) const { return amount > 0 && balance - held >= amount; }
+    // Runs the outflow rules on a payment the account can cover and, unless a
+    // blocking rule refuses it, counts it in the windows. Withdrawals and
+    // transfers out are screened; fees and other debits are not. Prepared
+    // cross-shard debits still pending (held here, and the owner's pending
+    // total) count as outflow already. A prepare passes count = false, since
+    // it may still be aborted: it is added to the owner's pending total instead
+    // of the windows, and settlePrepared counts it when it commits.
+    bool screenDebit(uint32_t descriptionId, Cents amount, uint32_t counterparty, int64_t timestampNs,
+                     bool count = true);
+    // Takes a settled or cancelled prepare off the owner's pending total, or
+    // puts a restored one back on it
+    void adjustPendingOutflow(Cents change);
+    // RULE_NEW_ACCOUNT_CREDIT for a transfer into this account
+    bool screenTransferCredit(Cents amount, uint32_t counterparty, int64_t timestampNs);
+    // Counts a debit in the windows without checking it
+    void recordDebit(uint32_t descriptionId, Cents amount, int64_t timestampNs);
+    // Records the balance and count for readers at epoch; callers hold accountMutex and a WriteEpoch
+    void publishVersion(uint64_t epoch);
+    // Detaches the versions no view at or after bound can reach; callers hold accountMutex
+    AccountVersion* cutVersions(uint64_t bound);
+    static size_t freeVersions(AccountVersion* version);
+    WalEntryPayload lastEntryPayload() const;
+    void logLastEntry(WalRecordType type);
+
+public:
+    Account(const string& accNum, const string& accType, CustomerHandle owner, CustomerOutflow* ownerOutflow)
+        : accountNumber(accNum), accountNumberValue(0), accountType(accType), balance(0), held(0), owner(owner),
+          ownerOutflow(ownerOutflow), transactionBase(0), ledgerLog(nullptr), openedNs(currentEpochNanoseconds()),
+          versionEpoch(readEpochs.getCurrent()), versionBalance(0), versionTransactionCount(0),
+          olderVersions(nullptr) {
+        for (char character : accNum) {
+            if (isdigit((unsigned char)character)) {
+                accountNumberValue = accountNumberValue * 10 + (character - '0');
+            }
+        }
+        transactions.setOwner(accountNumberValue);
+    }
+
+    ~Account();
+
+    string getAccountNumber() const { return accountNumber; }
+    string getAccountType() const { return accountType; }
+    uint32_t getAccountNumberValue() const { return accountNumberValue; }
+    Cents getBalance() const {
+        lock_guard<mutex> lock(accountMutex);
+        return balance;
+    }
+    // Bank::getCustomer turns this into the customer
+    CustomerHandle getOwner() const { return owner; }
+    const TransactionLog& getTransactions() const { return transactions; }
+    uint64_t getTransactionCount() const {
+        lock_guard<mutex> lock(accountMutex);
+        return transactionBase + transactions.size();
+    }
+    // Records held in memory; older ones may have been spilled to the cold history store
+    size_t getStoredTransactionCount() const {
+        lock_guard<mutex> lock(accountMutex);
+        return transactions.residentCount();
+    }
+    // Reads balance and transaction count together, as one consistent pair
+    void readState(Cents& currentBalance, uint64_t& transactionCount) const {
+        lock_guard<mutex> lock(accountMutex);
+        currentBalance = balance;
+        transactionCount = transactionBase + transactions.size();
+    }
+
+    // Successful deposits, withdrawals and transfers are appended here while the account is locked
+    void setLedgerLog(WriteAheadLog* log) { ledgerLog = log; }
+
+    OperationResult deposit(Cents amount, uint32_t descriptionId = DESCRIPTION_DEPOSIT, uint32_t counterparty = 0);
+    OperationResult withdraw(Cents amount, uint32_t descriptionId = DESCRIPTION_WITHDRAWAL, uint32_t counterparty = 0);
+    OperationResult transfer(Account& targetAccount, Cents amount);
+    void addTransaction(const Transaction& transaction);
+    // Re-applies a logged entry during recovery; entries the account already holds are skipped
+    void restoreTransaction(TransactionType type, uint64_t transactionId, Cents amount,
+                            uint32_t descriptionId, uint32_t counterparty, int64_t timestampNs);
+    // Starts a freshly opened account from snapshot state; history before the snapshot is not kept
+    void restoreSnapshotState(Cents snapshotBalance, uint64_t transactionCount);
+    // The log does not record when an account was opened, so a recovered account
+    // takes the time of its first replayed transaction instead
+    void clearOpenedTime() { openedNs = 0; }
+    // Balance after every transaction stamped at or before timestampNs. History
+    // from before a snapshot restore is not kept, so earlier times report the
+    // balance the account was restored with.
+    Cents getBalanceAt(int64_t timestampNs) const;
+    AccountStatement getStatement(int64_t fromNs, int64_t toNs) const;
+    // Copies up to limit records, starting skip records back from the newest, oldest first
+    void getHistory(uint64_t skip, size_t limit, vector<Transaction>& out) const;
+
+    // Balance and transaction count as of view, read without the account lock;
+    // false when the account was opened after the view
+    bool readAt(const ReadView& view, Cents& viewBalance, uint64_t& transactionCount) const;
+    // getHistory as of view. Records never change once written, so they are
+    // copied a chunk at a time and a long history holds the lock only briefly.
+    void getHistoryAt(const ReadView& view, uint64_t skip, size_t limit, vector<Transaction>& out) const;
+    // getStatement without the entries booked after view
+    AccountStatement getStatementAt(const ReadView& view, int64_t fromNs, int64_t toNs) const;
+    // Frees the versions older than the newest one stamped at or before bound; returns how many
+    size_t reclaimVersions(uint64_t bound);
+    // Checks the history's hash chain and that it adds up to the balance; see TransactionLog::audit
+    AccountAuditResult audit(AccountAuditMark& mark) const {
+        lock_guard<mutex> lock(accountMutex);
+        return transactions.audit(mark, transactionBase, balance);
+    }
+
+    // Holds back part of the balance for a prepared cross-shard debit; the held
+    // amount stays in the balance but withdrawals and transfers cannot use it
+    OperationResult holdFunds(Cents amount);
+    // holdFunds for a new prepared debit, screened by the velocity rules first
+    OperationResult holdForTransfer(Cents amount, uint32_t counterparty);
+    // The velocity check for the receiving side of a prepared transfer
+    OperationResult admitTransferCredit(Cents amount, uint32_t counterparty);
+    void releaseHold(Cents amount);
+    Cents getHeld() const {
+        lock_guard<mutex> lock(accountMutex);
+        return held;
+    }
+    // Books a prepared side of a cross-shard transfer (using up its hold for a
+    // debit) and logs it as one TransferSettled record
+    OperationResult settlePrepared(TransactionType side, Cents amount, uint32_t counterparty, uint64_t transferId);
+
+    // Applies a planned batch to accounts (one per plan entry, same order): locks
+    // them all in ascending number, checks every net debit against the spendable
+    // balance, then books each leg's entry and moves each balance once, all or
+    // nothing, and logs one TransferBatch record. Velocity rules count the debits
+    // but do not screen them: clearing batches are the bank's own.
+    static TransferBatchResult applyTransferBatch(Account* const* accounts, const TransferBatchPlan& plan,
+                                                  const TransferLeg* legs, size_t legCount, WriteAheadLog* log);
+    // Recovery: re-applies plan entry accountIndex of a logged batch, numbering from firstTransactionId
+    void restoreBatchEntries(const TransferBatchPlan& plan, size_t accountIndex, const TransferLeg* legs,
+                             uint64_t firstTransactionId, int64_t timestampNs);
+};
+
+// A point-in-time view of the bank: the customers and accounts that existed when
+// it was opened, read with Account::readAt and friends. Versions the view may
+// read are kept until it is destroyed, so views are meant to be short-lived.
+class ReadView {
+private:
+    uint64_t epoch;             // 0 once moved from
+    vector<Customer*> customers;
+    vector<Account*> accounts;
+
+public:
+    // A view without the lists, for reading accounts the caller already holds
+    ReadView() : epoch(readEpochs.openRead()) {}
+    ReadView(uint64_t epoch, vector<Customer*> customerList, vector<Account*> accountList)
+        : epoch(epoch), customers(std::move(customerList)), accounts(std::move(accountList)) {}
+    ReadView(ReadView&& other) noexcept
+        : epoch(other.epoch), customers(std::move(other.customers)), accounts(std::move(other.accounts)) {
+        other.epoch = 0;
+    }
+    ReadView(const ReadView&) = delete;
+    ReadView& operator=(const ReadView&) = delete;
+    ~ReadView() {
+        if (epoch != 0) readEpochs.closeRead(epoch);
+    }
+
+    uint64_t getEpoch() const { return epoch; }
+    const vector<Customer*>& getCustomers() const { return customers; }
+    const vector<Account*>& getAccounts() const { return accounts; }
+};
+
+// One side of a cross-shard transfer that has been prepared but not yet
+// committed or aborted by the coordinator
+struct PendingTransfer {
+    uint64_t transferId;
+    uint32_t account;
+    uint32_t counterparty;
+    Cents amount;
+    TransactionType side;       // Debit on the paying shard, Credit on the receiving one
+    uint64_t prepareLsn;        // log position at or before its TransferPrepared record
+};
+
+// Number of times this thread found an account lock already taken while transferring
+extern thread_local uint64_t transferLockConflicts;
+
+// Splits "ACCT100042" (any case) into its prefix and number; false when id is not prefix + digits
+bool parseIdNumber(const string& id, const char* prefix, uint32_t& number);
+
+const int FIRST_CUSTOMER_NUMBER = 1000;
+const int FIRST_ACCOUNT_NUMBER = 100000;
+
+enum class CustomerSearchField : uint8_t {
+    Name,
+    Phone
+};
+
+// Position in a result list to continue from: the last customer already returned
+struct CustomerSearchCursor {
+    string key;
+    uint32_t customerNumber = 0;
+    bool valid = false;
+};
+
+struct CustomerSearchPage {
+    vector<Customer*> customers;
+    bool hasMore = false;
+    CustomerSearchCursor next;      // pass back to get the following page
+};
+
+// Sorted prefix index from a normalized key to customer numbers. Entries are
+// fixed-width (the first KEY_BYTES of the key plus the number), so they sort
+// and merge as plain bytes. An insert only appends to a pending list; the next
+// query folds that list into a small ordered set, or, once the set would hold
+// more than a sixteenth of the main sorted vector, sorts everything into the
+// vector. Loading a million customers therefore costs one sort, and a query is
+// two binary searches plus its matches. Keys longer than KEY_BYTES are cut
+// short in the index, and queries that reach past the cut are confirmed by the
+// caller. The owner serializes inserts and queries (Bank holds directoryMutex).
+class CustomerPrefixIndex {
+public:
+    static constexpr size_t KEY_BYTES = 20;
+
+private:
+    struct Entry {
+        char key[KEY_BYTES];        // zero padded
+        uint32_t customerNumber;
+
+        bool operator<(const Entry& other) const {
+            int order = memcmp(key, other.key, KEY_BYTES);
+            return order < 0 || (order == 0 && customerNumber < other.customerNumber);
+        }
+    };
+
+    // Reorganized by queries, which the owner already serializes with inserts
+    mutable vector<Entry> sorted;
+    mutable set<Entry> recent;
+    mutable vector<Entry> pending;
+
+    static Entry makeEntry(const string& key, uint32_t customerNumber);
+    void absorbPending() const;
+
+public:
+    // Names match case-insensitively; phone numbers match on their digits only
+    static string normalize(CustomerSearchField field, const string& text);
+
+    void insert(const string& key, uint32_t customerNumber);
+
+    // Appends up to limit customer numbers, in key order, whose key starts with
+    // prefix (or equals it when exact), resuming after the cursor when it is
+    // valid. confirm(number) is asked about candidates only when the prefix is
+    // longer than the index keeps. Returns true when more matches remain; next
+    // then points at the last one appended.
+    bool find(const string& prefix, bool exact, const CustomerSearchCursor& after, size_t limit,
+              const function<bool(uint32_t)>& confirm, vector<uint32_t>& out, CustomerSearchCursor& next) const;
+};
+
+// A snapshot file that stays mapped after loading; defined with the snapshot
+// format in bank_core.cpp
+class LoadedSnapshot;
+
+// Here we keep every customer and account in slabs, with hash indexes from
+// the number inside the customer ID and account number to its handle, so
+// lookups stay O(1) however many exist. The lists keep creation order for
+// scans, and since slabs fill page by page that is also memory order.
+// Customers and accounts are created from one thread; deposits, withdrawals and
+// transfers on existing accounts may then run from many threads at once.
+//
+// After loadSnapshot, a customer still only in the snapshot file is built, with
+// all of its accounts, the first time it or one of them is looked up. Until
+// everything has been built, lookups take directoryMutex, and anything that
+// needs the complete lists (a scan, a read view, a search) builds the rest
+// first, in snapshot order.
+class Bank {
+private:
+    // Accounts point into their owners' CustomerOutflow, so customers are declared (and outlive) first
+    Slab<Customer> customerSlab;
+    Slab<Account> accountSlab;
+    vector<Customer*> customers;
+    vector<Account*> accounts;
+    unordered_map<uint32_t, CustomerHandle> customerIndex;
+    unordered_map<uint32_t, AccountHandle> accountIndex;
+    CustomerPrefixIndex nameIndex;
+    CustomerPrefixIndex phoneIndex;
+    WriteAheadLog* ledgerLog;
+    mutable mutex directoryMutex;   // guards the two lists against a concurrent snapshot capture
+    mutable mutex transferMutex;    // guards pendingTransfers; taken after directoryMutex
+    mutex reclaimMutex;             // one version sweep at a time
+    unordered_map<uint64_t, PendingTransfer> pendingTransfers;
+    // Numbers for the next customer ID and account number; guarded by directoryMutex
+    uint32_t nextCustomerNumber;
+    uint32_t nextAccountNumber;
+    // Records of the loaded snapshot not built yet, and what was created since
+    // it was loaded (listed after its records once they are all built); all
+    // guarded by directoryMutex. snapshotPending is true until then.
+    shared_ptr<const LoadedSnapshot> loadedSnapshot;
+    atomic<bool> snapshotPending;
+    size_t unbuiltCustomers;
+    size_t unbuiltAccounts;
+    vector<Customer*> customersSinceLoad;
+    vector<Account*> accountsSinceLoad;
+
+    // These add an object under its number, without logging it; nullptr if the
+    // number is already in the index. directoryMutex is held.
+    Customer* insertCustomer(uint32_t customerNumber, string name, string address, string phone) {
+        auto inserted = customerIndex.emplace(customerNumber, CustomerHandle());
+        if (!inserted.second) return nullptr;
+        nextCustomerNumber = max(nextCustomerNumber, customerNumber + 1);
+        nameIndex.insert(CustomerPrefixIndex::normalize(CustomerSearchField::Name, name), customerNumber);
+        phoneIndex.insert(CustomerPrefixIndex::normalize(CustomerSearchField::Phone, phone), customerNumber);
+        CustomerHandle handle = customerSlab.emplace("CUST" + to_string(customerNumber), std::move(name),
+                                                     std::move(address), std::move(phone));
+        inserted.first->second = handle;
+        return customerSlab.get(handle);
+    }
+
+    Account* insertAccount(uint32_t accountNumber, CustomerHandle ownerHandle, const string& accountType,
+                           Cents balance, uint64_t transactionCount) {
+        auto inserted = accountIndex.emplace(accountNumber, AccountHandle());
+        if (!inserted.second) return nullptr;
+        nextAccountNumber = max(nextAccountNumber, accountNumber + 1);
+        Customer* owner = customerSlab.get(ownerHandle);
+        AccountHandle handle = accountSlab.emplace("ACCT" + to_string(accountNumber), accountType, ownerHandle,
+                                                   owner->getOutflow());
+        inserted.first->second = handle;
+        Account* account = accountSlab.get(handle);
+        owner->addAccount(handle);
+        if (ledgerLog != nullptr) account->setLedgerLog(ledgerLog);
+        account->restoreSnapshotState(balance, transactionCount);
+        return account;
+    }
+
+    // With directoryMutex held: the customer or account with this number,
+    // built from the loaded snapshot if it is only there; nullptr if neither
+    // has it
+    Customer* lookupCustomer(uint32_t number);
+    Account* lookupAccount(uint32_t number);
+    // Builds the customer in this row of the loaded snapshot and its accounts,
+    // which are appended to builtAccounts
+    Customer* buildLoadedCustomer(size_t row, vector<Account*>& builtAccounts);
+    // Builds every record still only in the loaded snapshot and lists them all
+    // in snapshot order; with directoryMutex held
+    void buildLoadedSnapshot();
+
+    // Lookups and scans are const but may build records from the loaded
+    // snapshot. That only makes objects for records the bank already holds, so
+    // these three do it through a const_cast.
+    Customer* findLoadedCustomer(uint32_t number) const;
+    Account* findLoadedAccount(uint32_t number) const;
+    void completeDirectory() const;
+
+    // Copies the lists and works out their log position; directoryMutex is held
+    uint64_t copyDirectory(vector<Customer*>& customerList, vector<Account*>& accountList) const {
+        lock_guard<mutex> transferLock(transferMutex);
+        uint64_t logPosition = ledgerLog != nullptr ? ledgerLog->getAppendedLsn() : 0;
+        for (const auto& entry : pendingTransfers) {
+            logPosition = min(logPosition, entry.second.prepareLsn);
+        }
+        customerList = customers;
+        accountList = accounts;
+        return logPosition;
+    }
+
+public:
+    Bank()
+        : ledgerLog(nullptr), nextCustomerNumber(FIRST_CUSTOMER_NUMBER), nextAccountNumber(FIRST_ACCOUNT_NUMBER),
+          snapshotPending(false), unbuiltCustomers(0), unbuiltAccounts(0) {}
+    Bank(const Bank&) = delete;
+    Bank& operator=(const Bank&) = delete;
+
+    Customer* createCustomer(const string& name, const string& address, const string& phone) {
+        lock_guard<mutex> lock(directoryMutex);
+        uint32_t customerNumber = nextCustomerNumber++;
+        CustomerHandle handle = customerSlab.emplace("CUST" + to_string(customerNumber), name, address, phone);
+        Customer* newCustomer = customerSlab.get(handle);
+        customers.push_back(newCustomer);
+        if (snapshotPending) customersSinceLoad.push_back(newCustomer);
+        customerIndex[customerNumber] = handle;
+        nameIndex.insert(CustomerPrefixIndex::normalize(CustomerSearchField::Name, name), customerNumber);
+        phoneIndex.insert(CustomerPrefixIndex::normalize(CustomerSearchField::Phone, phone), customerNumber);
+        
+        if (ledgerLog != nullptr) {
+            string payload(reinterpret_cast<const char*>(&customerNumber), sizeof(customerNumber));
+            for (const string* field : {&name, &address, &phone}) {
+                uint16_t length = (uint16_t)min<size_t>(field->size(), 0xFFFF);
+                payload.append(reinterpret_cast<const char*>(&length), sizeof(length));
+                payload.append(*field, 0, length);
+            }
+            ledgerLog->append(WalRecordType::CreateCustomer, payload.data(), payload.size());
+        }
+        return newCustomer;
+    }
+
+    // Takes the next free account number, or accountNumber itself when it is given
+    // (a shard owns a scattered set of numbers); numbering then continues after it.
+    // nullptr if a given number is already taken.
+    Account* openAccount(Customer* owner, const string& accountType, uint32_t accountNumber = 0) {
+        uint32_t ownerNumber = 0;
+        for (char character : owner->getCustomerId()) {
+            if (isdigit((unsigned char)character)) ownerNumber = ownerNumber * 10 + (character - '0');
+        }
+        lock_guard<mutex> lock(directoryMutex);
+        if (accountNumber == 0) accountNumber = nextAccountNumber;
+        // Rows of a loaded snapshot that are not built yet hold their numbers too
+        if (snapshotPending && lookupAccount(accountNumber) != nullptr) return nullptr;
+        auto inserted = accountIndex.emplace(accountNumber, AccountHandle());
+        if (!inserted.second) return nullptr;
+        nextAccountNumber = max(nextAccountNumber, accountNumber + 1);
+        AccountHandle handle = accountSlab.emplace("ACCT" + to_string(accountNumber), accountType, customerIndex.at(ownerNumber),
+                                                   owner->getOutflow());
+        inserted.first->second = handle;
+        Account* newAccount = accountSlab.get(handle);
+        owner->addAccount(handle);
+        accounts.push_back(newAccount);
+        if (snapshotPending) accountsSinceLoad.push_back(newAccount);
+        
+        if (ledgerLog != nullptr) {
+            newAccount->setLedgerLog(ledgerLog);
+            uint32_t numbers[2] = {newAccount->getAccountNumberValue(), ownerNumber};
+            uint16_t length = (uint16_t)min<size_t>(accountType.size(), 0xFFFF);
+            string payload(reinterpret_cast<const char*>(numbers), sizeof(numbers));
+            payload.append(reinterpret_cast<const char*>(&length), sizeof(length));
+            payload.append(accountType, 0, length);
+            ledgerLog->append(WalRecordType::OpenAccount, payload.data(), payload.size());
+        }
+        return newAccount;
+    }
+
+    // For loading a snapshot or replaying the log: adds a customer under the
+    // number it was saved with, without logging it. nullptr if that number is
+    // already taken.
+    Customer* restoreCustomer(uint32_t customerNumber, string name, string address, string phone) {
+        lock_guard<mutex> lock(directoryMutex);
+        if (lookupCustomer(customerNumber) != nullptr) return nullptr;
+        Customer* customer = insertCustomer(customerNumber, std::move(name), std::move(address), std::move(phone));
+        customers.push_back(customer);
+        if (snapshotPending) customersSinceLoad.push_back(customer);
+        return customer;
+    }
+
+    // Likewise for an account, with its saved balance and transaction count.
+    // nullptr if the number is taken or the owner is unknown.
+    Account* restoreAccount(uint32_t accountNumber, uint32_t ownerNumber, const string& accountType,
+                            Cents balance, uint64_t transactionCount) {
+        lock_guard<mutex> lock(directoryMutex);
+        if (lookupCustomer(ownerNumber) == nullptr || lookupAccount(accountNumber) != nullptr) return nullptr;
+        Account* account = insertAccount(accountNumber, customerIndex.at(ownerNumber), accountType, balance,
+                                         transactionCount);
+        accounts.push_back(account);
+        if (snapshotPending) accountsSinceLoad.push_back(account);
+        return account;
+    }
+
+    // For loadSnapshot, on an empty bank: its records are built as they are first used
+    void attachLoadedSnapshot(shared_ptr<const LoadedSnapshot> snapshot);
+
+    // From here on every change to the book is appended to the log
+    void attachLedgerLog(WriteAheadLog* log) {
+        ledgerLog = log;
+        for (Account* account : accounts) {
+            account->setLedgerLog(log);
+        }
+    }
+
+    const WriteAheadLog* getLedgerLog() const { return ledgerLog; }
+    WriteAheadLog* getLedgerLog() { return ledgerLog; }
+
+    void reserve(size_t customerCount, size_t accountCount) {
+        customerSlab.reserve(customerCount);
+        accountSlab.reserve(accountCount);
+        customers.reserve(customerCount);
+        accounts.reserve(accountCount);
+        customerIndex.reserve(customerCount);
+        accountIndex.reserve(accountCount);
+    }
+
+    // Copies the customer and account lists together with the log position they
+    // correspond to. Everything logged before that position is already reflected
+    // in the listed objects. Pending transfers live only in the log, so the
+    // position is pulled back to the oldest one still prepared; replaying from
+    // there prepares it again and skips the entries the objects already hold.
+    uint64_t captureDirectory(vector<Customer*>& customerList, vector<Account*>& accountList) const {
+        completeDirectory();
+        lock_guard<mutex> lock(directoryMutex);
+        return copyDirectory(customerList, accountList);
+    }
+
+    // Like captureDirectory, but lists only the objects built so far instead of
+    // building the whole loaded snapshot. Returns that snapshot (nullptr once
+    // everything is built), which holds the rest and stays mapped while the
+    // caller keeps it; none of its records have changed since it was loaded.
+    shared_ptr<const LoadedSnapshot> captureBuiltDirectory(vector<Customer*>& customerList,
+                                                           vector<Account*>& accountList,
+                                                           uint64_t& logPosition) const {
+        lock_guard<mutex> lock(directoryMutex);
+        logPosition = copyDirectory(customerList, accountList);
+        return loadedSnapshot;
+    }
+
+    // The epoch is closed before the lists are copied, so every account that
+    // was open at the view's point in time is listed
+    ReadView openReadView() const {
+        uint64_t epoch = readEpochs.openRead();
+        vector<Customer*> customerList;
+        vector<Account*> accountList;
+        captureDirectory(customerList, accountList);
+        return ReadView(epoch, std::move(customerList), std::move(accountList));
+    }
+
+    // Frees account versions no view can read any more; returns how many
+    size_t reclaimVersions();
+
+    // Forces a group commit of everything logged so far; true when nothing is logged
+    bool commitLedger() {
+        return ledgerLog == nullptr || ledgerLog->flush();
+    }
+
+    Customer* findCustomer(const string& customerId) const {
+        uint32_t number;
+        return parseIdNumber(customerId, "CUST", number) ? findCustomerByNumber(number) : nullptr;
+    }
+
+    Account* findAccount(const string& accountNumber) const {
+        uint32_t number;
+        return parseIdNumber(accountNumber, "ACCT", number) ? findAccountByNumber(number) : nullptr;
+    }
+
+    Account* findAccountByNumber(uint32_t number) const {
+        if (snapshotPending.load(memory_order_acquire)) return findLoadedAccount(number);
+        auto it = accountIndex.find(number);
+        return it == accountIndex.end() ? nullptr : accountSlab.get(it->second);
+    }
+
+    Customer* findCustomerByNumber(uint32_t number) const {
+        if (snapshotPending.load(memory_order_acquire)) return findLoadedCustomer(number);
+        auto it = customerIndex.find(number);
+        return it == customerIndex.end() ? nullptr : customerSlab.get(it->second);
+    }
+
+    // nullptr for a handle whose object is gone
+    Customer* getCustomer(CustomerHandle handle) const { return customerSlab.get(handle); }
+    Account* getAccount(AccountHandle handle) const { return accountSlab.get(handle); }
+
+    // Customers whose name or phone number starts with query (or matches it exactly),
+    // limit at a time; pass page.next back as after to continue
+    CustomerSearchPage searchCustomers(CustomerSearchField field, const string& query, bool exact, size_t limit,
+                                       const CustomerSearchCursor& after = CustomerSearchCursor()) const {
+        CustomerSearchPage page;
+        vector<uint32_t> numbers;
+        completeDirectory();
+        lock_guard<mutex> lock(directoryMutex);
+        const CustomerPrefixIndex& index = field == CustomerSearchField::Name ? nameIndex : phoneIndex;
+        string key = CustomerPrefixIndex::normalize(field, query);
+        auto confirm = [&](uint32_t number) {
+            const Customer* customer = findCustomerByNumber(number);
+            string full = CustomerPrefixIndex::normalize(
+                field, field == CustomerSearchField::Name ? customer->getName() : customer->getPhoneNumber());
+            return exact ? full == key : full.compare(0, key.size(), key) == 0;
+        };
+        page.hasMore = index.find(key, exact, after, limit, confirm, numbers, page.next);
+        for (uint32_t number : numbers) {
+            page.customers.push_back(findCustomerByNumber(number));
+        }
+        return page;
+    }
+
+    // Two-phase cross-shard transfers, driven by a coordinator (the shard router).
+    // Preparing a Debit side holds the funds on the account; preparing a Credit
+    // side only checks the amount. Both are logged before the caller acknowledges
+    // them, and stay pending, across restarts, until resolveTransfer commits
+    // (books the entry) or aborts (drops it). Repeating either call with the same
+    // id has no further effect.
+    OperationResult prepareTransfer(uint64_t transferId, TransactionType side, Account& account,
+                                    uint32_t counterparty, Cents amount);
+    // Returns false when the id is not pending (never prepared or already resolved)
+    bool resolveTransfer(uint64_t transferId, bool commit);
+
+    // Applies many transfers as one: each account's legs are netted, every net
+    // debit must be covered, and then all of them are booked or none are. Each
+    // leg still gets its own history entry on both sides, but an account is
+    // locked once and the batch is one ledger record of 16 bytes per leg,
+    // instead of a lock pair and a 48-byte record per transfer.
+    TransferBatchResult applyTransferBatch(const TransferLeg* legs, size_t legCount);
+    vector<PendingTransfer> getPendingTransfers() const;
+    // Recovery: re-applies a TransferPrepared record, or drops the pending side a
+    // TransferSettled or TransferCancelled record resolved
+    void restorePreparedTransfer(const PendingTransfer& transfer);
+    void restoreResolvedTransfer(uint64_t transferId);
+
+    size_t getCustomerCount() const { return customers.size() + unbuiltCustomers; }
+    size_t getAccountCount() const { return accounts.size() + unbuiltAccounts; }
+    const vector<Customer*>& getCustomers() const {
+        completeDirectory();
+        return customers;
+    }
+    const vector<Account*>& getAccounts() const {
+        completeDirectory();
+        return accounts;
+    }
+};
+
+bool readWholeFile(const string& path, string& contents);
+
+struct LedgerRecoverySummary {
+    size_t customers = 0;
+    size_t accounts = 0;
+    size_t entries = 0;
+    uint64_t validBytes = 0;
+    bool truncatedTail = false;
+    bool rejectedRecord = false;    // an intact record could not be applied; it starts at validBytes
+    uint8_t rejectedRecordType = 0;
+};
+
+// Here we rebuild customers and accounts by replaying the log in order, starting
+// at startOffset when a snapshot already covers the beginning. A torn or corrupt
+// record at the end (a crash in the middle of a write) is cut off so that new
+// records are appended right after the last good one. A record that is whole
+// and passes its checksum but cannot be applied (its owner is missing, say)
+// fails recovery instead, with rejectedRecord set and the file left untouched,
+// since everything after it is durable too.
+bool replayLedgerLog(Bank& bank, const string& path, LedgerRecoverySummary& summary, uint64_t startOffset = 0);
+
+struct SnapshotSummary {
+    size_t customers = 0;
+    size_t accounts = 0;
+    uint64_t logOffset = 0;
+    double seconds = 0;
+};
+
+// Writes to path + ".tmp" and renames it into place, so a crash never leaves a
+// half-written snapshot behind. Accounts are locked one at a time while their
+// balance is copied, so transaction processing carries on during the write.
+bool writeSnapshot(Bank& bank, const string& path, SnapshotSummary& summary);
+
+// Loads a snapshot into an empty bank. Returns false when the file is missing
+// (found is then false) or is not a valid snapshot. Every record is checked,
+// but customers and accounts are only built as they are first used.
+bool loadSnapshot(Bank& bank, const string& path, SnapshotSummary& summary, bool& found);
+
+// Writes every metric in the Prometheus text exposition format. The file is
+// written next to its final name and renamed over it, so a scraper never reads
+// half a dump.
+bool writeMetricsFile(const Bank& bank, const string& path);
+
+// Audit marks for every account, kept between audits so the next one only
+// re-hashes chunks sealed since. Accounts without a mark are audited in full.
+class LedgerAuditState {
+private:
+    unordered_map<uint32_t, AccountAuditMark> marks;
+
+public:
+    // A missing file is an empty state; false only for a file that is not a valid state
+    bool load(const string& path);
+    // Written next to its final name and renamed over it
+    bool save(const string& path) const;
+    AccountAuditMark& mark(uint32_t accountNumber) { return marks[accountNumber]; }
+    size_t size() const { return marks.size(); }
+};
+
+struct LedgerAuditSummary {
+    size_t accounts = 0;
+    unsigned threads = 0;
+    uint64_t chunksVerified = 0;
+    uint64_t chunksSkipped = 0;
+    uint64_t recordsVerified = 0;
+    size_t rebased = 0;
+    vector<uint32_t> brokenChains;      // account numbers
+    vector<uint32_t> balanceMismatches;
+    vector<uint32_t> unreadable;
+    // Merkle root over every account's number, mark and balance, in account
+    // order: one value an auditor can write down and compare next time
+    Sha256Digest bookRoot = {};
+    double seconds = 0;
+
+    bool clean() const { return brokenChains.empty() && balanceMismatches.empty() && unreadable.empty(); }
+};
+
+// Audits every account on threadCount threads (0: one per core). Threads take
+// accounts in small batches from a shared counter, since a busy account can
+// have far more new chunks than a quiet one. Each account is locked while it
+// is checked; other accounts carry on.
+LedgerAuditSummary auditLedger(const Bank& bank, LedgerAuditState& state, unsigned threadCount);
+
+// A standing order as the scheduler keeps it: 48 bytes, linked into its wheel
+// slot by slot number rather than by pointer
+struct ScheduledTransfer {
+    uint32_t source;
+    uint32_t target;
+    Cents amount;
+    uint64_t dueTick;
+    uint32_t intervalTicks;     // 0 for a one-off
+    uint32_t remaining;         // firings left; 0 means no limit
+    uint32_t next;              // neighbours in the wheel slot, NO_SLOT at the ends
+    uint32_t previous;
+    uint16_t wheelSlot;         // level * WHEEL_SLOTS + slot, so a cancel can fix the slot's head
+};
+
+// One order that came due, handed to whoever runs the transfers
+struct DueTransfer {
+    uint64_t orderId;
+    uint32_t source;
+    uint32_t target;
+    Cents amount;
+    int64_t dueNs;
+};
+
+// Future-dated and recurring transfers in a hierarchical timing wheel: four
+// levels of 256 slots, each slot of a level spanning a whole turn of the level
+// below. An order goes in the lowest level whose turn reaches its due tick, so
+// schedule and cancel are O(1). Every 256 ticks the next slot of level 1 is
+// emptied back into the levels below it (and every 65536 ticks one of level 2,
+// and so on), so an order is moved at most three times before it fires, and a
+// tick costs one slot no matter how many orders there are.
+//
+// With one-second ticks the levels reach 4 minutes, 18 hours, 194 days and 136
+// years. Runs of empty ticks up to the next level-0 order (or the next
+// cascade) are skipped in one step. Orders live in a Slab; an order id is its
+// handle, so cancelling an order that already fired or was cancelled finds
+// nothing. Not thread-safe: one thread schedules, cancels and collects.
+class TransferScheduler {
+public:
+    static const int WHEEL_LEVELS = 4;
+    static const int WHEEL_BITS = 8;
+    static const uint32_t WHEEL_SLOTS = 1u << WHEEL_BITS;
+    static const uint32_t NO_SLOT = 0xFFFFFFFFu;
+
+private:
+    Slab<ScheduledTransfer> orders;
+    uint32_t heads[WHEEL_LEVELS * WHEEL_SLOTS];
+    uint64_t levelZeroOccupied[WHEEL_SLOTS / 64];  // which level-0 slots hold orders, to skip empty ticks
+    int64_t tickNs;
+    uint64_t nextTick;          // the first tick not yet fully collected
+    bool nextTickCascaded;      // its higher-level slots have already been emptied down
+    uint64_t cascaded;
+
+    void link(uint32_t slot, uint64_t earliestTick);
+    void unlink(uint32_t slot);
+    void cascade(int level);
+
+public:
+    explicit TransferScheduler(int64_t tickNs = 1000000000LL, int64_t startNs = currentEpochNanoseconds());
+    TransferScheduler(const TransferScheduler&) = delete;
+    TransferScheduler& operator=(const TransferScheduler&) = delete;
+
+    // Schedules amount from source to target at firstDueNs (a time already
+    // past fires on the next collect), then every intervalNs after that if it
+    // is nonzero, count times in all (0: until cancelled). Returns the order
+    // id, or 0 when intervalNs is shorter than one tick.
+    uint64_t schedule(uint32_t source, uint32_t target, Cents amount, int64_t firstDueNs,
+                      int64_t intervalNs = 0, uint32_t count = 0);
+    // False when the order is not scheduled (any more)
+    bool cancel(uint64_t orderId);
+
+    // Appends up to limit orders due at or before nowNs, oldest tick first, and
+    // returns how many it appended. Recurring orders are put back for their
+    // next time. A call that stops at limit picks up where it left off.
+    size_t collectDue(int64_t nowNs, size_t limit, vector<DueTransfer>& out);
+
+    size_t size() const { return orders.size(); }
+    uint64_t getCascadedOrders() const { return cascaded; }
+    int64_t getTickNs() const { return tickNs; }
+};
+
+struct StandingOrderRun {
+    size_t due = 0;
+    size_t applied = 0;
+    size_t rejected = 0;            // insufficient funds, a blocking velocity rule or an unknown account
+    size_t batches = 0;
+    bool durable = true;            // every batch's ledger commit succeeded
+};
+
+// Collects everything due by nowNs, batchSize orders at a time, and runs each
+// batch through Account::transfer with one ledger commit per batch
+StandingOrderRun runDueTransfers(Bank& bank, TransferScheduler& scheduler, int64_t nowNs, size_t batchSize);
+
+#endif
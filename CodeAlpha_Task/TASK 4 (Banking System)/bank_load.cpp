@@ -0,0 +1,298 @@
+// Load generator for the bank socket service ("--serve" in the menu program).
+// Forks one client process per connection; each keeps a fixed number of
+// requests in flight, writing every refill in one go and reading answers as
+// they arrive, and times each request from send to answer. The parent merges
+// the per-process histograms and reports throughput and latency percentiles.
+//
+//   g++ -std=c++17 -O2 -pthread bank_load.cpp bank_service.cpp bank_core.cpp -o bank_load
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "bank_service.h"
+
+enum LoadOperation {
+    LOAD_DEPOSIT,
+    LOAD_WITHDRAW,
+    LOAD_TRANSFER,
+    LOAD_BALANCE,
+    LOAD_HISTORY,
+    LOAD_OPERATION_COUNT
+};
+
+const ServiceOpcode LOAD_OPCODES[LOAD_OPERATION_COUNT] = {
+    ServiceOpcode::Deposit, ServiceOpcode::Withdraw, ServiceOpcode::Transfer,
+    ServiceOpcode::Balance, ServiceOpcode::History
+};
+
+const uint32_t LOAD_HISTORY_ENTRIES = 10;
+
+struct LoadConfig {
+    string socketPath;
+    uint32_t accounts = 0;
+    unsigned processes = 0;
+    unsigned pipelineDepth = 0;
+    double seconds = 0;
+    unsigned mix[LOAD_OPERATION_COUNT] = {30, 20, 30, 15, 5};
+};
+
+// What one client process reports back to the parent over its pipe
+struct LoadReport {
+    uint64_t completed = 0;
+    uint64_t statusCounts[256] = {};
+    uint64_t batches = 0;           // writes that carried at least one request
+    double seconds = 0;
+    LatencyHistogram latency;
+};
+
+bool parseLoadMix(const string& text, unsigned mix[LOAD_OPERATION_COUNT]) {
+    unsigned parsed[LOAD_OPERATION_COUNT];
+    unsigned totalWeight = 0;
+    size_t position = 0;
+    for (int i = 0; i < LOAD_OPERATION_COUNT; i++) {
+        size_t separator = text.find(':', position);
+        if ((separator == string::npos) != (i == LOAD_OPERATION_COUNT - 1)) return false;
+        string field = text.substr(position, separator == string::npos ? string::npos : separator - position);
+        if (field.empty() || field.find_first_not_of("0123456789") != string::npos || field.size() > 6) return false;
+        parsed[i] = (unsigned)stoul(field);
+        totalWeight += parsed[i];
+        position = separator + 1;
+    }
+    if (totalWeight == 0) return false;
+    copy(parsed, parsed + LOAD_OPERATION_COUNT, mix);
+    return true;
+}
+
+// MSG_NOSIGNAL only applies to sockets; the report pipe goes through plain write
+bool sendAll(int descriptor, const char* data, size_t length, bool isSocket = true) {
+    while (length > 0) {
+        ssize_t sent = isSocket ? send(descriptor, data, length, MSG_NOSIGNAL) : ::write(descriptor, data, length);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+// One client: keeps pipelineDepth requests outstanding until the time is up,
+// then collects the answers still owed. Answers arrive in request order, so
+// the send time of tag t sits in slot t % pipelineDepth.
+bool runLoadClient(const LoadConfig& config, unsigned clientIndex, LoadReport& report) {
+    int descriptor = connectToService(config.socketPath);
+    if (descriptor < 0) return false;
+
+    mt19937_64 random(0x5eed0000ULL + clientIndex);
+    unsigned totalWeight = 0;
+    for (unsigned weight : config.mix) totalWeight += weight;
+    vector<chrono::steady_clock::time_point> sentAt(config.pipelineDepth);
+    string outgoing;
+    string incoming;
+    char buffer[64 * 1024];
+    uint32_t nextTag = 0;
+    uint32_t nextAnswer = 0;
+
+    auto started = chrono::steady_clock::now();
+    auto deadline = started + chrono::duration_cast<chrono::steady_clock::duration>(
+                                  chrono::duration<double>(config.seconds));
+    bool sending = true;
+    bool ok = true;
+    while (ok && (sending || nextAnswer != nextTag)) {
+        auto now = chrono::steady_clock::now();
+        if (sending && now >= deadline) sending = false;
+
+        outgoing.clear();
+        while (sending && nextTag - nextAnswer < config.pipelineDepth) {
+            unsigned pick = (unsigned)(random() % totalWeight);
+            int operation = 0;
+            while (pick >= config.mix[operation]) {
+                pick -= config.mix[operation];
+                operation++;
+            }
+            ServiceRequest request = {};
+            request.tag = nextTag;
+            request.opcode = (uint8_t)LOAD_OPCODES[operation];
+            request.account = FIRST_ACCOUNT_NUMBER + (uint32_t)(random() % config.accounts);
+            if (operation == LOAD_TRANSFER) {
+                request.target = FIRST_ACCOUNT_NUMBER + (uint32_t)(random() % config.accounts);
+                if (request.target == request.account) {
+                    request.target = request.account == FIRST_ACCOUNT_NUMBER ? request.account + 1 : request.account - 1;
+                }
+            }
+            if (operation == LOAD_HISTORY) {
+                request.target = LOAD_HISTORY_ENTRIES;
+            } else if (operation != LOAD_BALANCE) {
+                request.amount = 100 + (Cents)(random() % 10000);
+            }
+            sentAt[nextTag % config.pipelineDepth] = now;
+            outgoing.append(reinterpret_cast<const char*>(&request), sizeof(request));
+            nextTag++;
+        }
+        if (!outgoing.empty()) {
+            ok = sendAll(descriptor, outgoing.data(), outgoing.size());
+            report.batches++;
+        }
+        if (nextAnswer == nextTag) break;
+
+        ssize_t received = ok ? ::read(descriptor, buffer, sizeof(buffer)) : -1;
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        incoming.append(buffer, (size_t)received);
+        auto answeredAt = chrono::steady_clock::now();
+
+        size_t used = 0;
+        ServiceResponse response;
+        while (incoming.size() - used >= sizeof(response)) {
+            memcpy(&response, incoming.data() + used, sizeof(response));
+            size_t length = sizeof(response) + (size_t)response.entryCount * sizeof(ServiceHistoryEntry);
+            if (incoming.size() - used < length) break;
+            if (response.tag != nextAnswer) {
+                ok = false;
+                break;
+            }
+            auto elapsed = answeredAt - sentAt[nextAnswer % config.pipelineDepth];
+            report.latency.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+            report.statusCounts[response.status]++;
+            report.completed++;
+            nextAnswer++;
+            used += length;
+        }
+        incoming.erase(0, used);
+    }
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    ::close(descriptor);
+    return ok;
+}
+
+string encodeReport(const LoadReport& report) {
+    string out;
+    out.append(reinterpret_cast<const char*>(&report.completed), sizeof(report.completed));
+    out.append(reinterpret_cast<const char*>(report.statusCounts), sizeof(report.statusCounts));
+    out.append(reinterpret_cast<const char*>(&report.batches), sizeof(report.batches));
+    out.append(reinterpret_cast<const char*>(&report.seconds), sizeof(report.seconds));
+    report.latency.save(out);
+    return out;
+}
+
+bool decodeReport(const string& in, LoadReport& report) {
+    size_t fixedBytes = sizeof(report.completed) + sizeof(report.statusCounts) +
+                        sizeof(report.batches) + sizeof(report.seconds);
+    if (in.size() < fixedBytes) return false;
+    const char* cursor = in.data();
+    memcpy(&report.completed, cursor, sizeof(report.completed));
+    cursor += sizeof(report.completed);
+    memcpy(report.statusCounts, cursor, sizeof(report.statusCounts));
+    cursor += sizeof(report.statusCounts);
+    memcpy(&report.batches, cursor, sizeof(report.batches));
+    cursor += sizeof(report.batches);
+    memcpy(&report.seconds, cursor, sizeof(report.seconds));
+    return report.latency.load(in.substr(fixedBytes));
+}
+
+void displayLoadUsage(const char* program) {
+    cout << "Usage:\n";
+    cout << "  " << program << " <socket> <accounts> <processes> <pipeline depth> <seconds> [mix]\n";
+    cout << "        drive ACCT" << FIRST_ACCOUNT_NUMBER << " onwards through a bank started with --serve;\n";
+    cout << "        mix is deposit:withdraw:transfer:balance:history weights (default 30:20:30:15:5)\n";
+}
+
+int main(int argc, char* argv[]) {
+    LoadConfig config;
+    if (argc == 6 || argc == 7) {
+        config.socketPath = argv[1];
+        config.accounts = (uint32_t)strtoul(argv[2], nullptr, 10);
+        config.processes = (unsigned)strtoul(argv[3], nullptr, 10);
+        config.pipelineDepth = (unsigned)strtoul(argv[4], nullptr, 10);
+        config.seconds = strtod(argv[5], nullptr);
+    }
+    if ((argc != 6 && argc != 7) || config.accounts < 2 || config.processes == 0 ||
+        config.pipelineDepth == 0 || config.seconds <= 0 || (argc == 7 && !parseLoadMix(argv[6], config.mix))) {
+        displayLoadUsage(argv[0]);
+        return 1;
+    }
+
+    vector<pid_t> children;
+    vector<int> pipes;
+    for (unsigned i = 0; i < config.processes; i++) {
+        int ends[2];
+        if (pipe(ends) != 0) {
+            cout << "Error: Unable to create a pipe.\n";
+            return 1;
+        }
+        pid_t child = fork();
+        if (child == 0) {
+            ::close(ends[0]);
+            LoadReport report;
+            bool ok = runLoadClient(config, i, report);
+            string encoded = encodeReport(report);
+            bool sent = sendAll(ends[1], encoded.data(), encoded.size(), false);
+            _exit(ok && sent ? 0 : 1);
+        }
+        ::close(ends[1]);
+        if (child < 0) {
+            cout << "Error: Unable to start client process.\n";
+            return 1;
+        }
+        children.push_back(child);
+        pipes.push_back(ends[0]);
+    }
+
+    LoadReport total;
+    unsigned failedClients = 0;
+    for (size_t i = 0; i < children.size(); i++) {
+        string encoded;
+        char buffer[64 * 1024];
+        ssize_t received;
+        while ((received = ::read(pipes[i], buffer, sizeof(buffer))) > 0 || (received < 0 && errno == EINTR)) {
+            if (received > 0) encoded.append(buffer, (size_t)received);
+        }
+        ::close(pipes[i]);
+        int exitStatus = 0;
+        waitpid(children[i], &exitStatus, 0);
+
+        LoadReport report;
+        if (!decodeReport(encoded, report) || !WIFEXITED(exitStatus) || WEXITSTATUS(exitStatus) != 0) {
+            failedClients++;
+        }
+        total.completed += report.completed;
+        for (int status = 0; status < 256; status++) {
+            total.statusCounts[status] += report.statusCounts[status];
+        }
+        total.batches += report.batches;
+        total.seconds = max(total.seconds, report.seconds);
+        total.latency.merge(report.latency);
+    }
+
+    cout << "Load: " << config.processes << " processes x " << config.pipelineDepth << " in flight, "
+         << config.accounts << " accounts, " << fixed << setprecision(1) << total.seconds << " s\n";
+    cout << "Requests: " << total.completed << " (" << setprecision(0)
+         << (total.seconds > 0 ? total.completed / total.seconds : 0) << "/s), "
+         << setprecision(1) << (total.batches > 0 ? (double)total.completed / total.batches : 0)
+         << " per write\n";
+    cout << "Latency us: mean " << setprecision(1) << total.latency.getMean() / 1000.0
+         << "  p50 " << total.latency.percentile(0.50) / 1000.0
+         << "  p90 " << total.latency.percentile(0.90) / 1000.0
+         << "  p99 " << total.latency.percentile(0.99) / 1000.0
+         << "  p99.9 " << total.latency.percentile(0.999) / 1000.0
+         << "  max " << total.latency.getMax() / 1000.0 << "\n";
+    for (int status = 0; status < 256; status++) {
+        if (total.statusCounts[status] == 0) continue;
+        cout << "  " << left << setw(22) << describeServiceStatus((ServiceStatus)status)
+             << right << total.statusCounts[status] << "\n";
+    }
+    if (failedClients > 0) {
+        cout << "Error: " << failedClients << " client process(es) lost their connection.\n";
+        return 1;
+    }
+    return 0;
+}
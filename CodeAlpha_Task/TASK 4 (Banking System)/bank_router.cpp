@@ -0,0 +1,643 @@
+#include "bank_router.h"
+
+#include <cerrno>
+#include <unordered_set>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+const uint64_t LISTEN_KEY = 0;
+const uint64_t CLIENT_KEY_BASE = 1ULL << 32;   // shard i uses key 1 + i
+const size_t ROUTER_READ_CHUNK_BYTES = 64 * 1024;
+const size_t ROUTER_READ_BYTES_PER_PASS = 1024 * 1024;
+const size_t ROUTER_OUTPUT_PAUSE_BYTES = 4 * 1024 * 1024;
+const int ROUTER_EVENTS_PER_WAIT = 256;
+const chrono::milliseconds SHARD_RETRY_INTERVAL(200);
+
+struct RouterDecisionPayload {  // TransferDecided; TransferFinished carries only the id
+    uint64_t transferId;
+    uint32_t sourceShard;
+    uint32_t targetShard;
+};
+
+// Entries that follow a response of this opcode
+size_t responseEntryBytes(uint8_t opcode) {
+    if (opcode == (uint8_t)ServiceOpcode::History) return sizeof(ServiceHistoryEntry);
+    if (opcode == (uint8_t)ServiceOpcode::ListPending) return sizeof(ServicePendingEntry);
+    return 0;
+}
+
+ShardRouter::ShardRouter(const vector<string>& shardPaths)
+    : listenDescriptor(-1), epollDescriptor(-1), nextClientId(1), nextTransferId(0) {
+    shards.resize(shardPaths.size());
+    for (size_t i = 0; i < shardPaths.size(); i++) {
+        shards[i].path = shardPaths[i];
+        shards[i].fileDescriptor = -1;
+        shards[i].outputSent = 0;
+        shards[i].interest = 0;
+    }
+}
+
+ShardRouter::~ShardRouter() {
+    for (auto& entry : clients) {
+        ::close(entry.second->fileDescriptor);
+        delete entry.second;
+    }
+    for (ShardLink& link : shards) {
+        if (link.fileDescriptor >= 0) ::close(link.fileDescriptor);
+    }
+    if (epollDescriptor >= 0) ::close(epollDescriptor);
+    if (listenDescriptor >= 0) {
+        ::close(listenDescriptor);
+        unlink(socketPath.c_str());
+    }
+}
+
+bool ShardRouter::loadDecisions() {
+    string contents;
+    nextTransferId = (uint64_t)currentEpochNanoseconds();
+    if (!readWholeFile(decisionLogPath, contents)) {
+        return true; // no decisions yet
+    }
+
+    size_t offset = 0;
+    while (offset + sizeof(WalRecordHeader) <= contents.size()) {
+        WalRecordHeader header;
+        memcpy(&header, contents.data() + offset, sizeof(header));
+        size_t recordEnd = offset + sizeof(header) + header.payloadLength;
+        if (recordEnd > contents.size()) break;
+        const char* payload = contents.data() + offset + sizeof(header);
+        if (crc32(payload, header.payloadLength, crc32(&header.type, 1)) != header.checksum) break;
+
+        if (header.type == (uint8_t)WalRecordType::TransferDecided &&
+            header.payloadLength == sizeof(RouterDecisionPayload)) {
+            RouterDecisionPayload decision;
+            memcpy(&decision, payload, sizeof(decision));
+            if (decision.sourceShard >= shards.size() || decision.targetShard >= shards.size()) return false;
+            CrossShardTransfer transfer = {};
+            transfer.transferId = decision.transferId;
+            transfer.shards[0] = decision.sourceShard;
+            transfer.shards[1] = decision.targetShard;
+            transfer.committed = true;
+            transfer.awaitingAck[0] = transfer.awaitingAck[1] = true;
+            transfers[decision.transferId] = transfer;
+            nextTransferId = max(nextTransferId, decision.transferId + 1);
+        } else if (header.type == (uint8_t)WalRecordType::TransferFinished &&
+                   header.payloadLength == sizeof(uint64_t)) {
+            uint64_t transferId;
+            memcpy(&transferId, payload, sizeof(transferId));
+            transfers.erase(transferId);
+        } else {
+            break;
+        }
+        offset = recordEnd;
+    }
+    stats.recoveredDecisions = transfers.size();
+    if (offset == contents.size() &&
+        offset == transfers.size() * (sizeof(WalRecordHeader) + sizeof(RouterDecisionPayload))) {
+        return true; // nothing confirmed, nothing torn: the log is already as small as it gets
+    }
+    return rewriteDecisions();
+}
+
+// Replaces the decision log with just the commits still awaiting confirmation,
+// so it does not grow forever and a torn tail is dropped with everything else.
+// The new file is synced before it takes the old one's place.
+bool ShardRouter::rewriteDecisions() {
+    string bytes;
+    for (const auto& entry : transfers) {
+        const CrossShardTransfer& transfer = entry.second;
+        RouterDecisionPayload decision = {transfer.transferId, transfer.shards[0], transfer.shards[1]};
+        WalRecordHeader header = {};
+        header.payloadLength = sizeof(decision);
+        header.type = (uint8_t)WalRecordType::TransferDecided;
+        header.checksum = crc32(&decision, sizeof(decision), crc32(&header.type, 1));
+        bytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes.append(reinterpret_cast<const char*>(&decision), sizeof(decision));
+    }
+
+    string temporaryPath = decisionLogPath + ".tmp";
+    int descriptor = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (descriptor < 0) return false;
+    size_t written = 0;
+    while (written < bytes.size()) {
+        ssize_t result = ::write(descriptor, bytes.data() + written, bytes.size() - written);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) break;
+        written += (size_t)result;
+    }
+    bool ok = written == bytes.size() && fsync(descriptor) == 0;
+    ::close(descriptor);
+    return ok && rename(temporaryPath.c_str(), decisionLogPath.c_str()) == 0;
+}
+
+bool ShardRouter::open(const string& path, const string& decisionPath) {
+    decisionLogPath = decisionPath;
+    if (!loadDecisions()) return false;
+    // Every commit decision is synced explicitly before it is acted on
+    if (!decisionLog.open(decisionPath, 1 << 20, chrono::microseconds(1000000))) return false;
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    struct stat existing;
+    if (stat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(path.c_str());
+    }
+    listenDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenDescriptor < 0) return false;
+    if (bind(listenDescriptor, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(listenDescriptor);
+        listenDescriptor = -1;
+        return false;
+    }
+    socketPath = path;
+    epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (::listen(listenDescriptor, SOMAXCONN) != 0 || epollDescriptor < 0) return false;
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = LISTEN_KEY;
+    if (epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, listenDescriptor, &event) != 0) return false;
+
+    for (uint32_t shard = 0; shard < shards.size(); shard++) {
+        connectShard(shard);
+    }
+    return true;
+}
+
+bool ShardRouter::connectShard(uint32_t shard) {
+    ShardLink& link = shards[shard];
+    int descriptor = connectToService(link.path);
+    if (descriptor < 0 || fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK) != 0) {
+        if (descriptor >= 0) ::close(descriptor);
+        link.nextAttempt = chrono::steady_clock::now() + SHARD_RETRY_INTERVAL;
+        return false;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = 1 + shard;
+    if (epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, descriptor, &event) != 0) {
+        ::close(descriptor);
+        link.nextAttempt = chrono::steady_clock::now() + SHARD_RETRY_INTERVAL;
+        return false;
+    }
+    link.fileDescriptor = descriptor;
+    link.interest = EPOLLIN;
+    link.input.clear();
+    link.output.clear();
+    link.outputSent = 0;
+    stats.shardConnects++;
+
+    // Before anything else: settle whatever the shard still has prepared
+    ServiceRequest request = {};
+    request.opcode = (uint8_t)ServiceOpcode::ListPending;
+    sendToShard(shard, request, {CallKind::List, 0, 0, 0, 0, 0});
+    return true;
+}
+
+void ShardRouter::shardDown(uint32_t shard) {
+    ShardLink& link = shards[shard];
+    if (link.fileDescriptor < 0) return;
+    epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, link.fileDescriptor, nullptr);
+    ::close(link.fileDescriptor);
+    link.fileDescriptor = -1;
+    link.input.clear();
+    link.output.clear();
+    link.outputSent = 0;
+    link.nextAttempt = chrono::steady_clock::now() + SHARD_RETRY_INTERVAL;
+
+    // Unanswered prepares count as "no" votes; unanswered commits stay owed and
+    // are settled from the shard's pending list once it is back
+    deque<ShardCall> lost;
+    lost.swap(link.calls);
+    for (const ShardCall& call : lost) {
+        if (call.kind == CallKind::Forward) {
+            answer(call.clientId, call.slot, call.clientTag, call.opcode, ServiceStatus::ShardUnavailable, 0);
+        } else if (call.kind == CallKind::Prepare) {
+            auto it = transfers.find(call.transferId);
+            if (it != transfers.end()) {
+                handleVote(it->second, it->second.shards[0] == shard ? 0 : 1, ServiceStatus::ShardUnavailable, 0);
+            }
+        }
+    }
+}
+
+void ShardRouter::sendToShard(uint32_t shard, const ServiceRequest& request, const ShardCall& call) {
+    ShardLink& link = shards[shard];
+    link.output.append(reinterpret_cast<const char*>(&request), sizeof(request));
+    link.calls.push_back(call);
+}
+
+void ShardRouter::sendResolve(uint32_t shard, uint64_t transferId, bool commit) {
+    if (shards[shard].fileDescriptor < 0) return;
+    ServiceRequest request = {};
+    request.opcode = (uint8_t)(commit ? ServiceOpcode::CommitTransfer : ServiceOpcode::AbortTransfer);
+    request.transferId = transferId;
+    sendToShard(shard, request, {CallKind::Resolve, 0, 0, 0, transferId, 0});
+}
+
+void ShardRouter::readShard(uint32_t shard) {
+    ShardLink& link = shards[shard];
+    char buffer[ROUTER_READ_CHUNK_BYTES];
+    bool lost = false;
+    while (true) {
+        ssize_t received = ::read(link.fileDescriptor, buffer, sizeof(buffer));
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) {
+            lost = received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+        link.input.append(buffer, (size_t)received);
+    }
+
+    size_t used = 0;
+    ServiceResponse response;
+    while (link.input.size() - used >= sizeof(response) && !link.calls.empty()) {
+        memcpy(&response, link.input.data() + used, sizeof(response));
+        size_t length = sizeof(response) + response.entryCount * responseEntryBytes(response.opcode);
+        if (link.input.size() - used < length) break;
+        ShardCall call = link.calls.front();
+        link.calls.pop_front();
+        handleShardResponse(shard, call, link.input.data() + used, length);
+        used += length;
+    }
+    link.input.erase(0, used);
+    if (lost) {
+        shardDown(shard);
+    }
+}
+
+void ShardRouter::handleShardResponse(uint32_t shard, const ShardCall& call, const char* bytes, size_t length) {
+    ServiceResponse response;
+    memcpy(&response, bytes, sizeof(response));
+    switch (call.kind) {
+        case CallKind::Forward:
+            fillSlot(call.clientId, call.slot, bytes, length, call.clientTag);
+            break;
+        case CallKind::Prepare: {
+            auto it = transfers.find(call.transferId);
+            if (it != transfers.end()) {
+                handleVote(it->second, it->second.shards[0] == shard ? 0 : 1,
+                           (ServiceStatus)response.status, response.balance);
+            }
+            break;
+        }
+        case CallKind::Resolve:
+            if (response.opcode == (uint8_t)ServiceOpcode::CommitTransfer) {
+                handleAck(shard, call.transferId);
+            }
+            break;
+        case CallKind::List:
+            handlePendingList(shard, bytes + sizeof(response), response.entryCount);
+            break;
+    }
+}
+
+void ShardRouter::handleVote(CrossShardTransfer& transfer, int side, ServiceStatus status, Cents balance) {
+    if (transfer.voted[side]) return;
+    transfer.voted[side] = true;
+    transfer.votes[side] = status;
+    if (side == 0) {
+        transfer.sourceBalance = balance;
+    }
+    if (transfer.voted[0] && transfer.voted[1]) {
+        finishVoting(transfer);
+    }
+}
+
+void ShardRouter::finishVoting(CrossShardTransfer& transfer) {
+    if (transfer.votes[0] == ServiceStatus::Ok && transfer.votes[1] == ServiceStatus::Ok) {
+        RouterDecisionPayload decision = {transfer.transferId, transfer.shards[0], transfer.shards[1]};
+        decisionLog.append(WalRecordType::TransferDecided, &decision, sizeof(decision));
+        decidedThisPass.push_back(transfer.transferId);
+        return;
+    }
+    for (int side = 0; side < 2; side++) {
+        if (transfer.votes[side] == ServiceStatus::Ok) {
+            sendResolve(transfer.shards[side], transfer.transferId, false);
+        }
+    }
+    // Report what a single-shard transfer would have: the paying side's refusal first
+    ServiceStatus status = transfer.votes[0] != ServiceStatus::Ok ? transfer.votes[0] : transfer.votes[1];
+    answer(transfer.clientId, transfer.slot, transfer.clientTag, (uint8_t)ServiceOpcode::Transfer, status,
+           transfer.sourceBalance);
+    stats.crossShardAborted++;
+    transfers.erase(transfer.transferId);
+}
+
+void ShardRouter::handleAck(uint32_t shard, uint64_t transferId) {
+    auto it = transfers.find(transferId);
+    if (it == transfers.end() || !it->second.committed) return;
+    CrossShardTransfer& transfer = it->second;
+    transfer.awaitingAck[transfer.shards[0] == shard ? 0 : 1] = false;
+    if (!transfer.awaitingAck[0] && !transfer.awaitingAck[1]) {
+        decisionLog.append(WalRecordType::TransferFinished, &transferId, sizeof(transferId));
+        transfers.erase(it);
+    }
+}
+
+void ShardRouter::handlePendingList(uint32_t shard, const char* entries, size_t count) {
+    unordered_set<uint64_t> listed;
+    for (size_t i = 0; i < count; i++) {
+        ServicePendingEntry entry;
+        memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+        listed.insert(entry.transferId);
+        auto it = transfers.find(entry.transferId);
+        sendResolve(shard, entry.transferId, it != transfers.end() && it->second.committed);
+    }
+    // A committed transfer the shard no longer lists has already been booked there
+    vector<uint64_t> confirmed;
+    for (const auto& entry : transfers) {
+        const CrossShardTransfer& transfer = entry.second;
+        bool owed = transfer.committed &&
+                    ((transfer.shards[0] == shard && transfer.awaitingAck[0]) ||
+                     (transfer.shards[1] == shard && transfer.awaitingAck[1]));
+        if (owed && listed.count(entry.first) == 0 && count < 0xFFFF) {
+            confirmed.push_back(entry.first);
+        }
+    }
+    for (uint64_t transferId : confirmed) {
+        handleAck(shard, transferId);
+    }
+    if (count == 0xFFFF) {
+        // The list was cut short; ask again once these are settled
+        ServiceRequest request = {};
+        request.opcode = (uint8_t)ServiceOpcode::ListPending;
+        sendToShard(shard, request, {CallKind::List, 0, 0, 0, 0, 0});
+    }
+}
+
+void ShardRouter::acceptClients() {
+    while (true) {
+        int descriptor = accept4(listenDescriptor, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (descriptor < 0) return;
+
+        Client* client = new Client();
+        client->id = nextClientId++;
+        client->fileDescriptor = descriptor;
+        client->firstSlot = 0;
+        client->outputSent = 0;
+        client->interest = EPOLLIN;
+        client->closing = false;
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = CLIENT_KEY_BASE + client->id;
+        if (epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, descriptor, &event) != 0) {
+            ::close(descriptor);
+            delete client;
+            continue;
+        }
+        clients[client->id] = client;
+        stats.connections++;
+    }
+}
+
+void ShardRouter::readClient(Client& client) {
+    char buffer[ROUTER_READ_CHUNK_BYTES];
+    size_t readThisPass = 0;
+    while (readThisPass < ROUTER_READ_BYTES_PER_PASS) {
+        ssize_t received = ::read(client.fileDescriptor, buffer, sizeof(buffer));
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) {
+            if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) client.closing = true;
+            return;
+        }
+        readThisPass += (size_t)received;
+        client.input.append(buffer, (size_t)received);
+
+        size_t used = 0;
+        ServiceRequest request;
+        while (client.input.size() - used >= sizeof(request)) {
+            memcpy(&request, client.input.data() + used, sizeof(request));
+            routeRequest(client, request);
+            used += sizeof(request);
+        }
+        client.input.erase(0, used);
+        if (client.output.size() - client.outputSent >= ROUTER_OUTPUT_PAUSE_BYTES) return;
+    }
+}
+
+uint64_t ShardRouter::reserveSlot(Client& client) {
+    client.slots.push_back({string(), false});
+    return client.firstSlot + client.slots.size() - 1;
+}
+
+void ShardRouter::routeRequest(Client& client, const ServiceRequest& request) {
+    stats.requests++;
+    uint64_t slot = reserveSlot(client);
+    uint32_t shardCount = (uint32_t)shards.size();
+    ServiceOpcode opcode = (ServiceOpcode)request.opcode;
+    bool singleShard = opcode == ServiceOpcode::Deposit || opcode == ServiceOpcode::Withdraw ||
+                       opcode == ServiceOpcode::Balance || opcode == ServiceOpcode::History ||
+                       (opcode == ServiceOpcode::Transfer &&
+                        shardForAccount(request.account, shardCount) == shardForAccount(request.target, shardCount));
+
+    if (singleShard) {
+        uint32_t shard = shardForAccount(request.account, shardCount);
+        if (shards[shard].fileDescriptor < 0) {
+            answer(client.id, slot, request.tag, request.opcode, ServiceStatus::ShardUnavailable, 0);
+            return;
+        }
+        sendToShard(shard, request, {CallKind::Forward, client.id, slot, request.tag, 0, request.opcode});
+        stats.forwarded++;
+        return;
+    }
+    if (opcode != ServiceOpcode::Transfer) {
+        answer(client.id, slot, request.tag, request.opcode, ServiceStatus::BadRequest, 0);
+        return;
+    }
+
+    CrossShardTransfer transfer = {};
+    transfer.transferId = nextTransferId++;
+    transfer.shards[0] = shardForAccount(request.account, shardCount);
+    transfer.shards[1] = shardForAccount(request.target, shardCount);
+    transfer.clientId = client.id;
+    transfer.slot = slot;
+    transfer.clientTag = request.tag;
+    transfer.amount = request.amount;
+    transfers[transfer.transferId] = transfer;
+
+    bool down[2];
+    for (int side = 0; side < 2; side++) {
+        ServiceRequest prepare = {};
+        prepare.opcode = (uint8_t)(side == 0 ? ServiceOpcode::PrepareDebit : ServiceOpcode::PrepareCredit);
+        prepare.account = side == 0 ? request.account : request.target;
+        prepare.target = side == 0 ? request.target : request.account;
+        prepare.amount = request.amount;
+        prepare.transferId = transfer.transferId;
+        down[side] = shards[transfer.shards[side]].fileDescriptor < 0;
+        if (!down[side]) {
+            sendToShard(transfer.shards[side], prepare, {CallKind::Prepare, 0, 0, 0, transfer.transferId, 0});
+        }
+    }
+    for (int side = 0; side < 2; side++) {
+        auto it = transfers.find(transfer.transferId);
+        if (down[side] && it != transfers.end()) {
+            handleVote(it->second, side, ServiceStatus::ShardUnavailable, 0);
+        }
+    }
+}
+
+void ShardRouter::fillSlot(uint64_t clientId, uint64_t slot, const char* bytes, size_t length, uint32_t tag) {
+    auto it = clients.find(clientId);
+    if (it == clients.end()) return; // the client left before its answer came back
+    Client& client = *it->second;
+    ClientSlot& target = client.slots[slot - client.firstSlot];
+    target.bytes.assign(bytes, length);
+    memcpy(&target.bytes[0], &tag, sizeof(tag));
+    target.ready = true;
+}
+
+void ShardRouter::answer(uint64_t clientId, uint64_t slot, uint32_t tag, uint8_t opcode, ServiceStatus status,
+                         Cents balance) {
+    ServiceResponse response = {};
+    response.tag = tag;
+    response.status = (uint8_t)status;
+    response.opcode = opcode;
+    response.balance = balance;
+    fillSlot(clientId, slot, reinterpret_cast<const char*>(&response), sizeof(response), tag);
+}
+
+bool ShardRouter::writeClient(Client& client) {
+    while (!client.slots.empty() && client.slots.front().ready) {
+        client.output += client.slots.front().bytes;
+        client.slots.pop_front();
+        client.firstSlot++;
+    }
+    while (client.outputSent < client.output.size()) {
+        ssize_t sent = send(client.fileDescriptor, client.output.data() + client.outputSent,
+                            client.output.size() - client.outputSent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.outputSent += (size_t)sent;
+    }
+    client.output.clear();
+    client.outputSent = 0;
+    return true;
+}
+
+bool ShardRouter::writeShard(ShardLink& link) {
+    while (link.outputSent < link.output.size()) {
+        ssize_t sent = send(link.fileDescriptor, link.output.data() + link.outputSent,
+                            link.output.size() - link.outputSent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        link.outputSent += (size_t)sent;
+    }
+    link.output.clear();
+    link.outputSent = 0;
+    return true;
+}
+
+void ShardRouter::updateInterest(int fileDescriptor, uint64_t key, uint32_t& interest, uint32_t wanted) {
+    if (wanted == interest) return;
+    epoll_event event = {};
+    event.events = wanted;
+    event.data.u64 = key;
+    epoll_ctl(epollDescriptor, EPOLL_CTL_MOD, fileDescriptor, &event);
+    interest = wanted;
+}
+
+void ShardRouter::closeClient(Client* client) {
+    epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, client->fileDescriptor, nullptr);
+    ::close(client->fileDescriptor);
+    clients.erase(client->id);
+    delete client;
+}
+
+bool ShardRouter::run(const volatile sig_atomic_t& stop) {
+    epoll_event events[ROUTER_EVENTS_PER_WAIT];
+    vector<uint64_t> touched;
+    while (stop == 0) {
+        int ready = epoll_wait(epollDescriptor, events, ROUTER_EVENTS_PER_WAIT, 100);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            uint64_t key = events[i].data.u64;
+            if (key == LISTEN_KEY) {
+                acceptClients();
+            } else if (key < CLIENT_KEY_BASE) {
+                uint32_t shard = (uint32_t)(key - 1);
+                if (shards[shard].fileDescriptor >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    readShard(shard);
+                }
+            } else {
+                auto it = clients.find(key - CLIENT_KEY_BASE);
+                if (it == clients.end()) continue;
+                if (events[i].events & EPOLLIN) {
+                    readClient(*it->second);
+                } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    closeClient(it->second);
+                }
+            }
+        }
+
+        auto now = chrono::steady_clock::now();
+        for (uint32_t shard = 0; shard < shards.size(); shard++) {
+            if (shards[shard].fileDescriptor < 0 && now >= shards[shard].nextAttempt) {
+                connectShard(shard);
+            }
+        }
+
+        // Commit decisions become durable before anyone hears about them
+        if (!decidedThisPass.empty()) {
+            if (!decisionLog.flush()) return false;
+            stats.decisionSyncs++;
+            for (uint64_t transferId : decidedThisPass) {
+                CrossShardTransfer& transfer = transfers[transferId];
+                transfer.committed = true;
+                transfer.awaitingAck[0] = transfer.awaitingAck[1] = true;
+                answer(transfer.clientId, transfer.slot, transfer.clientTag, (uint8_t)ServiceOpcode::Transfer,
+                       ServiceStatus::Ok, transfer.sourceBalance - transfer.amount);
+                stats.crossShardCommitted++;
+                sendResolve(transfer.shards[0], transferId, true);
+                sendResolve(transfer.shards[1], transferId, true);
+            }
+            decidedThisPass.clear();
+        }
+
+        for (uint32_t shard = 0; shard < shards.size(); shard++) {
+            ShardLink& link = shards[shard];
+            if (link.fileDescriptor < 0) continue;
+            if (!writeShard(link)) {
+                shardDown(shard);
+                continue;
+            }
+            updateInterest(link.fileDescriptor, 1 + shard, link.interest,
+                           EPOLLIN | (link.output.empty() ? 0 : (uint32_t)EPOLLOUT));
+        }
+
+        // Answers can land on any client, so every client with something ready is written.
+        // A client that has stopped sending is closed once it has every answer.
+        touched.clear();
+        for (auto& entry : clients) {
+            Client& client = *entry.second;
+            if (client.closing || !client.output.empty() ||
+                (!client.slots.empty() && client.slots.front().ready)) {
+                touched.push_back(entry.first);
+            }
+        }
+        for (uint64_t clientId : touched) {
+            Client* client = clients[clientId];
+            if (!writeClient(*client) || (client->closing && client->slots.empty() && client->output.empty())) {
+                closeClient(client);
+                continue;
+            }
+            size_t unsent = client->output.size() - client->outputSent;
+            bool reading = !client->closing && unsent < ROUTER_OUTPUT_PAUSE_BYTES;
+            updateInterest(client->fileDescriptor, CLIENT_KEY_BASE + client->id, client->interest,
+                           (reading ? (uint32_t)EPOLLIN : 0) | (unsent > 0 ? (uint32_t)EPOLLOUT : 0));
+        }
+    }
+    return true;
+}
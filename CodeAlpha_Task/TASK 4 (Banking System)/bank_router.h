@@ -0,0 +1,154 @@
+// Shard router for a bank split across several shard processes. Each shard is
+// a "--serve --shard <i>/<n>" instance holding only the accounts that
+// shardForAccount assigns to it, with its own ledger log and snapshot. Clients
+// talk to the router with the ordinary service protocol and never see the
+// shards.
+//
+// Deposits, withdrawals, balances, history and transfers inside one shard are
+// forwarded as they are. A transfer between shards runs two-phase commit with
+// the router as coordinator:
+//   1. PrepareDebit goes to the paying shard (it holds the funds, which is
+//      where "Insufficient funds" is decided) and PrepareCredit to the
+//      receiving one, at the same time. Each shard logs its prepare durably
+//      before voting.
+//   2. If both vote yes the router appends a commit decision to its own
+//      decision log and syncs it, then answers the client and sends
+//      CommitTransfer to both. Otherwise it sends AbortTransfer to whichever
+//      side prepared. An abort is never logged: a prepared transfer with no
+//      commit decision on record is aborted (presumed abort).
+//
+// Recovery: a shard restarts with its prepared transfers still holding funds.
+// Whenever the router (re)connects to a shard it first asks for that list and
+// commits the ids its decision log holds, aborting the rest. A restarted router
+// reloads the commit decisions that were never confirmed by both shards and
+// rewrites its decision log down to them.
+#ifndef BANK_ROUTER_H
+#define BANK_ROUTER_H
+
+#include "bank_service.h"
+
+#include <deque>
+
+struct ShardRouterStats {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t forwarded = 0;
+    uint64_t crossShardCommitted = 0;
+    uint64_t crossShardAborted = 0;
+    uint64_t decisionSyncs = 0;         // decision log flushes, each covering every commit in its pass
+    uint64_t recoveredDecisions = 0;    // unconfirmed commits reloaded from the decision log
+    uint64_t shardConnects = 0;          // including the first connection to each shard
+};
+
+class ShardRouter {
+private:
+    // Answers go back to a client in request order, so every request gets a
+    // slot that is filled whenever its shard (or shards) reply
+    struct ClientSlot {
+        string bytes;
+        bool ready;
+    };
+
+    struct Client {
+        uint64_t id;
+        int fileDescriptor;
+        string input;
+        deque<ClientSlot> slots;
+        uint64_t firstSlot;         // sequence number of slots.front()
+        string output;
+        size_t outputSent;
+        uint32_t interest;
+        bool closing;
+    };
+
+    enum class CallKind : uint8_t { Forward, Prepare, Resolve, List };
+
+    // A request sent to a shard and not yet answered; shards answer in order
+    struct ShardCall {
+        CallKind kind;
+        uint64_t clientId;
+        uint64_t slot;
+        uint32_t clientTag;
+        uint64_t transferId;
+        uint8_t opcode;             // the client's, for a Forward
+    };
+
+    struct ShardLink {
+        string path;
+        int fileDescriptor;
+        string input;
+        string output;
+        size_t outputSent;
+        uint32_t interest;
+        deque<ShardCall> calls;
+        chrono::steady_clock::time_point nextAttempt;
+    };
+
+    struct CrossShardTransfer {
+        uint64_t transferId;
+        uint32_t shards[2];             // paying shard, receiving shard
+        uint64_t clientId;
+        uint64_t slot;
+        uint32_t clientTag;
+        Cents amount;
+        Cents sourceBalance;
+        ServiceStatus votes[2];
+        bool voted[2];
+        bool committed;                 // decision logged (or recovered)
+        bool awaitingAck[2];            // commit not yet confirmed by that shard
+    };
+
+    vector<ShardLink> shards;
+    string socketPath;
+    int listenDescriptor;
+    int epollDescriptor;
+    unordered_map<uint64_t, Client*> clients;
+    uint64_t nextClientId;
+    unordered_map<uint64_t, CrossShardTransfer> transfers;
+    vector<uint64_t> decidedThisPass;   // committed, waiting for the decision log sync
+    uint64_t nextTransferId;
+    string decisionLogPath;
+    WriteAheadLog decisionLog;
+    ShardRouterStats stats;
+
+    bool loadDecisions();
+    bool rewriteDecisions();
+    bool connectShard(uint32_t shard);
+    void shardDown(uint32_t shard);
+    void sendToShard(uint32_t shard, const ServiceRequest& request, const ShardCall& call);
+    void sendResolve(uint32_t shard, uint64_t transferId, bool commit);
+    void readShard(uint32_t shard);
+    void handleShardResponse(uint32_t shard, const ShardCall& call, const char* response, size_t length);
+    void handleVote(CrossShardTransfer& transfer, int side, ServiceStatus status, Cents balance);
+    void finishVoting(CrossShardTransfer& transfer);
+    void handleAck(uint32_t shard, uint64_t transferId);
+    void handlePendingList(uint32_t shard, const char* entries, size_t count);
+
+    void acceptClients();
+    void readClient(Client& client);
+    void routeRequest(Client& client, const ServiceRequest& request);
+    uint64_t reserveSlot(Client& client);
+    void fillSlot(uint64_t clientId, uint64_t slot, const char* bytes, size_t length, uint32_t tag);
+    void answer(uint64_t clientId, uint64_t slot, uint32_t tag, uint8_t opcode, ServiceStatus status, Cents balance);
+    bool writeClient(Client& client);
+    bool writeShard(ShardLink& link);
+    void updateInterest(int fileDescriptor, uint64_t key, uint32_t& interest, uint32_t wanted);
+    void closeClient(Client* client);
+
+public:
+    explicit ShardRouter(const vector<string>& shardPaths);
+    ShardRouter(const ShardRouter&) = delete;
+    ShardRouter& operator=(const ShardRouter&) = delete;
+    ~ShardRouter();
+
+    // Reloads unconfirmed commit decisions, opens the decision log for appending
+    // and binds the client socket. Shards that are not up yet are retried.
+    bool open(const string& path, const string& decisionPath);
+    // Serves until stop becomes nonzero. Returns false if the decision log
+    // cannot be written; no commit is acknowledged without it.
+    bool run(const volatile sig_atomic_t& stop);
+    const ShardRouterStats& getStats() const { return stats; }
+    size_t getUnconfirmedTransfers() const { return transfers.size(); }
+};
+
+#endif
@@ -0,0 +1,317 @@
+#include "bank_service.h"
+
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+const size_t READ_CHUNK_BYTES = 64 * 1024;
+const size_t READ_BYTES_PER_PASS = 1024 * 1024;     // so one busy client cannot starve the rest
+const size_t OUTPUT_PAUSE_BYTES = 4 * 1024 * 1024;
+const int EVENTS_PER_WAIT = 256;
+
+const char* describeServiceStatus(ServiceStatus status) {
+    switch (status) {
+    case ServiceStatus::UnknownAccount: return "Unknown account";
+    case ServiceStatus::BadRequest: return "Bad request";
+    case ServiceStatus::ShardUnavailable: return "Shard unavailable";
+    case ServiceStatus::Ok:
+    case ServiceStatus::InvalidAmount:
+    case ServiceStatus::InsufficientFunds:
+    case ServiceStatus::SameAccount:
+    case ServiceStatus::Blocked:
+        return describeStatus((OperationStatus)status);
+    }
+    return "Unknown status";
+}
+
+int connectToService(const string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) return -1;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int descriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (descriptor < 0) return -1;
+    if (connect(descriptor, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(descriptor);
+        return -1;
+    }
+    return descriptor;
+}
+
+BankService::~BankService() {
+    for (auto& entry : connections) {
+        ::close(entry.first);
+        delete entry.second;
+    }
+    if (epollDescriptor >= 0) ::close(epollDescriptor);
+    if (listenDescriptor >= 0) {
+        ::close(listenDescriptor);
+        unlink(socketPath.c_str());
+    }
+}
+
+bool BankService::listen(const string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    struct stat existing;
+    if (stat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    listenDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenDescriptor < 0) return false;
+    if (bind(listenDescriptor, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(listenDescriptor);
+        listenDescriptor = -1;
+        return false;
+    }
+    socketPath = path;
+    epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (::listen(listenDescriptor, SOMAXCONN) != 0 || epollDescriptor < 0) return false;
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    return epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, listenDescriptor, &event) == 0;
+}
+
+void BankService::acceptConnections() {
+    while (true) {
+        int descriptor = accept4(listenDescriptor, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (descriptor < 0) return;
+
+        Connection* connection = new Connection();
+        connection->fileDescriptor = descriptor;
+        connection->outputSent = 0;
+        connection->interest = EPOLLIN;
+        connection->readPaused = false;
+        connection->closing = false;
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, descriptor, &event) != 0) {
+            ::close(descriptor);
+            delete connection;
+            continue;
+        }
+        connections[descriptor] = connection;
+        stats.connections++;
+    }
+}
+
+bool BankService::handleRequest(const ServiceRequest& request, string& output) {
+    ServiceResponse response = {};
+    response.tag = request.tag;
+    response.opcode = request.opcode;
+    ServiceStatus status = ServiceStatus::Ok;
+    bool mutated = false;
+    size_t headerOffset = output.size();
+    output.append(sizeof(response), '\0');
+
+    Account* account = bank.findAccountByNumber(request.account);
+    ServiceOpcode opcode = (ServiceOpcode)request.opcode;
+    if (opcode == ServiceOpcode::CommitTransfer || opcode == ServiceOpcode::AbortTransfer) {
+        // Resolving an id that is no longer pending is fine: the coordinator repeats itself after a failure
+        mutated = bank.resolveTransfer(request.transferId, opcode == ServiceOpcode::CommitTransfer);
+    } else if (opcode == ServiceOpcode::ListPending) {
+        vector<PendingTransfer> pending = bank.getPendingTransfers();
+        pending.resize(min<size_t>(pending.size(), 0xFFFF));
+        response.entryCount = (uint16_t)pending.size();
+        for (const PendingTransfer& transfer : pending) {
+            ServicePendingEntry entry = {};
+            entry.transferId = transfer.transferId;
+            entry.amount = transfer.amount;
+            entry.account = transfer.account;
+            entry.counterparty = transfer.counterparty;
+            entry.side = (uint8_t)transfer.side;
+            output.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        }
+    } else if (account == nullptr) {
+        status = ServiceStatus::UnknownAccount;
+    } else if (opcode == ServiceOpcode::Deposit || opcode == ServiceOpcode::Withdraw) {
+        OperationResult result = opcode == ServiceOpcode::Deposit ? account->deposit(request.amount)
+                                                                  : account->withdraw(request.amount);
+        status = (ServiceStatus)result.status;
+        response.balance = result.balance;
+        mutated = result.ok();
+    } else if (opcode == ServiceOpcode::Transfer) {
+        Account* target = bank.findAccountByNumber(request.target);
+        if (target == nullptr) {
+            status = ServiceStatus::UnknownAccount;
+        } else {
+            OperationResult result = account->transfer(*target, request.amount);
+            status = (ServiceStatus)result.status;
+            response.balance = result.balance;
+            mutated = result.ok();
+        }
+    } else if (opcode == ServiceOpcode::PrepareDebit || opcode == ServiceOpcode::PrepareCredit) {
+        TransactionType side = opcode == ServiceOpcode::PrepareDebit ? TransactionType::Debit : TransactionType::Credit;
+        OperationResult result = bank.prepareTransfer(request.transferId, side, *account, request.target,
+                                                      request.amount);
+        status = (ServiceStatus)result.status;
+        response.balance = result.balance;
+        mutated = result.ok();
+    } else if (opcode == ServiceOpcode::Balance) {
+        response.balance = account->getBalance();
+    } else if (opcode == ServiceOpcode::History && request.amount >= 0) {
+        historyScratch.clear();
+        account->getHistory((uint64_t)request.amount, min<size_t>(request.target, SERVICE_HISTORY_LIMIT),
+                            historyScratch);
+        response.balance = account->getBalance();
+        response.entryCount = (uint16_t)historyScratch.size();
+        for (const Transaction& transaction : historyScratch) {
+            ServiceHistoryEntry entry = {};
+            entry.transactionNumber = transaction.getTransactionNumber();
+            entry.timestampNs = transaction.getTimestampNs();
+            entry.amount = transaction.getAmount();
+            entry.descriptionId = transaction.getDescriptionId();
+            entry.counterparty = transaction.getCounterparty();
+            entry.type = (uint8_t)transaction.getTypeCode();
+            output.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        }
+    } else {
+        status = ServiceStatus::BadRequest;
+    }
+
+    response.status = (uint8_t)status;
+    memcpy(&output[headerOffset], &response, sizeof(response));
+    return mutated;
+}
+
+void BankService::readRequests(Connection& connection, bool& mutated) {
+    char buffer[READ_CHUNK_BYTES];
+    size_t readThisPass = 0;
+    while (readThisPass < READ_BYTES_PER_PASS) {
+        ssize_t received = ::read(connection.fileDescriptor, buffer, sizeof(buffer));
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) connection.closing = true;
+            return;
+        }
+        if (received == 0) {
+            connection.closing = true;
+            return;
+        }
+        readThisPass += (size_t)received;
+        stats.bytesIn += (uint64_t)received;
+
+        // Answer straight out of the read buffer; only a partial request is kept over
+        const char* data = buffer;
+        size_t available = (size_t)received;
+        if (!connection.input.empty()) {
+            connection.input.append(buffer, available);
+            data = connection.input.data();
+            available = connection.input.size();
+        }
+        size_t used = 0;
+        ServiceRequest request;
+        while (available - used >= sizeof(request)) {
+            memcpy(&request, data + used, sizeof(request));
+            mutated = handleRequest(request, connection.output) || mutated;
+            used += sizeof(request);
+            stats.requests++;
+        }
+        if (data == buffer) {
+            connection.input.assign(buffer + used, available - used);
+        } else {
+            connection.input.erase(0, used);
+        }
+
+        if (connection.output.size() - connection.outputSent >= OUTPUT_PAUSE_BYTES) {
+            connection.readPaused = true;
+            return;
+        }
+    }
+}
+
+bool BankService::writeResponses(Connection& connection) {
+    while (connection.outputSent < connection.output.size()) {
+        ssize_t sent = send(connection.fileDescriptor, connection.output.data() + connection.outputSent,
+                            connection.output.size() - connection.outputSent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection.outputSent += (size_t)sent;
+        stats.bytesOut += (uint64_t)sent;
+    }
+    connection.output.clear();
+    connection.outputSent = 0;
+    return true;
+}
+
+void BankService::updateInterest(Connection& connection) {
+    size_t unsent = connection.output.size() - connection.outputSent;
+    if (connection.readPaused && unsent < OUTPUT_PAUSE_BYTES / 2) {
+        connection.readPaused = false;
+    }
+    bool reading = !connection.readPaused && !connection.closing;
+    uint32_t wanted = (reading ? (uint32_t)EPOLLIN : 0) | (unsent > 0 ? (uint32_t)EPOLLOUT : 0);
+    if (wanted == connection.interest) return;
+
+    epoll_event event = {};
+    event.events = wanted;
+    event.data.ptr = &connection;
+    epoll_ctl(epollDescriptor, EPOLL_CTL_MOD, connection.fileDescriptor, &event);
+    connection.interest = wanted;
+}
+
+void BankService::closeConnection(Connection* connection) {
+    epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, connection->fileDescriptor, nullptr);
+    ::close(connection->fileDescriptor);
+    connections.erase(connection->fileDescriptor);
+    delete connection;
+}
+
+bool BankService::run(const volatile sig_atomic_t& stop) {
+    epoll_event events[EVENTS_PER_WAIT];
+    vector<Connection*> active;
+    while (stop == 0) {
+        int ready = epoll_wait(epollDescriptor, events, EVENTS_PER_WAIT, 100);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        active.clear();
+        bool mutated = false;
+        uint64_t requestsBefore = stats.requests;
+        for (int i = 0; i < ready; i++) {
+            Connection* connection = static_cast<Connection*>(events[i].data.ptr);
+            if (connection == nullptr) {
+                acceptConnections();
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                readRequests(*connection, mutated);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                connection->closing = true;
+            }
+            active.push_back(connection);
+        }
+        if (stats.requests != requestsBefore) {
+            stats.rounds++;
+        }
+
+        // One durable commit for every change made in this pass, before any of it is acknowledged
+        if (mutated) {
+            if (!bank.commitLedger()) return false;
+            stats.ledgerCommits++;
+        }
+        for (Connection* connection : active) {
+            // A client that shut down its sending side still gets what it asked for; it is
+            // closed once the socket has taken every answer, and only written to until then
+            if (!writeResponses(*connection) || (connection->closing && connection->output.empty())) {
+                closeConnection(connection);
+            } else {
+                updateInterest(*connection);
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,167 @@
+// Local socket service for the bank core. Clients connect to a Unix domain
+// socket and send fixed-size binary requests; the server answers each one in
+// order with a fixed-size response header, followed by history entries for a
+// history request. Clients may pipeline as many requests as they like without
+// waiting for answers. The load generator in bank_load.cpp speaks the same
+// protocol.
+#ifndef BANK_SERVICE_H
+#define BANK_SERVICE_H
+
+#include "bank_core.h"
+
+#include <csignal>
+
+enum class ServiceOpcode : uint8_t {
+    Deposit = 1,
+    Withdraw = 2,
+    Transfer = 3,
+    Balance = 4,
+    History = 5,
+    // Shard-side steps of a cross-shard transfer, sent by the shard router
+    PrepareDebit = 6,
+    PrepareCredit = 7,
+    CommitTransfer = 8,
+    AbortTransfer = 9,
+    ListPending = 10
+};
+
+// The first five values are OperationStatus; the rest are service-level failures
+enum class ServiceStatus : uint8_t {
+    Ok = 0,
+    InvalidAmount = 1,
+    InsufficientFunds = 2,
+    SameAccount = 3,
+    Blocked = 4,
+    UnknownAccount = 16,
+    BadRequest = 17,
+    ShardUnavailable = 18       // from the shard router: the owning shard is down
+};
+
+const char* describeServiceStatus(ServiceStatus status);
+
+// Connects a blocking stream socket to a service; -1 on failure
+int connectToService(const string& path);
+
+// Every request is the same 32 bytes, so the server can cut a read buffer into
+// requests without parsing lengths. Fields a request does not use must be zero.
+//   Deposit / Withdraw           account, amount
+//   Transfer                     account (from), target (to), amount
+//   Balance                      account
+//   History                      account, target = most entries wanted, amount = entries to skip from the newest
+//   PrepareDebit / PrepareCredit account (on this shard), target (the other side), amount, transferId
+//   CommitTransfer / AbortTransfer   transferId
+//   ListPending                  nothing; answered with ServicePendingEntry records
+struct ServiceRequest {
+    uint32_t tag;               // echoed back in the response
+    uint8_t opcode;
+    uint8_t reserved[3];
+    uint32_t account;           // account number value, e.g. 100042 for ACCT100042
+    uint32_t target;
+    Cents amount;
+    uint64_t transferId;
+};
+static_assert(sizeof(ServiceRequest) == 32, "ServiceRequest is a wire format");
+
+struct ServiceResponse {
+    uint32_t tag;
+    uint8_t status;             // ServiceStatus
+    uint8_t opcode;
+    uint16_t entryCount;        // ServiceHistoryEntry (or ServicePendingEntry) records that follow
+    Cents balance;              // balance afterwards (the source account for a transfer)
+};
+static_assert(sizeof(ServiceResponse) == 16, "ServiceResponse is a wire format");
+
+struct ServiceHistoryEntry {
+    uint64_t transactionNumber;
+    int64_t timestampNs;
+    Cents amount;
+    uint32_t descriptionId;
+    uint32_t counterparty;
+    uint8_t type;               // TransactionType
+    uint8_t reserved[7];
+};
+static_assert(sizeof(ServiceHistoryEntry) == 40, "ServiceHistoryEntry is a wire format");
+
+struct ServicePendingEntry {
+    uint64_t transferId;
+    Cents amount;
+    uint32_t account;
+    uint32_t counterparty;
+    uint8_t side;               // TransactionType
+    uint8_t reserved[7];
+};
+static_assert(sizeof(ServicePendingEntry) == 32, "ServicePendingEntry is a wire format");
+
+const size_t SERVICE_HISTORY_LIMIT = 1000;
+
+// Which of shardCount shards owns an account. The number is mixed first so
+// that consecutive account numbers spread evenly.
+inline uint32_t shardForAccount(uint32_t accountNumber, uint32_t shardCount) {
+    uint64_t mixed = accountNumber * 0x9E3779B97F4A7C15ULL;
+    mixed ^= mixed >> 29;
+    mixed *= 0xBF58476D1CE4E5B9ULL;
+    mixed ^= mixed >> 32;
+    return (uint32_t)(mixed % shardCount);
+}
+
+struct ServiceStats {
+    uint64_t connections = 0;
+    uint64_t requests = 0;
+    uint64_t rounds = 0;            // event-loop passes that answered at least one request
+    uint64_t ledgerCommits = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+};
+
+// Single-threaded epoll server. Each pass of the loop reads every ready
+// connection, runs all the complete requests it finds, commits the ledger log
+// once for the whole pass and only then writes the answers, so a response is
+// never sent for work that is not yet durable and one fdatasync covers every
+// client that was active in the pass.
+class BankService {
+private:
+    struct Connection {
+        int fileDescriptor;
+        string input;
+        string output;
+        size_t outputSent;
+        uint32_t interest;          // epoll events currently registered
+        bool readPaused;            // too much unsent output; stop reading until it drains
+        bool closing;               // peer hung up or failed; closed once its answers are sent
+    };
+
+    Bank& bank;
+    string socketPath;
+    int listenDescriptor;
+    int epollDescriptor;
+    unordered_map<int, Connection*> connections;
+    vector<Transaction> historyScratch;
+    ServiceStats stats;
+
+    void acceptConnections();
+    // Reads what is available and answers every complete request. Sets mutated
+    // when a request changed a balance and so needs a ledger commit.
+    void readRequests(Connection& connection, bool& mutated);
+    // Appends the answer to output; true when the request changed a balance
+    bool handleRequest(const ServiceRequest& request, string& output);
+    // Sends as much pending output as the socket takes; false on a write error
+    bool writeResponses(Connection& connection);
+    void updateInterest(Connection& connection);
+    void closeConnection(Connection* connection);
+
+public:
+    explicit BankService(Bank& bank) : bank(bank), listenDescriptor(-1), epollDescriptor(-1) {}
+    BankService(const BankService&) = delete;
+    BankService& operator=(const BankService&) = delete;
+    ~BankService();
+
+    // Binds the socket, replacing a stale socket file left by an earlier run
+    bool listen(const string& path);
+    // Serves until stop becomes nonzero (typically set by a signal handler); it is
+    // checked at least every 100 ms. Returns false if a ledger commit fails; the
+    // answers that were waiting on that commit are never sent.
+    bool run(const volatile sig_atomic_t& stop);
+    const ServiceStats& getStats() const { return stats; }
+};
+
+#endif